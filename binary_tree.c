@@ -2,6 +2,12 @@
  * Copyright (C) 2019 Santiago León O.
  */
 
+// Trees are kept balanced as AVL trees, so lookups and insertions are
+// O(log n) even when keys are inserted in order, like symbol ids that only
+// grow. The height of an AVL tree with n nodes is less than 1.45*log2(n+2),
+// so this is enough for any tree with less than 2^32 nodes.
+#define BINARY_TREE_MAX_HEIGHT 64
+
 #define BINARY_TREE_NEW(PREFIX,KEY_TYPE,VALUE_TYPE,CMP_A_TO_B)                                           \
                                                                                                          \
 struct PREFIX ## _tree_t {                                                                               \
@@ -10,6 +16,9 @@ struct PREFIX ## _tree_t {
     uint32_t num_nodes;                                                                                  \
                                                                                                          \
     struct PREFIX ## _tree_node_t *root;                                                                 \
+                                                                                                         \
+    /*Nodes of removed keys, linked through their right pointer.*/                                       \
+    struct PREFIX ## _tree_node_t *free_nodes;                                                           \
 };                                                                                                       \
                                                                                                          \
 /*Leftmost node will be the smallest.*/                                                                  \
@@ -20,6 +29,9 @@ struct PREFIX ## _tree_node_t {
                                                                                                          \
     struct PREFIX ## _tree_node_t *right;                                                                \
     struct PREFIX ## _tree_node_t *left;                                                                 \
+                                                                                                         \
+    /*Height of the subtree rooted at this node, leaves have height 1.*/                                 \
+    int height;                                                                                          \
 };                                                                                                       \
                                                                                                          \
 void PREFIX ## _tree_destroy (struct PREFIX ## _tree_t *tree)                                            \
@@ -29,63 +41,188 @@ void PREFIX ## _tree_destroy (struct PREFIX ## _tree_t *tree)
                                                                                                          \
 struct PREFIX ## _tree_node_t* PREFIX ## _tree_allocate_node (struct PREFIX ## _tree_t *tree)            \
 {                                                                                                        \
-    /* TODO: When we add removal of nodes, this should allocate them from a free
-    list of nodes.*/                                                                                     \
-    struct PREFIX ## _tree_node_t *new_node =                                                            \
-        mem_pool_push_struct (&tree->pool, struct PREFIX ## _tree_node_t);                               \
+    struct PREFIX ## _tree_node_t *new_node = tree->free_nodes;                                          \
+    if (new_node != NULL) {                                                                              \
+        tree->free_nodes = new_node->right;                                                              \
+    } else {                                                                                             \
+        new_node = mem_pool_push_struct (&tree->pool, struct PREFIX ## _tree_node_t);                    \
+    }                                                                                                    \
     *new_node = ZERO_INIT(struct PREFIX ## _tree_node_t);                                                \
     return new_node;                                                                                     \
 }                                                                                                        \
                                                                                                          \
+int PREFIX ## _tree_node_height (struct PREFIX ## _tree_node_t *node)                                    \
+{                                                                                                        \
+    return node == NULL ? 0 : node->height;                                                              \
+}                                                                                                        \
+                                                                                                         \
+void PREFIX ## _tree_node_update_height (struct PREFIX ## _tree_node_t *node)                            \
+{                                                                                                        \
+    node->height = 1 + MAX(PREFIX ## _tree_node_height (node->left),                                     \
+                           PREFIX ## _tree_node_height (node->right));                                   \
+}                                                                                                        \
+                                                                                                         \
+struct PREFIX ## _tree_node_t* PREFIX ## _tree_rotate_right (struct PREFIX ## _tree_node_t *node)        \
+{                                                                                                        \
+    struct PREFIX ## _tree_node_t *new_root = node->left;                                                \
+    node->left = new_root->right;                                                                        \
+    new_root->right = node;                                                                              \
+                                                                                                         \
+    PREFIX ## _tree_node_update_height (node);                                                           \
+    PREFIX ## _tree_node_update_height (new_root);                                                       \
+    return new_root;                                                                                     \
+}                                                                                                        \
+                                                                                                         \
+struct PREFIX ## _tree_node_t* PREFIX ## _tree_rotate_left (struct PREFIX ## _tree_node_t *node)         \
+{                                                                                                        \
+    struct PREFIX ## _tree_node_t *new_root = node->right;                                               \
+    node->right = new_root->left;                                                                        \
+    new_root->left = node;                                                                               \
+                                                                                                         \
+    PREFIX ## _tree_node_update_height (node);                                                           \
+    PREFIX ## _tree_node_update_height (new_root);                                                       \
+    return new_root;                                                                                     \
+}                                                                                                        \
+                                                                                                         \
+/*Restores the AVL property of a subtree whose children differ in height by                              \
+at most 2, returns the new root of the subtree.*/                                                        \
+struct PREFIX ## _tree_node_t* PREFIX ## _tree_rebalance (struct PREFIX ## _tree_node_t *node)           \
+{                                                                                                        \
+    PREFIX ## _tree_node_update_height (node);                                                           \
+                                                                                                         \
+    int balance = PREFIX ## _tree_node_height (node->left) - PREFIX ## _tree_node_height (node->right);  \
+    if (balance > 1) {                                                                                   \
+        if (PREFIX ## _tree_node_height (node->left->left) < PREFIX ## _tree_node_height (node->left->right)) { \
+            node->left = PREFIX ## _tree_rotate_left (node->left);                                       \
+        }                                                                                                \
+        node = PREFIX ## _tree_rotate_right (node);                                                      \
+                                                                                                         \
+    } else if (balance < -1) {                                                                           \
+        if (PREFIX ## _tree_node_height (node->right->right) < PREFIX ## _tree_node_height (node->right->left)) { \
+            node->right = PREFIX ## _tree_rotate_right (node->right);                                    \
+        }                                                                                                \
+        node = PREFIX ## _tree_rotate_left (node);                                                       \
+    }                                                                                                    \
+                                                                                                         \
+    return node;                                                                                         \
+}                                                                                                        \
+                                                                                                         \
 void PREFIX ## _tree_insert (struct PREFIX ## _tree_t *tree, KEY_TYPE key, VALUE_TYPE value)             \
 {                                                                                                        \
     bool key_found = false;                                                                              \
-    if (tree->root == NULL) {                                                                            \
-        struct PREFIX ## _tree_node_t *new_node = PREFIX ## _tree_allocate_node (tree);                  \
-        new_node->key = key;                                                                             \
-        new_node->value = value;                                                                         \
                                                                                                          \
-        tree->root = new_node;                                                                           \
+    /*Links traversed from the root to the insertion point, these are the only                           \
+    subtrees that can become unbalanced.*/                                                               \
+    int path_len = 0;                                                                                    \
+    struct PREFIX ## _tree_node_t **path[BINARY_TREE_MAX_HEIGHT];                                        \
+                                                                                                         \
+    struct PREFIX ## _tree_node_t **curr_node = &tree->root;                                             \
+    while (*curr_node != NULL) {                                                                         \
+        KEY_TYPE a = key;                                                                                \
+        KEY_TYPE b = (*curr_node)->key;                                                                  \
+        int c = CMP_A_TO_B;                                                                              \
+        if (c == 0) {                                                                                    \
+            /* Key already exists. Options of what we could do here:                                     \
+                                                                                                         \
+              - Assert that this will never happen.                                                      \
+              - Overwrite the existing value with the new one. The problem                               \
+                is if values are pointers in the future, then we could be                                \
+                leaking stuff without knowing?                                                           \
+              - Do nothing, but somehow let the caller know the key was                                  \
+                already there so we didn't insert the value they wanted.                                 \
+                                                                                                         \
+             I lean more towards the last option.*/                                                      \
+            key_found = true;                                                                            \
+            break;                                                                                       \
+        }                                                                                                \
+                                                                                                         \
+        path[path_len++] = curr_node;                                                                    \
+        if (c < 0) {                                                                                     \
+            curr_node = &(*curr_node)->left;                                                             \
+        } else {                                                                                         \
+            curr_node = &(*curr_node)->right;                                                            \
+        }                                                                                                \
+    }                                                                                                    \
+                                                                                                         \
+    if (!key_found) {                                                                                    \
+        *curr_node = PREFIX ## _tree_allocate_node (tree);                                               \
+        (*curr_node)->key = key;                                                                         \
+        (*curr_node)->value = value;                                                                     \
+        (*curr_node)->height = 1;                                                                        \
+                                                                                                         \
         tree->num_nodes++;                                                                               \
                                                                                                          \
-    } else {                                                                                             \
-        struct PREFIX ## _tree_node_t **curr_node = &tree->root;                                         \
-        while (!key_found && *curr_node != NULL) {                                                       \
-            KEY_TYPE a = key;                                                                            \
-            KEY_TYPE b = (*curr_node)->key;                                                              \
-            int c = CMP_A_TO_B;                                                                          \
-            if (c < 0) {                                                                                 \
-                curr_node = &(*curr_node)->left;                                                         \
-                                                                                                         \
-            } else if (c > 0) {                                                                          \
-                curr_node = &(*curr_node)->right;                                                        \
-                                                                                                         \
-            } else {                                                                                     \
-                /* Key already exists. Options of what we could do here:
-
-                  - Assert that this will never happen.
-                  - Overwrite the existing value with the new one. The problem
-                    is if values are pointers in the future, then we could be
-                    leaking stuff without knowing?
-                  - Do nothing, but somehow let the caller know the key was
-                    already there so we didn't insert the value they wanted.
-
-                 I lean more towards the last option.*/                                                  \
-                key_found = true;                                                                        \
-                break;                                                                                   \
-            }                                                                                            \
+        while (path_len > 0) {                                                                           \
+            struct PREFIX ## _tree_node_t **link = path[--path_len];                                     \
+            int old_height = (*link)->height;                                                            \
+            *link = PREFIX ## _tree_rebalance (*link);                                                   \
+                                                                                                         \
+            /*After an insertion at most one rebalance is needed, once a subtree                         \
+            keeps its height nothing above it changes.*/                                                 \
+            if ((*link)->height == old_height) break;                                                    \
+        }                                                                                                \
+    }                                                                                                    \
+}                                                                                                        \
+                                                                                                         \
+/*Removes the node with the passed key, returns false if there is none. Nodes                            \
+are reused by later insertions, so pointers to nodes are only valid until the                            \
+tree is changed.*/                                                                                       \
+bool PREFIX ## _tree_remove (struct PREFIX ## _tree_t *tree, KEY_TYPE key)                               \
+{                                                                                                        \
+    bool key_found = false;                                                                              \
+                                                                                                         \
+    int path_len = 0;                                                                                    \
+    struct PREFIX ## _tree_node_t **path[BINARY_TREE_MAX_HEIGHT];                                        \
+                                                                                                         \
+    struct PREFIX ## _tree_node_t **curr_node = &tree->root;                                             \
+    while (*curr_node != NULL) {                                                                         \
+        KEY_TYPE a = key;                                                                                \
+        KEY_TYPE b = (*curr_node)->key;                                                                  \
+        int c = CMP_A_TO_B;                                                                              \
+        if (c == 0) {                                                                                    \
+            key_found = true;                                                                            \
+            break;                                                                                       \
+        }                                                                                                \
+                                                                                                         \
+        path[path_len++] = curr_node;                                                                    \
+        if (c < 0) {                                                                                     \
+            curr_node = &(*curr_node)->left;                                                             \
+        } else {                                                                                         \
+            curr_node = &(*curr_node)->right;                                                            \
         }                                                                                                \
+    }                                                                                                    \
                                                                                                          \
-        if (!key_found) {                                                                                \
-            *curr_node = PREFIX ## _tree_allocate_node (tree);                                           \
-            (*curr_node)->key = key;                                                                     \
-            (*curr_node)->value = value;                                                                 \
+    if (key_found) {                                                                                     \
+        struct PREFIX ## _tree_node_t *removed = *curr_node;                                             \
+        if (removed->left != NULL && removed->right != NULL) {                                           \
+            /*Move the entry of the successor here and remove its node instead,                          \
+            it has no left child.*/                                                                      \
+            path[path_len++] = curr_node;                                                                \
+            struct PREFIX ## _tree_node_t **successor = &removed->right;                                 \
+            while ((*successor)->left != NULL) {                                                         \
+                path[path_len++] = successor;                                                            \
+                successor = &(*successor)->left;                                                         \
+            }                                                                                            \
                                                                                                          \
-            tree->num_nodes++;                                                                           \
+            removed->key = (*successor)->key;                                                            \
+            removed->value = (*successor)->value;                                                        \
+            curr_node = successor;                                                                       \
+            removed = *successor;                                                                        \
         }                                                                                                \
+        *curr_node = removed->left != NULL ? removed->left : removed->right;                             \
+                                                                                                         \
+        removed->right = tree->free_nodes;                                                               \
+        tree->free_nodes = removed;                                                                      \
+        tree->num_nodes--;                                                                               \
                                                                                                          \
-        /* TODO: Rebalance the tree.*/                                                                   \
+        /*Unlike insertion, a removal can require a rebalance at each level.*/                           \
+        while (path_len > 0) {                                                                           \
+            struct PREFIX ## _tree_node_t **link = path[--path_len];                                     \
+            *link = PREFIX ## _tree_rebalance (*link);                                                   \
+        }                                                                                                \
     }                                                                                                    \
+                                                                                                         \
+    return key_found;                                                                                    \
 }                                                                                                        \
                                                                                                          \
 bool PREFIX ## _tree_lookup (struct PREFIX ## _tree_t *tree,                                             \
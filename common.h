@@ -19,6 +19,9 @@
 #include <dirent.h>
 #include <locale.h>
 #include <float.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #ifdef __cplusplus
 #define ZERO_INIT(type) (type){}
@@ -1981,17 +1984,21 @@ void cont_buff_destroy (cont_buff_t *buff)
 }
 
 // Memory pool that grows as needed, and can be freed easily.
+//
+// Sizes are 64 bit so a single allocation (or bin) can be larger than 4GB,
+// which happens when building arrays indexed by symbol for systems with
+// millions of symbols.
 #define MEM_POOL_DEFAULT_MIN_BIN_SIZE 1024u
 typedef struct {
-    uint32_t min_bin_size;
-    uint32_t size;
-    uint32_t used;
+    uint64_t min_bin_size;
+    uint64_t size;
+    uint64_t used;
     void *base;
 
     // total_data is the total used memory minus the memory used for
     // on_destroy_callback_info_t structs. We use this variable to compute the
     // ammount of empty space left in previous bins.
-    uint32_t total_data;
+    uint64_t total_data;
     uint32_t num_bins;
 } mem_pool_t;
 
@@ -2032,7 +2039,7 @@ struct on_destroy_callback_info_t {
 
 struct _bin_info_t {
     void *base;
-    uint32_t size;
+    uint64_t size;
     struct _bin_info_t *prev_bin_info;
 
     struct on_destroy_callback_info_t *last_cb_info;
@@ -2069,12 +2076,12 @@ enum alloc_opts {
 #define mem_pool_push_size(pool,size) mem_pool_push_size_full(pool,size,POOL_UNINITIALIZED,NULL,NULL)
 #define mem_pool_push_struct(pool,type) ((type*)mem_pool_push_size(pool,sizeof(type)))
 #define mem_pool_push_array(pool,n,type) mem_pool_push_size(pool,(n)*sizeof(type))
-void* mem_pool_push_size_full (mem_pool_t *pool, uint32_t size, enum alloc_opts opts,
+void* mem_pool_push_size_full (mem_pool_t *pool, uint64_t size, enum alloc_opts opts,
                                mem_pool_on_destroy_callback_t *cb, void *clsr)
 {
     assert (pool != NULL);
 
-    uint32_t required_size = cb == NULL ? size : size + sizeof(struct on_destroy_callback_info_t);
+    uint64_t required_size = cb == NULL ? size : size + sizeof(struct on_destroy_callback_info_t);
 
     if (required_size == 0) return NULL;
 
@@ -2087,7 +2094,10 @@ void* mem_pool_push_size_full (mem_pool_t *pool, uint32_t size, enum alloc_opts
             pool->min_bin_size = MEM_POOL_DEFAULT_MIN_BIN_SIZE;
         }
 
-        int new_bin_size = MAX(pool->min_bin_size, required_size);
+        // Bin info goes right after the data, its size is rounded up so
+        // the info stays aligned even if required_size is odd.
+        uint64_t new_bin_size = MAX(pool->min_bin_size, required_size);
+        new_bin_size = (new_bin_size + __alignof__(bin_info_t) - 1) & ~((uint64_t)__alignof__(bin_info_t) - 1);
         void *new_bin;
         bin_info_t *new_info;
         if ((new_bin = malloc (new_bin_size + sizeof(bin_info_t)))) {
@@ -2135,6 +2145,21 @@ void* mem_pool_push_size_full (mem_pool_t *pool, uint32_t size, enum alloc_opts
     return ret;
 }
 
+// Pushes never pad allocations, so arrays of 8 byte types pushed after ones of
+// smaller types may be misaligned. This variant pads the current bin so the
+// result is aligned to alignment, which must be a power of 2 not larger than
+// the alignment of malloc().
+#define mem_pool_push_struct_aligned(pool,type) ((type*)mem_pool_push_size_aligned(pool,sizeof(type),__alignof__(type)))
+#define mem_pool_push_array_aligned(pool,n,type) mem_pool_push_size_aligned(pool,(n)*sizeof(type),__alignof__(type))
+void* mem_pool_push_size_aligned (mem_pool_t *pool, uint64_t size, uint64_t alignment)
+{
+    uint64_t padding = (alignment - ((uintptr_t)pool->base + pool->used) % alignment) % alignment;
+    if (pool->used + padding + size <= pool->size) {
+        pool->used += padding;
+    }
+    return mem_pool_push_size (pool, size);
+}
+
 // NOTE: Do NOT use _pool_ again after calling this. We don't reset pool because
 // it could have been bootstrapped into itself. Reusing is better hendled by
 // mem_pool_end_temporary_memory().
@@ -2167,7 +2192,7 @@ void mem_pool_destroy (mem_pool_t *pool)
     }
 }
 
-uint32_t mem_pool_allocated (mem_pool_t *pool)
+uint64_t mem_pool_allocated (mem_pool_t *pool)
 {
     uint64_t allocated = 0;
     if (pool->base != NULL) {
@@ -2182,7 +2207,7 @@ uint32_t mem_pool_allocated (mem_pool_t *pool)
 
 // Computes how much memory of the pool is used to store
 // on_destroy_callback_info_t structutres.
-uint32_t mem_pool_callback_info (mem_pool_t *pool)
+uint64_t mem_pool_callback_info (mem_pool_t *pool)
 {
     uint64_t callback_info_size = 0;
     if (pool->base != NULL) {
@@ -2205,16 +2230,16 @@ uint32_t mem_pool_callback_info (mem_pool_t *pool)
 // mem_pool_callback_info().
 void mem_pool_print (mem_pool_t *pool)
 {
-    uint32_t allocated = mem_pool_allocated(pool);
-    printf ("Allocated: %u bytes\n", allocated);
+    uint64_t allocated = mem_pool_allocated(pool);
+    printf ("Allocated: %lu bytes\n", allocated);
 
-    uint32_t available = pool->size-pool->used;
-    printf ("Available: %u bytes (%.2f%%)\n", available, ((double)available*100)/allocated);
+    uint64_t available = pool->size-pool->used;
+    printf ("Available: %lu bytes (%.2f%%)\n", available, ((double)available*100)/allocated);
 
-    printf ("Data: %u bytes (%.2f%%)\n", pool->total_data, ((double)pool->total_data*100)/allocated);
+    printf ("Data: %lu bytes (%.2f%%)\n", pool->total_data, ((double)pool->total_data*100)/allocated);
 
-    uint32_t callback_info_size = mem_pool_callback_info (pool);
-    printf ("Callback Info: %u bytes (%.2f%%)\n", callback_info_size, ((double)callback_info_size*100)/allocated);
+    uint64_t callback_info_size = mem_pool_callback_info (pool);
+    printf ("Callback Info: %lu bytes (%.2f%%)\n", callback_info_size, ((double)callback_info_size*100)/allocated);
 
     uint64_t info_size = pool->num_bins*sizeof(bin_info_t);
     printf ("Info: %lu bytes (%.2f%%)\n", info_size, ((double)info_size*100)/allocated);
@@ -2237,8 +2262,8 @@ void mem_pool_print (mem_pool_t *pool)
 typedef struct {
     mem_pool_t *pool;
     void* base;
-    uint32_t used;
-    uint32_t total_data;
+    uint64_t used;
+    uint64_t total_data;
 } mem_pool_marker_t;
 
 mem_pool_marker_t mem_pool_begin_temporary_memory (mem_pool_t *pool)
@@ -2331,7 +2356,7 @@ char* pom_strndup (mem_pool_t *pool, const char *str, uint32_t str_len)
 }
 
 static inline
-void* pom_dup (mem_pool_t *pool, void *data, uint32_t size)
+void* pom_dup (mem_pool_t *pool, void *data, uint64_t size)
 {
     void *res = pom_push_size (pool, size);
     memcpy (res, data, size);
@@ -3044,6 +3069,24 @@ bool download_file (const char *url, char *path)
 }
 #endif
 
+///////////////
+//
+//  TIMING
+//
+//  Wall clock time from a monotonic clock, in milliseconds. Only differences
+//  between two calls are meaningful.
+//
+//  double start = wall_time_ms ();
+//  ...
+//  double elapsed = wall_time_ms () - start;
+
+double wall_time_ms (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec*1000 + (double)ts.tv_nsec/1000000;
+}
+
 ///////////////
 //
 //  THREADING
@@ -3059,6 +3102,294 @@ void end_mutex (volatile int *lock) {
     *lock = 0;
 }
 
+//  Work stealing thread pool
+//
+//  Work is submitted in batches with thread_pool_run(), which returns after all
+//  tasks have been executed. Tasks are distributed round robin into a deque
+//  owned by each worker, workers pop tasks from the bottom of their own deque
+//  and when it's empty they steal from the top of the other ones (Chase-Lev
+//  deque). The thread calling thread_pool_run() acts as worker 0.
+//
+//  Each worker has its own memory pool that tasks can use as scratch space.
+//  It's never reset by the thread pool, tasks are expected to use temporary
+//  memory markers so that memory gets reused across tasks and batches.
+//
+//  Usage:
+//
+//  THREAD_POOL_TASK (my_task)
+//  {
+//      struct my_data_t *my_data = (struct my_data_t*)data;
+//      mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (&worker->pool);
+//      ...
+//      mem_pool_end_temporary_memory (mrkr);
+//  }
+//
+//  {
+//      struct thread_pool_t pool = {0};
+//      thread_pool_init (&pool, 0); // 0 means one worker per core
+//
+//      struct thread_pool_task_info_t tasks[N];
+//      for (int i=0; i<N; i++) {
+//          tasks[i].task = my_task;
+//          tasks[i].data = &my_data[i];
+//      }
+//      thread_pool_run (&pool, tasks, N);
+//
+//      thread_pool_destroy (&pool);
+//  }
+struct thread_pool_worker_t;
+
+#define THREAD_POOL_TASK(name) void name(struct thread_pool_worker_t *worker, void *data)
+typedef THREAD_POOL_TASK(thread_pool_task_t);
+
+struct thread_pool_task_info_t {
+    thread_pool_task_t *task;
+    void *data;
+};
+
+struct work_deque_t {
+    volatile int64_t top;
+    volatile int64_t bottom;
+
+    // Power of two. Deques aren't resized while a batch runs, all tasks are
+    // pushed before workers are woken up.
+    int64_t capacity;
+    struct thread_pool_task_info_t *tasks;
+};
+
+struct thread_pool_t;
+
+struct thread_pool_worker_t {
+    int id;
+    struct thread_pool_t *thread_pool;
+    pthread_t thread;
+
+    struct work_deque_t deque;
+    mem_pool_t pool;
+};
+
+struct thread_pool_t {
+    int num_workers;
+    struct thread_pool_worker_t *workers;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t batch_start;
+    pthread_cond_t batch_end;
+
+    uint64_t generation;
+    int num_idle;
+    bool quit;
+
+    volatile int64_t remaining_tasks;
+};
+
+static inline
+void work_deque_push (struct work_deque_t *deque, struct thread_pool_task_info_t task)
+{
+    int64_t b = __atomic_load_n (&deque->bottom, __ATOMIC_RELAXED);
+    deque->tasks[b & (deque->capacity-1)] = task;
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    __atomic_store_n (&deque->bottom, b+1, __ATOMIC_RELAXED);
+}
+
+// Only called by the owner of the deque.
+static inline
+bool work_deque_pop (struct work_deque_t *deque, struct thread_pool_task_info_t *task)
+{
+    bool found = false;
+    int64_t b = __atomic_load_n (&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n (&deque->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n (&deque->top, __ATOMIC_RELAXED);
+
+    if (t <= b) {
+        *task = deque->tasks[b & (deque->capacity-1)];
+        found = true;
+
+        if (t == b) {
+            // Last task, race against thieves for it.
+            if (!__atomic_compare_exchange_n (&deque->top, &t, t+1, false,
+                                              __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                found = false;
+            }
+            __atomic_store_n (&deque->bottom, b+1, __ATOMIC_RELAXED);
+        }
+
+    } else {
+        __atomic_store_n (&deque->bottom, b+1, __ATOMIC_RELAXED);
+    }
+
+    return found;
+}
+
+// Called by any worker other than the owner.
+static inline
+bool work_deque_steal (struct work_deque_t *deque, struct thread_pool_task_info_t *task)
+{
+    int64_t t = __atomic_load_n (&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n (&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (t < b) {
+        struct thread_pool_task_info_t stolen = deque->tasks[t & (deque->capacity-1)];
+        if (__atomic_compare_exchange_n (&deque->top, &t, t+1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            *task = stolen;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Executes tasks until the current batch has no remaining ones.
+void thread_pool_work (struct thread_pool_worker_t *worker)
+{
+    struct thread_pool_t *thread_pool = worker->thread_pool;
+
+    while (__atomic_load_n (&thread_pool->remaining_tasks, __ATOMIC_ACQUIRE) > 0) {
+        struct thread_pool_task_info_t task;
+        bool found = work_deque_pop (&worker->deque, &task);
+
+        for (int i=1; !found && i<thread_pool->num_workers; i++) {
+            struct thread_pool_worker_t *victim =
+                &thread_pool->workers[(worker->id + i) % thread_pool->num_workers];
+            found = work_deque_steal (&victim->deque, &task);
+        }
+
+        if (found) {
+            task.task (worker, task.data);
+            __atomic_sub_fetch (&thread_pool->remaining_tasks, 1, __ATOMIC_RELEASE);
+
+        } else {
+            // Other workers are running the last tasks.
+            sched_yield ();
+        }
+    }
+}
+
+void* thread_pool_worker_main (void *arg)
+{
+    struct thread_pool_worker_t *worker = (struct thread_pool_worker_t*)arg;
+    struct thread_pool_t *thread_pool = worker->thread_pool;
+
+    uint64_t generation = 0;
+    while (true) {
+        pthread_mutex_lock (&thread_pool->mutex);
+        thread_pool->num_idle++;
+        pthread_cond_signal (&thread_pool->batch_end);
+        while (!thread_pool->quit && thread_pool->generation == generation) {
+            pthread_cond_wait (&thread_pool->batch_start, &thread_pool->mutex);
+        }
+        generation = thread_pool->generation;
+        thread_pool->num_idle--;
+        bool quit = thread_pool->quit;
+        pthread_mutex_unlock (&thread_pool->mutex);
+
+        if (quit) break;
+
+        thread_pool_work (worker);
+    }
+
+    return NULL;
+}
+
+// If num_workers is 0 one worker per online processor is created. Worker 0 is
+// the thread calling thread_pool_run(), so num_workers-1 threads are created.
+void thread_pool_init (struct thread_pool_t *thread_pool, int num_workers)
+{
+    if (num_workers <= 0) {
+        num_workers = sysconf (_SC_NPROCESSORS_ONLN);
+        if (num_workers <= 0) num_workers = 1;
+    }
+
+    *thread_pool = ZERO_INIT (struct thread_pool_t);
+    thread_pool->num_workers = num_workers;
+    thread_pool->workers = calloc (num_workers, sizeof(struct thread_pool_worker_t));
+    pthread_mutex_init (&thread_pool->mutex, NULL);
+    pthread_cond_init (&thread_pool->batch_start, NULL);
+    pthread_cond_init (&thread_pool->batch_end, NULL);
+
+    for (int i=0; i<num_workers; i++) {
+        struct thread_pool_worker_t *worker = &thread_pool->workers[i];
+        worker->id = i;
+        worker->thread_pool = thread_pool;
+    }
+
+    for (int i=1; i<num_workers; i++) {
+        pthread_create (&thread_pool->workers[i].thread, NULL,
+                        thread_pool_worker_main, &thread_pool->workers[i]);
+    }
+}
+
+void thread_pool_run (struct thread_pool_t *thread_pool, struct thread_pool_task_info_t *tasks, int num_tasks)
+{
+    if (num_tasks == 0) return;
+
+    // Wait for all workers to be idle before touching their deques.
+    pthread_mutex_lock (&thread_pool->mutex);
+    while (thread_pool->num_idle < thread_pool->num_workers-1) {
+        pthread_cond_wait (&thread_pool->batch_end, &thread_pool->mutex);
+    }
+
+    int64_t capacity = 1;
+    while (capacity < num_tasks/thread_pool->num_workers + 1) capacity *= 2;
+
+    for (int i=0; i<thread_pool->num_workers; i++) {
+        struct work_deque_t *deque = &thread_pool->workers[i].deque;
+        if (deque->capacity < capacity) {
+            free (deque->tasks);
+            deque->tasks = malloc (capacity*sizeof(struct thread_pool_task_info_t));
+            deque->capacity = capacity;
+        }
+        deque->top = 0;
+        deque->bottom = 0;
+    }
+
+    // Push in reverse so workers pop tasks in the order they were passed.
+    for (int i=num_tasks-1; i>=0; i--) {
+        work_deque_push (&thread_pool->workers[i % thread_pool->num_workers].deque, tasks[i]);
+    }
+
+    thread_pool->remaining_tasks = num_tasks;
+    thread_pool->generation++;
+    pthread_cond_broadcast (&thread_pool->batch_start);
+    pthread_mutex_unlock (&thread_pool->mutex);
+
+    thread_pool_work (&thread_pool->workers[0]);
+
+    pthread_mutex_lock (&thread_pool->mutex);
+    while (thread_pool->num_idle < thread_pool->num_workers-1) {
+        pthread_cond_wait (&thread_pool->batch_end, &thread_pool->mutex);
+    }
+    pthread_mutex_unlock (&thread_pool->mutex);
+}
+
+void thread_pool_destroy (struct thread_pool_t *thread_pool)
+{
+    if (thread_pool->workers == NULL) return;
+
+    pthread_mutex_lock (&thread_pool->mutex);
+    thread_pool->quit = true;
+    pthread_cond_broadcast (&thread_pool->batch_start);
+    pthread_mutex_unlock (&thread_pool->mutex);
+
+    for (int i=1; i<thread_pool->num_workers; i++) {
+        pthread_join (thread_pool->workers[i].thread, NULL);
+    }
+
+    for (int i=0; i<thread_pool->num_workers; i++) {
+        free (thread_pool->workers[i].deque.tasks);
+        mem_pool_destroy (&thread_pool->workers[i].pool);
+    }
+
+    pthread_mutex_destroy (&thread_pool->mutex);
+    pthread_cond_destroy (&thread_pool->batch_start);
+    pthread_cond_destroy (&thread_pool->batch_end);
+    free (thread_pool->workers);
+    *thread_pool = ZERO_INIT (struct thread_pool_t);
+}
+
 ///////////////////////
 //
 //   SHARED VARIABLE
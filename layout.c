@@ -0,0 +1,453 @@
+/*
+ * Copyright (C) 2020 Santiago León O.
+ */
+
+// Layout entities and the functions that translate them into equations of a
+// linear system. This doesn't depend on GTK so it can be used by the layouter
+// and by benchmarks, it expects common.h and linear_solver.c to be included
+// before.
+
+// These are the kinds of things that can be added to the layout
+#define TK_ENTITY_TYPE_TABLE \
+    TK_ENTITY_TYPE_ROW (TK_RECTANGLE, "rectangle") \
+    TK_ENTITY_TYPE_ROW (TK_LINK, "link")
+
+#define TK_ENTITY_TYPE_ROW(v1, v2) v1,
+enum entity_type_t {
+    TK_ENTITY_TYPE_TABLE
+};
+#undef TK_ENTITY_TYPE_ROW
+
+#define TK_ENTITY_TYPE_ROW(v1, v2) v2,
+char *entity_type_names[] = {
+    TK_ENTITY_TYPE_TABLE
+};
+#undef TK_ENTITY_TYPE_ROW
+
+// A feature is some quantity of an entity that will be represented by a symbol
+// in the linear system of equations
+#define TK_FEATURE_TABLE \
+    TK_FEATURE_ROW (TK_MIN, "min")   \
+    TK_FEATURE_ROW (TK_B, "b")       \
+    TK_FEATURE_ROW (TK_MAX, "max")   \
+    TK_FEATURE_ROW (TK_D, "d")       \
+    TK_FEATURE_ROW (TK_SIZE, "size") \
+                                     \
+    TK_FEATURE_ROW (TK_DX, "dx")     \
+    TK_FEATURE_ROW (TK_DY, "dy")
+
+#define TK_FEATURE_ROW(v1,v2) v1,
+enum feature_identifier_t {
+    TK_FEATURE_TABLE
+};
+#undef TK_FEATURE_ROW
+
+#define TK_FEATURE_ROW(v1,v2) v2,
+char *feature_names[] = {
+    TK_FEATURE_TABLE
+};
+#undef TK_FEATURE_ROW
+
+enum axis_t {
+    TK_X,
+    TK_Y
+};
+
+char *axis_names[] = {"x", "y"};
+
+struct entity_definition_t {
+    enum entity_type_t type;
+    enum feature_identifier_t *features;
+};
+
+struct feature_t {
+    enum entity_type_t type;
+    uint64_t id;
+    enum feature_identifier_t feature;
+    enum axis_t axis;
+};
+
+struct entity_t {
+    enum entity_type_t type;
+    uint64_t id;
+    struct entity_t *next;
+};
+
+// This sets the passed string_t to be the name of the wvariable used in the
+// system of equations to represent the passed feature parameters. It's useful
+// to the user if they are adding equations that relate to layout entities.
+void str_set_feature_name (string_t *str,
+                           uint64_t id,
+                           enum feature_identifier_t feature_name,
+                           enum axis_t axis)
+{
+    // TODO: Check the passed features are valid
+    str_set_printf (str, "%ld.%s.%s", id, feature_names[feature_name], axis_names[axis]);
+}
+
+// Even though we provide a convenient API for adding entities, we want to
+// expose the full flexibility of defining relationships through equations. This
+// means we want the user to be able to add expressions to the system directly,
+// in a way that our render understands. To do this, users can add equations
+// with symbols in the following syntax:
+//
+//    {entity_type}_{id}.{feature_name}.{axis}
+//
+// NOTE: The {id} part is just an integer number used to differentiate multiple
+// entities of the same type. This never creates an actual entity object.
+//
+// NOTE: This is only to let the user add equations that represent internal
+// entitites, and are drawn by the renderer. This is not a restrictive syntax,
+// users can add symbols not adhering to it. For example, they can add their own
+// features.
+//
+// This function parses the user feature syntax and populates a struct with the
+// parsed data. If the name doesn't follow the syntax or the feature is not
+// valid false is returned.
+bool get_user_feature (char *name, struct feature_t *feature)
+{
+    assert (name != NULL && feature != NULL);
+
+    struct feature_t _l_feature = {0};
+    struct feature_t *l_feature = &_l_feature;
+
+    bool success = true;
+    struct scanner_t _scnr = {0};
+    struct scanner_t *scnr = &_scnr;
+    scnr->pos = name;
+
+    bool type_found = false;
+    for (int type_enum=0; type_enum<ARRAY_SIZE(entity_type_names); type_enum++) {
+        if (scanner_str (scnr, entity_type_names[type_enum])) {
+            l_feature->type = type_enum;
+            type_found = true;
+            break;
+        }
+    }
+
+    if (!type_found) {
+        success = false;
+    }
+
+    if (success) {
+        int id;
+        if (scanner_char(scnr, '_') && scanner_int (scnr, &id)) {
+            l_feature->id = id;
+        }
+    }
+
+    // TODO: Check that the entity type does have the found l_feature
+    if (success) {
+        if (scanner_char(scnr, '.')) {
+            bool feature_found = false;
+            for (int feature_enum=0; feature_enum<ARRAY_SIZE(feature_names); feature_enum++) {
+                if (scanner_str (scnr, feature_names[feature_enum])) {
+                    l_feature->feature = feature_enum;
+                    feature_found = true;
+                    break;
+                }
+            }
+
+            if (!feature_found) {
+                success = false;
+            }
+        }
+    }
+
+    if (success) {
+        if (scanner_char(scnr, '.')) {
+            bool axis_found = false;
+            for (int axis_enum=0; axis_enum<ARRAY_SIZE(axis_names); axis_enum++) {
+                if (scanner_str (scnr, axis_names[axis_enum])) {
+                    l_feature->axis = axis_enum;
+                    axis_found = true;
+                    break;
+                }
+            }
+
+            if (!axis_found) {
+                success = false;
+            }
+        }
+    }
+
+    if (success) {
+        *feature = *l_feature;
+    }
+
+    return success;
+}
+
+// Like str_set_feature_name() but writes the name of a symbol that uses the
+// user syntax.
+void str_set_user_feature_name (string_t *str,
+                                enum entity_type_t type,
+                                uint64_t id,
+                                enum feature_identifier_t feature_name,
+                                enum axis_t axis)
+{
+    // TODO: Check the passed features are valid
+    str_set_printf (str, "%s_%ld.%s.%s", entity_type_names[type], id, feature_names[feature_name], axis_names[axis]);
+}
+
+struct layout_t {
+    mem_pool_t pool;
+
+    uint64_t next_id;
+
+    struct linear_system_t system;
+
+    struct entity_t *rectangles;
+
+    // Handles of the symbols that represent features of entities, indexed by
+    // FEATURE_SYMBOL_IDX(). Entries for symbols that haven't been created yet
+    // are NO_SYMBOL.
+    uint64_t num_feature_symbols;
+    symbol_handle_t *feature_symbols;
+};
+
+#define NO_SYMBOL UINT64_MAX
+#define FEATURE_SYMBOL_IDX(id,feature,axis) \
+    (((id)*ARRAY_SIZE(feature_names) + (feature))*ARRAY_SIZE(axis_names) + (axis))
+
+// Returns the handle of the symbol that represents the feature of an entity.
+// The symbol is created the first time a feature is used, that's the only time
+// its name is formatted, after that everything uses the handle.
+symbol_handle_t layout_symbol (struct layout_t *layout, uint64_t id,
+                               enum feature_identifier_t feature, enum axis_t axis)
+{
+    uint64_t idx = FEATURE_SYMBOL_IDX (id, feature, axis);
+    if (idx >= layout->num_feature_symbols) {
+        uint64_t new_size = MAX (2*layout->num_feature_symbols, FEATURE_SYMBOL_IDX (id+1, 0, 0));
+        layout->feature_symbols = realloc (layout->feature_symbols, new_size*sizeof(symbol_handle_t));
+        for (uint64_t i=layout->num_feature_symbols; i<new_size; i++) {
+            layout->feature_symbols[i] = NO_SYMBOL;
+        }
+        layout->num_feature_symbols = new_size;
+    }
+
+    if (layout->feature_symbols[idx] == NO_SYMBOL) {
+        string_t name = {0};
+        str_set_feature_name (&name, id, feature, axis);
+        layout->feature_symbols[idx] = solver_symbol_get_or_create (&layout->system, str_data(&name));
+        str_free (&name);
+    }
+
+    return layout->feature_symbols[idx];
+}
+
+double layout_value (struct layout_t *layout, uint64_t id,
+                     enum feature_identifier_t feature, enum axis_t axis)
+{
+    return solver_symbol_value (&layout->system, layout_symbol (layout, id, feature, axis));
+}
+
+void layout_destroy (struct layout_t *layout)
+{
+    solver_destroy (&layout->system);
+    free (layout->feature_symbols);
+    mem_pool_destroy (&layout->pool);
+}
+
+// Adds the equation 'a + b - c = 0' between features of entities, along the
+// passed axis. This is the shape of all equations generated by the layout
+// functions.
+void layout_sum (struct layout_t *layout, enum axis_t axis,
+                 uint64_t id_a, enum feature_identifier_t feature_a,
+                 uint64_t id_b, enum feature_identifier_t feature_b,
+                 uint64_t id_c, enum feature_identifier_t feature_c)
+{
+    struct linear_system_t *system = &layout->system;
+    solver_expr_begin (system);
+    solver_expr_add_term (system, layout_symbol (layout, id_a, feature_a, axis), 1);
+    solver_expr_add_term (system, layout_symbol (layout, id_b, feature_b, axis), 1);
+    solver_expr_add_term (system, layout_symbol (layout, id_c, feature_c, axis), -1);
+    solver_expr_commit (system);
+}
+
+// Like layout_sum() but for 'a - b = 0'.
+void layout_equal (struct layout_t *layout, enum axis_t axis,
+                   uint64_t id_a, enum feature_identifier_t feature_a,
+                   uint64_t id_b, enum feature_identifier_t feature_b)
+{
+    struct linear_system_t *system = &layout->system;
+    solver_expr_begin (system);
+    solver_expr_add_term (system, layout_symbol (layout, id_a, feature_a, axis), 1);
+    solver_expr_add_term (system, layout_symbol (layout, id_b, feature_b, axis), -1);
+    solver_expr_commit (system);
+}
+
+uint64_t layout_rectangle_size (struct layout_t *layout, dvec2 size)
+{
+    uint64_t id = layout->next_id;
+    layout->next_id++;
+
+    layout_sum (layout, TK_X, id, TK_MIN, id, TK_SIZE, id, TK_MAX);
+    layout_sum (layout, TK_Y, id, TK_MIN, id, TK_SIZE, id, TK_MAX);
+
+    solver_symbol_assign_handle (&layout->system, layout_symbol (layout, id, TK_SIZE, TK_X), size.x);
+    solver_symbol_assign_handle (&layout->system, layout_symbol (layout, id, TK_SIZE, TK_Y), size.y);
+
+    struct entity_t *new_rect = mem_pool_push_struct (&layout->pool, struct entity_t);
+    *new_rect = ZERO_INIT(struct entity_t);
+    new_rect->id = id;
+    new_rect->type = TK_RECTANGLE;
+    LINKED_LIST_PUSH (layout->rectangles, new_rect);
+
+    return id;
+}
+
+void layout_add_rectangle_anchor (struct layout_t *layout, uint64_t id, enum feature_identifier_t anchor)
+{
+    // min and max are defining anchors of a rectangle they are added when
+    // pushing the rectangle.
+    if (anchor == TK_B) {
+        layout_equal (layout, TK_X, id, TK_MIN, id, TK_B);
+        layout_sum (layout, TK_Y, id, TK_MIN, id, TK_SIZE, id, TK_B);
+
+    } else if (anchor == TK_D) {
+        layout_sum (layout, TK_X, id, TK_MIN, id, TK_SIZE, id, TK_D);
+        layout_equal (layout, TK_Y, id, TK_MIN, id, TK_D);
+    }
+}
+
+uint64_t layout_link_d (struct layout_t *layout,
+                        uint64_t id1, enum feature_identifier_t feature1,
+                        uint64_t id2, enum feature_identifier_t feature2,
+                        dvec2 d)
+{
+    // Get an id for the link
+    uint64_t id = layout->next_id;
+    layout->next_id++;
+
+    // It's possible that we are using non defining features to link things,
+    // then we add their respective equations here.
+    // TODO: Avoid adding extra equations if this anchor has been referred to
+    // before.
+    layout_add_rectangle_anchor (layout, id1, feature1);
+    layout_add_rectangle_anchor (layout, id2, feature2);
+
+    layout_sum (layout, TK_X, id1, feature1, id, TK_D, id2, feature2);
+    layout_sum (layout, TK_Y, id1, feature1, id, TK_D, id2, feature2);
+
+    solver_symbol_assign_handle (&layout->system, layout_symbol (layout, id, TK_D, TK_X), d.x);
+    solver_symbol_assign_handle (&layout->system, layout_symbol (layout, id, TK_D, TK_Y), d.y);
+
+    return id;
+}
+
+void layout_fix (struct layout_t *layout,
+                     uint64_t id, enum feature_identifier_t feature,
+                     dvec2 pos)
+{
+    solver_symbol_assign_handle (&layout->system, layout_symbol (layout, id, feature, TK_X), pos.x);
+    solver_symbol_assign_handle (&layout->system, layout_symbol (layout, id, feature, TK_Y), pos.y);
+}
+
+void basic_rectangle (struct layout_t *layout)
+{
+    uint64_t rectangle_1 = layout_rectangle_size (layout, DVEC2(90, 20));
+    layout_fix (layout, rectangle_1, TK_MIN, DVEC2(100, 100));
+}
+
+void floating_rectangle (struct layout_t *layout)
+{
+    uint64_t rectangle_1 = layout_rectangle_size (layout, DVEC2(90, 20));
+    layout_rectangle_size (layout, DVEC2(90, 20));
+    layout_fix (layout, rectangle_1, TK_MIN, DVEC2(100, 100));
+}
+
+void linked_rectangles (struct layout_t *layout)
+{
+    uint64_t rectangle_1 = layout_rectangle_size (layout, DVEC2(90, 20));
+    uint64_t rectangle_2 = layout_rectangle_size (layout, DVEC2(90, 20));
+    layout_link_d (layout, rectangle_1, TK_B, rectangle_2, TK_MIN, DVEC2(10, 15));
+    layout_fix (layout, rectangle_1, TK_MIN, DVEC2(100, 100));
+}
+
+void linked_rectangles_system_floating (struct layout_t *layout)
+{
+    struct linear_system_t *system = &layout->system;
+
+    // Rectangle 1
+    solver_expr_equals_zero (system, "rectangle_1.min.x + rectangle_1.size.x - rectangle_1.max.x");
+    solver_expr_equals_zero (system, "rectangle_1.min.y + rectangle_1.size.y - rectangle_1.max.y");
+
+    solver_symbol_assign (system, "rectangle_1.size.x", 90);
+    solver_symbol_assign (system, "rectangle_1.size.y", 20);
+
+    // Link
+    solver_expr_equals_zero (system, "rectangle_1.min.x - rectangle_1.b.x");
+    solver_expr_equals_zero (system, "rectangle_1.min.y + rectangle_1.size.y - rectangle_1.b.y");
+
+    solver_expr_equals_zero (system, "rectangle_1.b.x + link_1.d.x - rectangle_2.min.x");
+    solver_expr_equals_zero (system, "rectangle_1.b.y + link_1.d.y - rectangle_2.min.y");
+
+    solver_symbol_assign (system, "link_1.d.x", 10);
+    solver_symbol_assign (system, "link_1.d.y", 15);
+
+    // Rectangle 2
+    solver_expr_equals_zero (system, "rectangle_2.min.x + rectangle_2.size.x - rectangle_2.max.x");
+    solver_expr_equals_zero (system, "rectangle_2.min.y + rectangle_2.size.y - rectangle_2.max.y");
+
+    solver_symbol_assign (system, "rectangle_2.size.x", 90);
+    solver_symbol_assign (system, "rectangle_2.size.y", 20);
+}
+
+void linked_rectangles_system (struct layout_t *layout)
+{
+    linked_rectangles_system_floating (layout);
+
+    struct linear_system_t *system = &layout->system;
+    // Fix
+    solver_symbol_assign (system, "rectangle_1.min.x", 100);
+    solver_symbol_assign (system, "rectangle_1.min.y", 100);
+}
+
+void sample (struct layout_t *layout, uint64_t *out_rectangle_1, uint64_t *out_rectangle_2)
+{
+    uint64_t rectangle_1 = layout_rectangle_size (layout, DVEC2(90, 20));
+    uint64_t rectangle_2 = layout_rectangle_size (layout, DVEC2(90, 20));
+    layout_link_d (layout, rectangle_1, TK_B, rectangle_2, TK_MIN, DVEC2(10, 15));
+
+    uint64_t rectangle_3 = layout_rectangle_size (layout, DVEC2(90, 20));
+    uint64_t rectangle_4 = layout_rectangle_size (layout, DVEC2(90, 20));
+    layout_link_d (layout, rectangle_3, TK_B, rectangle_4, TK_MIN, DVEC2(10, 15));
+
+    uint64_t rectangle_5 = layout_rectangle_size (layout, DVEC2(25, 20));
+    layout_link_d (layout, rectangle_2, TK_D, rectangle_5, TK_MIN, DVEC2(10, 0));
+    layout_link_d (layout, rectangle_5, TK_D, rectangle_4, TK_MIN, DVEC2(10, 0));
+
+    layout_fix (layout, rectangle_1, TK_MIN, DVEC2(100, 100));
+
+    if (out_rectangle_1 != NULL) {
+        *out_rectangle_1 = rectangle_1;
+    }
+
+    if (out_rectangle_2 != NULL) {
+        *out_rectangle_2 = rectangle_2;
+    }
+}
+
+void mix_layout (struct layout_t *layout)
+{
+    linked_rectangles_system_floating (layout);
+
+    uint64_t rectangle_1, rectangle_2;
+    sample (layout, &rectangle_1, &rectangle_2);
+
+    struct linear_system_t *system = &layout->system;
+    string_t buffer = {0};
+    // Align rectangle with left side of top left rectangle
+    str_set_printf (&buffer, "%ld.min.x - rectangle_1.min.x", rectangle_1);
+    solver_expr_equals_zero (system, str_data(&buffer));
+
+    // Separate vertically rectangle from bottom left rectangle
+    str_set_printf (&buffer, "%ld.min.y + %ld.size.y - %ld.b.y", rectangle_2, rectangle_2, rectangle_2);
+    solver_expr_equals_zero (system, str_data(&buffer));
+    str_set_printf (&buffer, "%ld.b.y + link_2.d.y - rectangle_1.min.y", rectangle_2);
+    solver_expr_equals_zero (system, str_data(&buffer));
+
+    solver_symbol_assign (system, "link_2.d.y", 15);
+    str_free (&buffer);
+}
@@ -8,50 +8,348 @@ enum symbol_state_t {
     SYMBOL_SOLVED
 };
 
-struct symbol_definition_t {
-    uint64_t id;
-    string_t name; // rename is not allowed!
-
-    enum symbol_state_t state;
-    double value;
+// Symbols can be referred to by their name, or by a handle returned by
+// solver_symbol_get_or_create(). Handles are symbol ids, using them avoids
+// formatting and parsing names when building or reading large systems.
+typedef uint64_t symbol_handle_t;
+
+// Keys point to names in the names array of the system, they are updated
+// when it grows, see system_intern_name().
+BINARY_TREE_NEW(name_to_symbol, char*, symbol_handle_t, strcmp(a,b))
+
+// How much a solved symbol changes for each unit an edit symbol changes.
+struct edit_dependency_t {
+    symbol_handle_t symbol;
+    double coefficient;
 };
 
-BINARY_TREE_NEW(id_to_symbol_definition, uint64_t, struct symbol_definition_t*, a <= b ? (a == b ? 0 : -1) : 1)
-BINARY_TREE_NEW(name_to_symbol_definition, char*, struct symbol_definition_t*, strcmp(a,b))
+// Dependencies of each edit symbol are a range of the edit_dependencies array
+// of the system.
+struct edit_symbol_t {
+    symbol_handle_t symbol;
+    uint64_t first_dependency;
+    uint64_t num_dependencies;
+};
 
-struct symbol_t {
-    bool is_negative;
-    struct symbol_definition_t *definition;
+struct term_t {
+    double coefficient;
+    symbol_handle_t symbol;
+};
 
-    struct symbol_t *next;
+// Relation between the sum of the terms of an expression and 0.
+enum solver_relation_t {
+    SOLVER_EQUAL,
+    SOLVER_LESS_EQUAL,
+    SOLVER_GREATER_EQUAL
 };
 
+// Strength of a constraint. Required ones must be satisfied, the error of the
+// rest is minimized, weighted by their strength. Each named strength
+// dominates any reasonable amount of constraints of the weaker ones.
+#define SOLVER_REQUIRED 1001001000.0
+#define SOLVER_STRONG 1000000.0
+#define SOLVER_MEDIUM 1000.0
+#define SOLVER_WEAK 1.0
+
+// Terms of all expressions are stored contiguously in linear_system_t, each
+// expression is a range in that array. The sum of all terms plus the constant
+// is related to 0 by relation, usually it's equal to it.
+//
+// Removed expressions are left without terms and with a zero constant, which
+// is always satisfied, so the solver doesn't need to skip them.
 struct expression_t {
-    struct symbol_t *symbols;
+    uint64_t first_term;
+    uint32_t num_terms;
+    bool is_removed;
+    double constant;
+
+    enum solver_relation_t relation;
+    double strength;
+};
+
+// Expressions that can't be solved by elimination, see SIMPLEX.
+static inline
+bool expression_needs_simplex (struct expression_t *expression)
+{
+    return expression->relation != SOLVER_EQUAL || expression->strength < SOLVER_REQUIRED;
+}
 
-    struct expression_t *next;
+// Expressions are identified by their index in linear_system_t, which is
+// returned when they are committed and is used to remove them.
+typedef uint32_t expression_handle_t;
+
+// Statistics of the last call to solver_solve(). Counters are only updated
+// once per component or per factorization, never inside inner loops, so they
+// are always collected.
+struct solver_stats_t {
+    // Wall time of each phase in milliseconds. When components are solved in
+    // parallel, the time of the per component phases (everything except
+    // partition) is the sum across all workers.
+    double total_ms;
+    double presolve_ms;
+    double partition_ms;
+    double matrix_build_ms;
+    double factorization_ms;
+    double substitution_ms;
+    double copy_back_ms;
+    double simplex_ms; // Only set if the system has inequalities or constraints that aren't required
+
+    uint64_t num_symbols;
+    uint64_t num_equations;
+    uint32_t num_components;
+    uint32_t num_factored_components; // Factored in this call, others were reused
+    uint32_t num_difference_components;
+    uint32_t num_dense_components;
+    uint32_t num_banded_components;
+    uint64_t num_presolved;
+    uint64_t num_aliases;
+
+    // Added up across the matrices of all components.
+    uint64_t num_nonzeros;
+    uint64_t num_pivots;
+    uint64_t num_row_swaps;
+
+    // Floating point operations of the factorizations computed in this call
+    // plus those of forward and back substitution.
+    uint64_t num_flops;
+
+    // Largest amount of temporary memory used to factor and solve a single
+    // component, in bytes.
+    uint64_t peak_temporary_size;
+
+    // Lookups and insertions into the name to symbol tree since the previous
+    // call to solver_solve().
+    uint64_t num_tree_lookups;
+
+    // Components solved with the iterative solver, the iterations summed
+    // across all of them, how many stopped without reaching the tolerance,
+    // and the largest relative residual left in one of them.
+    uint32_t num_iterative_components;
+    uint64_t num_iterations;
+    uint32_t num_unconverged_components;
+    double max_relative_residual;
+
+    // Constraints in the simplex tableau and its rows, and the pivots done by
+    // this call, only used by systems with inequalities or constraints that
+    // aren't required.
+    uint32_t num_simplex_constraints;
+    uint32_t num_simplex_rows;
+    uint64_t num_simplex_pivots;
+
+    // Dependencies of solved symbols on edit symbols, see EDIT SYMBOLS.
+    uint64_t num_edit_dependencies;
 };
 
 struct linear_system_t {
     mem_pool_t pool;
-    struct id_to_symbol_definition_tree_t id_to_symbol_definition;
-    struct name_to_symbol_definition_tree_t name_to_symbol_definition;
+    struct name_to_symbol_tree_t name_to_symbol;
 
+    // Symbols are stored as parallel arrays indexed by id, so solving scans
+    // states and values linearly. Ids are assigned densely, the arrays have
+    // symbols_size elements and the first last_id are used.
     uint64_t last_id;
-    struct expression_t *expressions;
+    uint64_t symbols_size;
+    enum symbol_state_t *state;
+    double *value;
+
+    // Names are interned in the names array, each one ends with a null byte.
+    // Names of removed symbols stay there until the system is compacted.
+    uint64_t *name_offset;
+    DYNAMIC_ARRAY_DEFINE (char, names);
+
+    // Number of terms that use each symbol, a symbol can only be removed when
+    // there are none.
+    uint32_t *num_uses;
+    bool *is_removed;
+
+    // Set for edit symbols, see solver_symbol_edit().
+    bool *is_edit;
+
+    // Set while factored if the symbol's value is computed by presolve, see
+    // system_presolve().
+    bool *is_presolved;
+
+    // Set while factored if an equation made a symbol equal to another one.
+    // It's the id of the symbol that represents all of them, which is the one
+    // solved, see system_merge_aliases(). Other symbols are their own alias.
+    uint64_t *alias;
+
+    DYNAMIC_ARRAY_DEFINE (struct expression_t, expressions);
+    DYNAMIC_ARRAY_DEFINE (struct term_t, terms);
+
+    // Ids of removed symbols and expressions, reused before creating new ones.
+    // Terms of removed expressions stay in the terms array until the system
+    // is compacted, see system_compact().
+    DYNAMIC_ARRAY_DEFINE (symbol_handle_t, free_symbols);
+    DYNAMIC_ARRAY_DEFINE (expression_handle_t, free_expressions);
+    uint64_t num_removed_terms;
+    uint64_t num_removed_symbols;
+
+    // Tableau used instead of components when some live expressions are
+    // inequalities or aren't required, num_simplex_expressions counts them.
+    // Removals are queued until the next solve, changing the value of an
+    // assigned symbol makes the tableau stale, see SIMPLEX.
+    uint32_t num_simplex_expressions;
+    struct simplex_t *simplex;
+    bool simplex_is_stale;
+    DYNAMIC_ARRAY_DEFINE (expression_handle_t, simplex_removed_expressions);
+    DYNAMIC_ARRAY_DEFINE (symbol_handle_t, simplex_removed_symbols);
+
+    // Assigned symbols whose value is changed by solver_symbol_suggest(). In
+    // systems without a tableau, values of solved symbols are linear in the
+    // ones of assigned symbols, so solving computes how much each solved
+    // symbol depends on each edit symbol. Changing the structure of the
+    // system makes them stale until the next solve.
+    DYNAMIC_ARRAY_DEFINE (struct edit_symbol_t, edit_symbols);
+    DYNAMIC_ARRAY_DEFINE (struct edit_dependency_t, edit_dependencies);
+    bool edit_dependencies_are_stale;
+
+    // Set between solver_expr_begin() and solver_expr_commit(), terms of the
+    // expression being built are the ones after new_expression_first_term.
+    bool is_building_expression;
+    uint64_t new_expression_first_term;
+    double new_expression_constant;
 
     bool success;
+
+    // Number of threads used to solve independent components, 0 means one per
+    // core and 1 disables multithreading. The thread pool is only created the
+    // first time a system with enough components is solved.
+    int num_threads;
+    struct thread_pool_t thread_pool;
+
+    // Configuration of the iterative solver, set with solver_set_iterative().
+    bool use_iterative_solver;
+    double iterative_tolerance;
+    uint32_t iterative_max_iterations;
+
+    // Cached component partition and factorizations. They only depend on the
+    // structure of the system, so they are kept across calls to
+    // solver_solve() until an unknown symbol gets assigned. Changing the value
+    // of an already assigned symbol only changes the right hand side.
+    // Expressions and symbols added after the last factorization are merged
+    // into the partition by system_factor_incremental().
+    bool is_factored;
+
+    // Set when the last call to solver_solve() succeeded and no symbol was
+    // assigned since, then values of components that are still factored are
+    // up to date and only new components are solved. Unchecked solves don't
+    // set it, they can't tell whether all components were solved.
+    bool is_solved;
+    mem_pool_t factorization_pool;
+    uint32_t num_components;
+    struct system_component_t *components;
+    uint32_t num_constant_expressions;
+    uint32_t *constant_expressions;
+    bool use_threads;
+
+    // Expressions and symbols already in the partition, and the number of
+    // symbols in components rebuilt by system_factor_incremental() since the
+    // last call to system_factor().
+    uint32_t num_factored_expressions;
+    uint64_t num_factored_symbols;
+    uint64_t num_incremental_symbols;
+
+    // Arrays indexed by symbol id, they have symbol_arrays_size elements and
+    // grow when symbols are added, see system_grow_symbol_arrays().
+    // symbol_component is the component of each unknown symbol, or
+    // SOLVER_NO_COMPONENT. symbol_mark is scratch space that is kept set to
+    // SOLVER_NO_MARK between uses.
+    uint64_t symbol_arrays_size;
+    uint64_t *symbol_id_to_column;
+    uint32_t *symbol_component;
+    uint32_t *symbol_mark;
+    uint32_t components_size;
+    uint32_t constant_expressions_size;
+
+    // Symbols computed by presolve, and the expression each one is computed
+    // from, in the order they have to be evaluated.
+    uint64_t num_presolved;
+    uint32_t *presolve_expressions;
+    uint64_t *presolve_symbols;
+
+    // Symbols replaced by the representative of their alias class. Expressions
+    // used to merge them are marked in expression_is_alias, which is NULL if
+    // there are no aliases.
+    uint64_t num_aliases;
+    uint64_t *aliases;
+    bool *expression_is_alias;
+
+    // One pool for each worker that can factor components, so they can
+    // allocate factorizations without locking.
+    int num_factor_pools;
+    mem_pool_t *factor_pools;
+
+    struct solver_stats_t stats;
+    uint64_t num_tree_lookups;
 };
 
+void system_factorization_destroy (struct linear_system_t *system)
+{
+    for (int i=0; i<system->num_factor_pools; i++) {
+        mem_pool_destroy (&system->factor_pools[i]);
+    }
+    free (system->factor_pools);
+    system->factor_pools = NULL;
+    system->num_factor_pools = 0;
+
+    mem_pool_destroy (&system->factorization_pool);
+    system->factorization_pool = ZERO_INIT (mem_pool_t);
+
+    system->components = NULL;
+    system->num_components = 0;
+    system->constant_expressions = NULL;
+    system->num_constant_expressions = 0;
+    system->presolve_expressions = NULL;
+    system->presolve_symbols = NULL;
+    system->num_presolved = 0;
+    system->aliases = NULL;
+    system->num_aliases = 0;
+    system->expression_is_alias = NULL;
+    system->symbol_id_to_column = NULL;
+    system->symbol_component = NULL;
+    system->symbol_mark = NULL;
+    system->symbol_arrays_size = 0;
+    system->components_size = 0;
+    system->constant_expressions_size = 0;
+    system->num_factored_expressions = 0;
+    system->num_factored_symbols = 0;
+    system->num_incremental_symbols = 0;
+    system->is_factored = false;
+    system->is_solved = false;
+}
+
+void system_simplex_destroy (struct linear_system_t *system);
+
 void solver_destroy (struct linear_system_t *system)
 {
-    id_to_symbol_definition_tree_destroy (&system->id_to_symbol_definition);
-    name_to_symbol_definition_tree_destroy (&system->name_to_symbol_definition);
+    thread_pool_destroy (&system->thread_pool);
+    system_factorization_destroy (system);
+    free (system->state);
+    free (system->value);
+    free (system->name_offset);
+    free (system->names);
+    free (system->num_uses);
+    free (system->is_removed);
+    free (system->is_edit);
+    free (system->is_presolved);
+    free (system->alias);
+    free (system->expressions);
+    free (system->terms);
+    free (system->free_symbols);
+    free (system->free_expressions);
+    system_simplex_destroy (system);
+    free (system->simplex_removed_expressions);
+    free (system->simplex_removed_symbols);
+    free (system->edit_symbols);
+    free (system->edit_dependencies);
+    name_to_symbol_tree_destroy (&system->name_to_symbol);
     mem_pool_destroy (&system->pool);
 }
 
 #define SOLVER_TOKEN_TABLE                     \
     SOLVER_TOKEN_ROW(SOLVER_TOKEN_IDENTIFIER)  \
+    SOLVER_TOKEN_ROW(SOLVER_TOKEN_NUMBER)      \
     SOLVER_TOKEN_ROW(SOLVER_TOKEN_OPERATOR)    \
 
 #define SOLVER_TOKEN_ROW(identifier) identifier,
@@ -66,49 +364,191 @@ char *solver_token_names[] = {
 };
 #undef SOLVER_TOKEN_ROW
 
+// Parsing an expression shouldn't allocate anything unless there is an error.
+// The pool is only used for error messages and tokens are short enough to fit
+// in a small string_t.
 struct solver_parser_state_t {
     mem_pool_t pool;
     struct scanner_t scnr;
 
     enum solver_token_type_t type;
     string_t str;
+    double value; // Only set for SOLVER_TOKEN_NUMBER
 };
 
 void solver_parser_state_destroy (struct solver_parser_state_t *state)
 {
+    str_free (&state->str);
     mem_pool_destroy (&state->pool);
 }
 
 void solver_parser_state_init (struct solver_parser_state_t *state, char *expr)
 {
-    str_pool (&state->pool, &state->str);
     state->scnr.pos = expr;
 }
 
-struct symbol_t* system_new_symbol (struct linear_system_t *system, bool is_negative, char *name)
+void system_reserve_symbols (struct linear_system_t *system, uint64_t size)
+{
+    if (size <= system->symbols_size) return;
+
+    size = MAX (size, MAX (64, 2*system->symbols_size));
+    system->state = realloc (system->state, size*sizeof(enum symbol_state_t));
+    system->value = realloc (system->value, size*sizeof(double));
+    system->name_offset = realloc (system->name_offset, size*sizeof(uint64_t));
+    system->num_uses = realloc (system->num_uses, size*sizeof(uint32_t));
+    system->is_removed = realloc (system->is_removed, size*sizeof(bool));
+    system->is_edit = realloc (system->is_edit, size*sizeof(bool));
+    system->is_presolved = realloc (system->is_presolved, size*sizeof(bool));
+    system->alias = realloc (system->alias, size*sizeof(uint64_t));
+    system->symbols_size = size;
+}
+
+static inline
+char* symbol_name (struct linear_system_t *system, symbol_handle_t symbol)
+{
+    return system->names + system->name_offset[symbol];
+}
+
+// Appends a name to the names array and returns its offset. Tree keys point
+// into the array, so if it moves they are updated.
+uint64_t system_intern_name (struct linear_system_t *system, char *name)
+{
+    uint64_t offset = system->names_len;
+    size_t len = strlen (name) + 1;
+    if (system->names_len + len > system->names_size) {
+        system->names_size = MAX (system->names_len + len, MAX (1024, 2*system->names_size));
+        char *names = realloc (system->names, system->names_size);
+        if (names != system->names) {
+            system->names = names;
+            BINARY_TREE_FOR (name_to_symbol, &system->name_to_symbol, curr_node) {
+                curr_node->key = symbol_name (system, curr_node->value);
+            }
+        }
+    }
+
+    memcpy (system->names + offset, name, len);
+    system->names_len += len;
+    return offset;
+}
+
+// Returns the handle of the symbol with the passed name, creating it if it
+// doesn't exist. Names are only used here, after this the handle can be used
+// to build expressions, assign values and read the solution.
+symbol_handle_t solver_symbol_get_or_create (struct linear_system_t *system, char *name)
+{
+    system->num_tree_lookups++;
+    struct name_to_symbol_tree_node_t *node;
+    if (name_to_symbol_tree_lookup (&system->name_to_symbol, name, &node)) {
+        return node->value;
+    }
+
+    symbol_handle_t id;
+    if (system->free_symbols_len > 0) {
+        id = system->free_symbols[--system->free_symbols_len];
+
+        // The factorization only knows about new symbols if their id is
+        // after the ones it has.
+        if (id < system->num_factored_symbols) {
+            system->is_factored = false;
+        }
+
+    } else {
+        id = system->last_id++;
+        system_reserve_symbols (system, system->last_id);
+    }
+
+    system->state[id] = SYMBOL_UNASSIGNED;
+    system->value[id] = 0;
+    system->name_offset[id] = system_intern_name (system, name);
+    system->num_uses[id] = 0;
+    system->is_removed[id] = false;
+    system->is_edit[id] = false;
+    system->is_presolved[id] = false;
+    system->alias[id] = id;
+
+    system->num_tree_lookups++;
+    name_to_symbol_tree_insert (&system->name_to_symbol, symbol_name (system, id), id);
+    return id;
+}
+
+// Expressions can be built term by term instead of parsing them from a string
+// with solver_expr_equals_zero(). Like there, the sum of all terms is equal to
+// zero.
+//
+//   solver_expr_begin (system);
+//   solver_expr_add_term (system, min_x, 1);
+//   solver_expr_add_term (system, size_x, 2);
+//   solver_expr_add_term (system, max_x, -1);
+//   solver_expr_add_constant (system, 10);
+//   solver_expr_commit (system);
+//
+// is the same as solver_expr_equals_zero (system, "min.x + 2*size.x - max.x + 10").
+void solver_expr_begin (struct linear_system_t *system)
+{
+    assert (!system->is_building_expression && "Previous expression wasn't committed.");
+    system->is_building_expression = true;
+    system->new_expression_first_term = system->terms_len;
+    system->new_expression_constant = 0;
+}
+
+void solver_expr_add_term (struct linear_system_t *system, symbol_handle_t symbol, double coefficient)
+{
+    assert (system->is_building_expression && "Missing call to solver_expr_begin().");
+    assert (symbol < system->last_id && !system->is_removed[symbol]);
+
+    DYNAMIC_ARRAY_APPEND_GET (system->terms, struct term_t*, new_term);
+    new_term->symbol = symbol;
+    new_term->coefficient = coefficient;
+    system->num_uses[symbol]++;
+}
+
+void solver_expr_add_constant (struct linear_system_t *system, double value)
+{
+    assert (system->is_building_expression && "Missing call to solver_expr_begin().");
+    system->new_expression_constant += value;
+}
+
+// Commits the expression being built as a constraint, which relates it to 0
+// instead of making it equal, and doesn't have to be required.
+expression_handle_t solver_expr_commit_constraint (struct linear_system_t *system,
+                                                   enum solver_relation_t relation, double strength)
 {
-    struct symbol_definition_t *symbol_definition =
-        name_to_symbol_definition_get (&system->name_to_symbol_definition, name);
-    if (symbol_definition == NULL) {
-        symbol_definition = mem_pool_push_struct (&system->pool, struct symbol_definition_t);
-        *symbol_definition = ZERO_INIT (struct symbol_definition_t);
+    assert (system->is_building_expression && "Missing call to solver_expr_begin().");
+
+    struct expression_t new_expression = {0};
+    new_expression.first_term = system->new_expression_first_term;
+    new_expression.num_terms = system->terms_len - system->new_expression_first_term;
+    new_expression.constant = system->new_expression_constant;
+    new_expression.relation = relation;
+    new_expression.strength = CLAMP (strength, 0, SOLVER_REQUIRED);
+    if (expression_needs_simplex (&new_expression)) {
+        system->num_simplex_expressions++;
+    }
+    system->edit_dependencies_are_stale = true;
+
+    expression_handle_t expression;
+    if (system->free_expressions_len > 0) {
+        expression = system->free_expressions[--system->free_expressions_len];
+        system->expressions[expression] = new_expression;
 
-        symbol_definition->id = system->last_id;
-        system->last_id++;
-        str_set (&symbol_definition->name, name);
+        // Like symbols, only expressions after the factored ones are added
+        // incrementally.
+        if (expression < system->num_factored_expressions) {
+            system->is_factored = false;
+        }
 
-        id_to_symbol_definition_tree_insert (&system->id_to_symbol_definition,
-                                             symbol_definition->id, symbol_definition);
-        name_to_symbol_definition_tree_insert (&system->name_to_symbol_definition,
-                                               str_data(&symbol_definition->name), symbol_definition);
+    } else {
+        expression = system->expressions_len;
+        DYNAMIC_ARRAY_APPEND (system->expressions, new_expression);
     }
 
-    struct symbol_t *new_symbol =
-        mem_pool_push_struct (&system->pool, struct symbol_t);
-    new_symbol->definition = symbol_definition;
-    new_symbol->is_negative = is_negative;
+    system->is_building_expression = false;
+    return expression;
+}
 
-    return new_symbol;
+expression_handle_t solver_expr_commit (struct linear_system_t *system)
+{
+    return solver_expr_commit_constraint (system, SOLVER_EQUAL, SOLVER_REQUIRED);
 }
 
 // Shorthand error for when the only replacement is the value of a token.
@@ -124,16 +564,37 @@ void solver_read_error (struct solver_parser_state_t *state, const char *format,
     scanner_set_error (&state->scnr, str);
 }
 
+static inline
+bool solver_is_identifier_char (char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+        c == '.' || c == '_' || c == '-';
+}
+
+// Symbol names can start with digits, like the ones generated by the layouter
+// ("12.min.x"). Something that starts like a number is only a number if it's
+// not followed by characters that would make it an identifier, this includes
+// '-' so "10-x" is still a single symbol. Returns the length of the number,
+// or 0 if str doesn't start with one.
+size_t solver_scan_number (char *str, double *value)
+{
+    size_t len = scan_decimal_double (str, value);
+    char next = str[len];
+    if (solver_is_identifier_char (next)) {
+        len = 0;
+    }
+    return len;
+}
+
 void solver_tokenizer_next (struct solver_parser_state_t *state)
 {
     struct scanner_t *scnr = &state->scnr;
 
     scnr->eof_is_error = true;
 
-    char *identifier_chars = "._-abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
-
     // Reset the token
     str_set (&state->str, "");
+    size_t number_len;
 
     scanner_consume_spaces (scnr);
 
@@ -141,13 +602,28 @@ void solver_tokenizer_next (struct solver_parser_state_t *state)
         state->type = SOLVER_TOKEN_OPERATOR;
         strn_set (&state->str, scnr->pos-1, 1);
 
-    } else if (scanner_char_peek (scnr, identifier_chars)) {
+    } else if (scanner_str (scnr, "<=") || scanner_str (scnr, ">=")) {
+        state->type = SOLVER_TOKEN_OPERATOR;
+        strn_set (&state->str, scnr->pos-2, 2);
+
+    } else if (scanner_char (scnr, '=')) {
+        state->type = SOLVER_TOKEN_OPERATOR;
+        strn_set (&state->str, scnr->pos-1, 1);
+
+    } else if ((number_len = solver_scan_number (scnr->pos, &state->value)) > 0) {
+        state->type = SOLVER_TOKEN_NUMBER;
+        strn_set (&state->str, scnr->pos, number_len);
+        scnr->pos += number_len;
+
+    } else if (solver_is_identifier_char (*scnr->pos)) {
         state->type = SOLVER_TOKEN_IDENTIFIER;
-        
-        while (scanner_char_peek (scnr, identifier_chars)) {
-            strn_cat_c (&state->str, scnr->pos, 1);
-            scanner_advance_char (scnr);
+
+        char *start = scnr->pos;
+        while (solver_is_identifier_char (*scnr->pos)) {
+            scnr->pos++;
         }
+        strn_set (&state->str, start, scnr->pos - start);
+
     } else {
         solver_read_error (state, "Unexpected character '%c'.", *(scnr->pos));
     }
@@ -164,7 +640,8 @@ bool solver_token_match (struct solver_parser_state_t *state, enum solver_token_
         if (value == NULL) {
             match = true;
 
-        } else if (type == SOLVER_TOKEN_IDENTIFIER || type == SOLVER_TOKEN_OPERATOR) {
+        } else if (type == SOLVER_TOKEN_IDENTIFIER || type == SOLVER_TOKEN_OPERATOR ||
+                   type == SOLVER_TOKEN_NUMBER) {
             if (strcmp (str_data(&state->str), value) == 0) {
                 match = true;
             }
@@ -205,61 +682,311 @@ void solver_tokenizer_expect (struct solver_parser_state_t *state,
     }
 }
 
-void solver_expression_push_symbol (struct linear_system_t *system,
-                                    struct expression_t *expression,
-                                    bool is_negative, char *identifier)
+// Parses a term starting at the current token, one of:
+//
+//   identifier
+//   number
+//   number * identifier
+//
+void solver_parse_term (struct linear_system_t *system, struct solver_parser_state_t *state, double sign)
 {
-    // TODO: Have a symbol identifier to ID map
-    struct symbol_t *new_symbol = system_new_symbol (system, is_negative, identifier);
-    LINKED_LIST_PUSH (expression->symbols, new_symbol);
+    if (state->scnr.error) {
+        return;
+
+    } else if (solver_token_match (state, SOLVER_TOKEN_IDENTIFIER, NULL)) {
+        solver_expr_add_term (system, solver_symbol_get_or_create (system, str_data(&state->str)), sign);
+
+    } else if (solver_token_match (state, SOLVER_TOKEN_NUMBER, NULL)) {
+        double value = state->value;
+        if (scanner_char (&state->scnr, '*')) {
+            solver_tokenizer_expect (state, SOLVER_TOKEN_IDENTIFIER, NULL);
+            if (!state->scnr.error) {
+                solver_expr_add_term (system, solver_symbol_get_or_create (system, str_data(&state->str)),
+                                      sign*value);
+            }
+
+        } else {
+            solver_expr_add_constant (system, sign*value);
+        }
+
+    } else {
+        solver_read_error_tok (state, "Expected a symbol or a number, got '%s'.");
+    }
 }
 
-void solver_expr_equals_zero (struct linear_system_t *system, char *expr)
+// Parses expr into the expression being built. If relation isn't NULL, expr
+// can have two sides separated by =, <= or >=, terms of the right side are
+// moved to the left one, and the operator is returned in relation.
+void solver_parse_expression (struct linear_system_t *system, char *expr, enum solver_relation_t *relation)
 {
     struct solver_parser_state_t _state = {0};
     struct solver_parser_state_t *state = &_state;
     solver_parser_state_init (state, expr);
 
-    bool is_negative = false;
-
-    struct expression_t *new_expression = mem_pool_push_struct (&system->pool, struct expression_t);
-    *new_expression = ZERO_INIT (struct expression_t);
-    LINKED_LIST_PUSH (system->expressions, new_expression)
+    // Sign of the side being parsed.
+    double side = 1;
 
+    double sign = 1;
     solver_tokenizer_next (state);
-    if (solver_token_match (state, SOLVER_TOKEN_IDENTIFIER, NULL)) {
-        solver_expression_push_symbol (system, new_expression, false, str_data(&state->str));
-
-    } else if (solver_token_match (state, SOLVER_TOKEN_OPERATOR, NULL)) {
-        if (strcmp (str_data(&state->str), "-") == 0) {
-            is_negative = true;
+    if (solver_token_match (state, SOLVER_TOKEN_OPERATOR, NULL)) {
+        if (solver_token_match (state, SOLVER_TOKEN_OPERATOR, "-")) {
+            sign = -1;
         }
-        solver_tokenizer_expect (state, SOLVER_TOKEN_IDENTIFIER, NULL);
-        solver_expression_push_symbol (system, new_expression, is_negative, str_data(&state->str));
+        solver_tokenizer_next (state);
     }
+    solver_parse_term (system, state, sign);
 
     while (!state->scnr.error && !state->scnr.is_eof) {
         solver_tokenizer_expect (state, SOLVER_TOKEN_OPERATOR, NULL);
-        if (strcmp (str_data(&state->str), "-") == 0) {
-            is_negative = true;
+        if (relation != NULL && side == 1 &&
+            (solver_token_match (state, SOLVER_TOKEN_OPERATOR, "=") ||
+             solver_token_match (state, SOLVER_TOKEN_OPERATOR, "<=") ||
+             solver_token_match (state, SOLVER_TOKEN_OPERATOR, ">="))) {
+            if (solver_token_match (state, SOLVER_TOKEN_OPERATOR, "<=")) {
+                *relation = SOLVER_LESS_EQUAL;
+            } else if (solver_token_match (state, SOLVER_TOKEN_OPERATOR, ">=")) {
+                *relation = SOLVER_GREATER_EQUAL;
+            } else {
+                *relation = SOLVER_EQUAL;
+            }
+
+            side = -1;
+            sign = 1;
+            solver_tokenizer_next (state);
+            if (solver_token_match (state, SOLVER_TOKEN_OPERATOR, "-") ||
+                solver_token_match (state, SOLVER_TOKEN_OPERATOR, "+")) {
+                if (solver_token_match (state, SOLVER_TOKEN_OPERATOR, "-")) {
+                    sign = -1;
+                }
+                solver_tokenizer_next (state);
+            }
+
+        } else if (solver_token_match (state, SOLVER_TOKEN_OPERATOR, "-")) {
+            sign = -1;
+            solver_tokenizer_next (state);
+        } else if (solver_token_match (state, SOLVER_TOKEN_OPERATOR, "+")) {
+            sign = 1;
+            solver_tokenizer_next (state);
         } else {
-            is_negative = false;
+            solver_read_error_tok (state, "Unexpected operator '%s'.");
         }
 
-        solver_tokenizer_expect (state, SOLVER_TOKEN_IDENTIFIER, NULL);
-
-        solver_expression_push_symbol (system, new_expression, is_negative, str_data(&state->str));
+        solver_parse_term (system, state, side*sign);
     }
 
     solver_parser_state_destroy (state);
 }
 
+// Adds the equation expr = 0. Terms are separated by + or -, an operator has
+// to be surrounded by spaces if the characters next to it can be part of a
+// symbol name, because '-' is allowed in names: "10-x" is a single symbol,
+// "10 - x" is 10 minus x.
+expression_handle_t solver_expr_equals_zero (struct linear_system_t *system, char *expr)
+{
+    solver_expr_begin (system);
+    solver_parse_expression (system, expr, NULL);
+    return solver_expr_commit (system);
+}
+
+// Adds a constraint written like "a.min.x + 10 <= b.min.x", its sides can be
+// separated by =, <= or >=.
+expression_handle_t solver_constraint (struct linear_system_t *system, char *expr, double strength)
+{
+    enum solver_relation_t relation = SOLVER_EQUAL;
+    solver_expr_begin (system);
+    solver_parse_expression (system, expr, &relation);
+    return solver_expr_commit_constraint (system, relation, strength);
+}
+
+// Removing symbols and expressions leaves garbage behind: terms of removed
+// expressions, and slots of removed ids at the end of the symbol and
+// expression arrays. Compaction is done once the removed terms or symbols
+// since the last one are at least half of the total and there are at least
+// SOLVER_COMPACT_MIN_SIZE of them, so its cost is amortized across removals.
+#define SOLVER_COMPACT_MIN_SIZE 1024
+
+// Copies terms of live expressions into a new array, drops removed ids at the
+// end of the symbol and expression arrays, and copies names of live symbols
+// into a new names array. Handles of live symbols and expressions don't
+// change, and the cached factorization is discarded.
+void system_compact (struct linear_system_t *system)
+{
+    assert (!system->is_building_expression);
+    system_factorization_destroy (system);
+
+    uint64_t num_terms = 0;
+    for (uint32_t i=0; i<system->expressions_len; i++) {
+        num_terms += system->expressions[i].num_terms;
+    }
+
+    struct term_t *terms = NULL;
+    if (num_terms > 0) {
+        terms = malloc (num_terms*sizeof(struct term_t));
+        num_terms = 0;
+        for (uint32_t i=0; i<system->expressions_len; i++) {
+            struct expression_t *expression = &system->expressions[i];
+            memcpy (terms + num_terms, &system->terms[expression->first_term], expression->num_terms*sizeof(struct term_t));
+            expression->first_term = num_terms;
+            num_terms += expression->num_terms;
+        }
+    }
+    free (system->terms);
+    system->terms = terms;
+    system->terms_len = num_terms;
+    system->terms_size = num_terms;
+    system->num_removed_terms = 0;
+
+    while (system->expressions_len > 0 && system->expressions[system->expressions_len-1].is_removed) {
+        system->expressions_len--;
+    }
+    uint32_t num_free_expressions = 0;
+    for (uint32_t i=0; i<system->free_expressions_len; i++) {
+        if (system->free_expressions[i] < system->expressions_len) {
+            system->free_expressions[num_free_expressions++] = system->free_expressions[i];
+        }
+    }
+    system->free_expressions_len = num_free_expressions;
+
+    uint64_t last_id = system->last_id;
+    while (last_id > 0 && system->is_removed[last_id-1]) {
+        last_id--;
+    }
+    uint32_t num_free_symbols = 0;
+    for (uint32_t i=0; i<system->free_symbols_len; i++) {
+        if (system->free_symbols[i] < last_id) {
+            system->free_symbols[num_free_symbols++] = system->free_symbols[i];
+        }
+    }
+    system->free_symbols_len = num_free_symbols;
+
+    // Names of removed symbols are only released by copying all the rest to
+    // a new array. Tree keys point to names, so they are updated too.
+    if (system->num_removed_symbols > 0) {
+        uint64_t names_len = 0;
+        for (uint64_t id=0; id<last_id; id++) {
+            if (!system->is_removed[id]) {
+                names_len += strlen (symbol_name (system, id)) + 1;
+            }
+        }
+
+        char *names = NULL;
+        if (names_len > 0) {
+            names = malloc (names_len);
+            names_len = 0;
+            for (uint64_t id=0; id<last_id; id++) {
+                if (!system->is_removed[id]) {
+                    size_t len = strlen (symbol_name (system, id)) + 1;
+                    memcpy (names + names_len, symbol_name (system, id), len);
+                    system->name_offset[id] = names_len;
+                    names_len += len;
+                }
+            }
+        }
+        free (system->names);
+        system->names = names;
+        system->names_len = names_len;
+        system->names_size = names_len;
+
+        BINARY_TREE_FOR (name_to_symbol, &system->name_to_symbol, curr_node) {
+            curr_node->key = symbol_name (system, curr_node->value);
+        }
+    }
+    system->last_id = last_id;
+    system->num_removed_symbols = 0;
+}
+
+void system_compact_if_needed (struct linear_system_t *system)
+{
+    if ((system->num_removed_terms >= SOLVER_COMPACT_MIN_SIZE && 2*system->num_removed_terms >= system->terms_len) ||
+        (system->num_removed_symbols >= SOLVER_COMPACT_MIN_SIZE && 2*system->num_removed_symbols >= system->last_id)) {
+        system_compact (system);
+    }
+}
+
+// Removes an expression returned by solver_expr_commit() or
+// solver_expr_equals_zero(). Its handle may be returned again for a new
+// expression. The factorization is discarded, next solve starts from scratch.
+void solver_expr_remove (struct linear_system_t *system, expression_handle_t expression)
+{
+    assert (!system->is_building_expression && "Can't remove expressions while building one.");
+    assert (expression < system->expressions_len && !system->expressions[expression].is_removed);
+
+    struct term_t *terms = &system->terms[system->expressions[expression].first_term];
+    for (uint32_t t=0; t<system->expressions[expression].num_terms; t++) {
+        system->num_uses[terms[t].symbol]--;
+    }
+    system->num_removed_terms += system->expressions[expression].num_terms;
+
+    if (expression_needs_simplex (&system->expressions[expression])) {
+        system->num_simplex_expressions--;
+    }
+    if (system->simplex != NULL) {
+        DYNAMIC_ARRAY_APPEND (system->simplex_removed_expressions, expression);
+    }
+    system->edit_dependencies_are_stale = true;
+
+    system->expressions[expression] = ZERO_INIT (struct expression_t);
+    system->expressions[expression].strength = SOLVER_REQUIRED;
+    system->expressions[expression].is_removed = true;
+    DYNAMIC_ARRAY_APPEND (system->free_expressions, expression);
+
+    system->is_factored = false;
+    system_compact_if_needed (system);
+}
+
+// Removes a symbol that isn't used by any expression, returns false if it
+// still is. Its handle may be returned again for a new symbol. Like removing
+// expressions, this discards the factorization.
+bool solver_symbol_remove (struct linear_system_t *system, symbol_handle_t symbol)
+{
+    assert (!system->is_building_expression && "Can't remove symbols while building an expression.");
+    assert (symbol < system->last_id && !system->is_removed[symbol]);
+    assert (!system->is_edit[symbol] && "Missing call to solver_symbol_edit_end().");
+    if (system->num_uses[symbol] > 0) {
+        return false;
+    }
+
+    name_to_symbol_tree_remove (&system->name_to_symbol, symbol_name (system, symbol));
+    system->is_removed[symbol] = true;
+    system->state[symbol] = SYMBOL_UNASSIGNED;
+    DYNAMIC_ARRAY_APPEND (system->free_symbols, symbol);
+    system->num_removed_symbols++;
+    if (system->simplex != NULL) {
+        DYNAMIC_ARRAY_APPEND (system->simplex_removed_symbols, symbol);
+    }
+
+    system->is_factored = false;
+    system_compact_if_needed (system);
+
+    return true;
+}
+
+void solver_symbol_assign_handle (struct linear_system_t *system, symbol_handle_t symbol, double value)
+{
+    assert (symbol < system->last_id && !system->is_removed[symbol]);
+
+    // Symbols created after the last factorization aren't part of it yet.
+    if (system->state[symbol] != SYMBOL_ASSIGNED && symbol < system->num_factored_symbols) {
+        system->is_factored = false;
+    }
+    if (system->state[symbol] != SYMBOL_ASSIGNED) {
+        system->edit_dependencies_are_stale = true;
+    }
+    if (system->state[symbol] != SYMBOL_ASSIGNED || system->value[symbol] != value) {
+        system->simplex_is_stale = true;
+    }
+    system->state[symbol] = SYMBOL_ASSIGNED;
+    system->value[symbol] = value;
+    system->is_solved = false;
+}
+
 void solver_symbol_assign (struct linear_system_t *system, char *identifier, double value)
 {
-    struct symbol_definition_t *symbol_definition =
-        name_to_symbol_definition_get (&system->name_to_symbol_definition, identifier);
-    symbol_definition->state = SYMBOL_ASSIGNED;
-    symbol_definition->value = value;
+    system->num_tree_lookups++;
+    struct name_to_symbol_tree_node_t *node;
+    name_to_symbol_tree_lookup (&system->name_to_symbol, identifier, &node);
+    assert (node != NULL && "Assigning undefined symbol.");
+    solver_symbol_assign_handle (system, node->value, value);
 }
 
 void str_cat_matrix (string_t *str, double *matrix, size_t m, size_t n)
@@ -285,462 +1012,4757 @@ void print_matrix (double *matrix, size_t m, size_t n)
     str_free (&str);
 }
 
+// Number of symbols and expressions that haven't been removed. Arrays indexed
+// by symbol id or expression have last_id and expressions_len elements.
 uint32_t system_num_symbols (struct linear_system_t *system)
 {
-    return system->id_to_symbol_definition.num_nodes;
+    return system->last_id - system->free_symbols_len;
 }
 
 uint32_t system_num_equations (struct linear_system_t *system)
 {
-    uint32_t num_equations = 0;
-    struct expression_t *curr_expression = system->expressions;
-    while (curr_expression != NULL) {
-        num_equations++;
-        curr_expression = curr_expression->next;
-    }
-
-    return num_equations;
+    return system->expressions_len - system->free_expressions_len;
 }
 
-double system_get_symbol_value (struct linear_system_t *system, char *name)
+static inline
+struct term_t* expression_terms (struct linear_system_t *system, uint32_t expression)
 {
-    struct symbol_definition_t *symbol_definition =
-        name_to_symbol_definition_get (&system->name_to_symbol_definition, name);
-    return symbol_definition->value;
+    return &system->terms[system->expressions[expression].first_term];
 }
 
-// This implementation of the solver works only if the system is solvable. Some
-// unsolvable systems may cause memory corruption and useless results. In
-// theory, this function can never fail if used correctly, we don't care about
-// error messages or even notifying something bad happened. If there is the
-// slightest chance of something going wrong DON'T USE THIS, use solver_solve().
-void solver_solve_unsafe (struct linear_system_t *system, string_t *error)
+// Symbols whose value is available before elimination, because they were
+// assigned or because presolve computes them.
+static inline
+bool symbol_is_known (struct linear_system_t *system, uint64_t id)
 {
-    uint64_t symbol_id_to_column[system->last_id];
-    uint64_t column_to_symbol_id[system->last_id];
-    int num_unassigned_symbols = 0;
-    BINARY_TREE_FOR (name_to_symbol_definition, &system->name_to_symbol_definition, curr_node) {
-        struct symbol_definition_t *symbol_definition = curr_node->value;
-        if (symbol_definition->state == SYMBOL_UNASSIGNED) {
-            symbol_id_to_column[symbol_definition->id] = num_unassigned_symbols;
-            column_to_symbol_id[num_unassigned_symbols] = symbol_definition->id;
-            num_unassigned_symbols++;
-        }
-    }
+    return system->state[id] == SYMBOL_ASSIGNED || system->is_presolved[id];
+}
 
-    uint32_t num_equations = system_num_equations (system);
+// Symbol that is solved in place of the passed one. Everything after alias
+// merging uses this instead of the symbol of a term.
+static inline
+uint64_t symbol_representative (struct linear_system_t *system, uint64_t id)
+{
+    return system->alias[id];
+}
 
-    if (num_unassigned_symbols > 0) {
-        // Create the matrix
-        size_t m = num_equations;
-        size_t n = num_unassigned_symbols+1;
+static inline
+bool system_expression_is_alias (struct linear_system_t *system, uint32_t expression)
+{
+    return system->expression_is_alias != NULL && system->expression_is_alias[expression];
+}
 
-        mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (&system->pool);
-        double *augmented_matrix = mem_pool_push_array(&system->pool, m*n, double);
-        memset (augmented_matrix, 0, m*n*sizeof(double));
-
-        // Populate the matrix with the data from the parsed expressions
-        int expression_idx = 0;
-        struct expression_t *curr_expression = system->expressions;
-        while (curr_expression != NULL) {
-            double constant = 0;
-
-            struct symbol_t *curr_symbol = curr_expression->symbols;
-            while (curr_symbol != NULL) {
-                if (curr_symbol->definition->state == SYMBOL_ASSIGNED) {
-                    if (curr_symbol->is_negative) {
-                        constant -= curr_symbol->definition->value;
-                    } else {
-                        constant += curr_symbol->definition->value;
-                    }
+double system_get_symbol_value (struct linear_system_t *system, char *name)
+{
+    system->num_tree_lookups++;
+    struct name_to_symbol_tree_node_t *node;
+    name_to_symbol_tree_lookup (&system->name_to_symbol, name, &node);
+    assert (node != NULL && "Reading undefined symbol.");
+    return system->value[node->value];
+}
 
-                } else {
-                    if (curr_symbol->is_negative) {
-                        augmented_matrix[n*expression_idx + symbol_id_to_column[curr_symbol->definition->id]] = -1;
-                    } else {
-                        augmented_matrix[n*expression_idx + symbol_id_to_column[curr_symbol->definition->id]] = 1;
-                    }
-                }
+double solver_symbol_value (struct linear_system_t *system, symbol_handle_t symbol)
+{
+    return system->value[symbol];
+}
 
-                curr_symbol = curr_symbol->next;
-            }
+char* solver_symbol_name (struct linear_system_t *system, symbol_handle_t symbol)
+{
+    return symbol_name (system, symbol);
+}
 
-            augmented_matrix[n*expression_idx+num_unassigned_symbols] = -constant;
+//////////////////////
+// VECTOR KERNELS
+//
+// Dense vector operations used by the solvers. There is an implementation for
+// each instruction set, the one used is chosen the first time they are needed
+// from what the CPU supports, so binaries built for a generic target still use
+// the widest registers available.
+//
+// All implementations accumulate dot products into the same 8 partial sums and
+// add them up in the same order, and none of them uses fused multiply-add, so
+// results are identical no matter which one runs. AVX-512 implies FMA support,
+// contraction has to be disabled there so the compiler doesn't fuse them.
 
-            expression_idx++;
-            curr_expression = curr_expression->next;
-        }
+#define VECTOR_DOT_LANES 8
 
-        // Compute row echelon form of the matrix
-        {
-            // Pivot indices
-            size_t h = 0;
-            size_t k = 0;
+struct vector_kernels_t {
+    const char *name;
 
-            //str_cat_matrix (error, augmented_matrix, m, n);
+    double (*dot) (double *a, double *b, uint32_t n);
 
-            while (h<(m-1) && k<(n-1)) {
-                // Find the row with the leading coefficient of maximum absolute
-                // value.
-                size_t m_i = 0; // Index where the maximum value was found
-                double maximum = 0;
-                {
-                    for (int i=h; i<m; i++) {
-                        if (fabs(augmented_matrix[n*i+k]) > maximum) {
-                            maximum = fabs(augmented_matrix[n*i+k]);
-                            m_i = i;
-                        }
-                    }
-                }
+    // y += alpha*x
+    void (*axpy) (double *y, double alpha, double *x, uint32_t n);
 
-                if (maximum == 0) {
-                    k++;
+    // y = x + beta*y
+    void (*xpby) (double *y, double *x, double beta, uint32_t n);
 
-                } else {
-                    // Swap the found row into row h.
-                    for (int j=0; j<n; j++) {
-                        double tmp = augmented_matrix[n*m_i+j];
-                        augmented_matrix[n*m_i+j] = augmented_matrix[n*h+j];
-                        augmented_matrix[n*h+j] = tmp;
-                    }
+    // Largest absolute value in x, 0 if n is 0.
+    double (*max_abs) (double *x, uint32_t n);
 
-                    // Operate all expressions below pivot to make 0 the k column
-                    for (int i=h+1; i<m; i++) {
-                        double c = augmented_matrix[n*i+k]/augmented_matrix[n*h+k];
-                        augmented_matrix[n*i+k] = 0;
-                        for (int j=k+1; j<n; j++) {
-                            augmented_matrix[n*i+j] -= augmented_matrix[n*h+j]*c;
-                        }
-                    }
+    // Exchanges the contents of x and y, used to swap rows stored
+    // contiguously.
+    void (*swap) (double *x, double *y, uint32_t n);
+};
 
-                    // Go to next pivot
-                    h++;
-                    k++;
-                }
+double vector_dot_reduce (double *lanes, double *a, double *b, uint32_t start, uint32_t n)
+{
+    double sum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+                 ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    for (uint32_t i=start; i<n; i++) {
+        sum += a[i]*b[i];
+    }
+    return sum;
+}
 
-                //str_cat_matrix (error, augmented_matrix, m, n);
-            }
+double vector_dot_scalar (double *a, double *b, uint32_t n)
+{
+    double lanes[VECTOR_DOT_LANES] = {0};
+    uint32_t end = n - n%VECTOR_DOT_LANES;
+    for (uint32_t i=0; i<end; i+=VECTOR_DOT_LANES) {
+        for (int l=0; l<VECTOR_DOT_LANES; l++) {
+            lanes[l] += a[i+l]*b[i+l];
         }
+    }
+    return vector_dot_reduce (lanes, a, b, end, n);
+}
 
-        // Perform back substitution
-        {
-            // This assumes the resulting matrix in row echelon form has the
-            // following additional constraints:
-            //
-            //  - All leading coefficients are in a straight diagonal.
-            //  - The number of linearly independent equations equals the number
-            //    of unassigned symbols.
-            
-            int k = n-2;
-
-            // If there were linearly dependent equations in the beginning,
-            // these will show up as rows with all zeroes at the end. Make h
-            // start at the last non zero row.
-            int h = num_unassigned_symbols-1;
-
-            //str_cat_matrix (error, augmented_matrix, m, n);
+void vector_axpy_scalar (double *y, double alpha, double *x, uint32_t n)
+{
+    for (uint32_t i=0; i<n; i++) {
+        y[i] += alpha*x[i];
+    }
+}
 
-            while (h>=0) {
-                if (augmented_matrix[n*h+k] == 0) {
-                    k--;
+void vector_xpby_scalar (double *y, double *x, double beta, uint32_t n)
+{
+    for (uint32_t i=0; i<n; i++) {
+        y[i] = x[i] + beta*y[i];
+    }
+}
 
-                } else {
-                    augmented_matrix[n*h+n-1] /= augmented_matrix[n*h+k];
-                    augmented_matrix[n*h+k] = 1;
+double vector_max_abs_scalar (double *x, uint32_t n)
+{
+    double maximum = 0;
+    for (uint32_t i=0; i<n; i++) {
+        maximum = MAX (maximum, fabs(x[i]));
+    }
+    return maximum;
+}
 
-                    for (int i=h-1; i>=0; i--) {
-                        augmented_matrix[n*i+n-1] -= augmented_matrix[n*h+n-1]*augmented_matrix[n*i+k];
-                        augmented_matrix[n*i+k] = 0;
-                    }
+void vector_swap_scalar (double *x, double *y, uint32_t n)
+{
+    for (uint32_t i=0; i<n; i++) {
+        double tmp = x[i];
+        x[i] = y[i];
+        y[i] = tmp;
+    }
+}
 
-                    h--;
-                    k--;
-                }
+#if defined(__x86_64__)
+#include <immintrin.h>
 
-                //str_cat_matrix (error, augmented_matrix, m, n);
-            }
+// SSE2 is part of x86-64, so these don't need a target attribute.
+double vector_dot_sse2 (double *a, double *b, uint32_t n)
+{
+    __m128d acc[4];
+    for (int r=0; r<4; r++) acc[r] = _mm_setzero_pd ();
 
-            //str_cat_matrix (error, augmented_matrix, m, n);
+    uint32_t end = n - n%VECTOR_DOT_LANES;
+    for (uint32_t i=0; i<end; i+=VECTOR_DOT_LANES) {
+        for (int r=0; r<4; r++) {
+            acc[r] = _mm_add_pd (acc[r], _mm_mul_pd (_mm_loadu_pd (a+i+2*r), _mm_loadu_pd (b+i+2*r)));
         }
+    }
 
-        // Copy result back into symbol definitions as a solution
-        // NOTE: Only read the results of the first num_unassigned rows.
-        for (int i=0; i<num_unassigned_symbols; i++) {
-            int col = -1;
-            for (int j=0; j<n-1; j++) {
-                if (augmented_matrix[n*i+j] != 0) {
-                    if (col == -1) {
-                        col = j;
-                    }
-                }
-            }
-
-            struct symbol_definition_t *symbol_definition =
-                id_to_symbol_definition_get (&system->id_to_symbol_definition, column_to_symbol_id[col]);
-            symbol_definition->value = augmented_matrix[n*i + n-1];
-            symbol_definition->state = SYMBOL_SOLVED;
-        }
+    double lanes[VECTOR_DOT_LANES];
+    for (int r=0; r<4; r++) _mm_storeu_pd (lanes+2*r, acc[r]);
+    return vector_dot_reduce (lanes, a, b, end, n);
+}
 
-        mem_pool_end_temporary_memory (mrkr);
+void vector_axpy_sse2 (double *y, double alpha, double *x, uint32_t n)
+{
+    __m128d va = _mm_set1_pd (alpha);
+    uint32_t end = n - n%2;
+    for (uint32_t i=0; i<end; i+=2) {
+        _mm_storeu_pd (y+i, _mm_add_pd (_mm_loadu_pd (y+i), _mm_mul_pd (va, _mm_loadu_pd (x+i))));
     }
-
-    system->success = true;
+    vector_axpy_scalar (y+end, alpha, x+end, n-end);
 }
 
-// This is a safe implementation of the solver that can generate partial
-// solutions if only part of the system is unsolvable. It's slower, but will
-// notify when an error happens (by returning false) and try to provide useful
-// error messages.
-bool solver_solve (struct linear_system_t *system, string_t *error)
+void vector_xpby_sse2 (double *y, double *x, double beta, uint32_t n)
 {
-    bool success = true;
+    __m128d vb = _mm_set1_pd (beta);
+    uint32_t end = n - n%2;
+    for (uint32_t i=0; i<end; i+=2) {
+        _mm_storeu_pd (y+i, _mm_add_pd (_mm_loadu_pd (x+i), _mm_mul_pd (vb, _mm_loadu_pd (y+i))));
+    }
+    vector_xpby_scalar (y+end, x+end, beta, n-end);
+}
 
-    uint64_t symbol_id_to_column[system->last_id];
-    uint64_t column_to_symbol_id[system->last_id];
-    int num_unassigned_symbols = 0;
-    BINARY_TREE_FOR (name_to_symbol_definition, &system->name_to_symbol_definition, curr_node) {
-        struct symbol_definition_t *symbol_definition = curr_node->value;
-        if (symbol_definition->state == SYMBOL_UNASSIGNED) {
-            symbol_id_to_column[symbol_definition->id] = num_unassigned_symbols;
-            column_to_symbol_id[num_unassigned_symbols] = symbol_definition->id;
-            num_unassigned_symbols++;
-        }
+double vector_max_abs_sse2 (double *x, uint32_t n)
+{
+    __m128d sign = _mm_set1_pd (-0.0);
+    __m128d maximum = _mm_setzero_pd ();
+    uint32_t end = n - n%2;
+    for (uint32_t i=0; i<end; i+=2) {
+        maximum = _mm_max_pd (maximum, _mm_andnot_pd (sign, _mm_loadu_pd (x+i)));
     }
 
-    uint32_t num_equations = system_num_equations (system);
+    double lanes[2];
+    _mm_storeu_pd (lanes, maximum);
+    return MAX (MAX (lanes[0], lanes[1]), vector_max_abs_scalar (x+end, n-end));
+}
 
-    if (num_unassigned_symbols > 0) {
-        // Create the matrix
-        size_t m = num_equations;
-        size_t n = num_unassigned_symbols+1;
+void vector_swap_sse2 (double *x, double *y, uint32_t n)
+{
+    uint32_t end = n - n%2;
+    for (uint32_t i=0; i<end; i+=2) {
+        __m128d vx = _mm_loadu_pd (x+i);
+        _mm_storeu_pd (x+i, _mm_loadu_pd (y+i));
+        _mm_storeu_pd (y+i, vx);
+    }
+    vector_swap_scalar (x+end, y+end, n-end);
+}
 
-        mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (&system->pool);
-        double *augmented_matrix = mem_pool_push_array(&system->pool, m*n, double);
-        memset (augmented_matrix, 0, m*n*sizeof(double));
-
-        // Populate the matrix with the data from the parsed expressions
-        int expression_idx = 0;
-        struct expression_t *curr_expression = system->expressions;
-        while (curr_expression != NULL) {
-            double constant = 0;
-
-            struct symbol_t *curr_symbol = curr_expression->symbols;
-            while (curr_symbol != NULL) {
-                if (curr_symbol->definition->state == SYMBOL_ASSIGNED) {
-                    if (curr_symbol->is_negative) {
-                        constant -= curr_symbol->definition->value;
-                    } else {
-                        constant += curr_symbol->definition->value;
-                    }
+__attribute__((target("avx2")))
+double vector_dot_avx2 (double *a, double *b, uint32_t n)
+{
+    __m256d acc0 = _mm256_setzero_pd ();
+    __m256d acc1 = _mm256_setzero_pd ();
 
-                } else {
-                    if (curr_symbol->is_negative) {
-                        augmented_matrix[n*expression_idx + symbol_id_to_column[curr_symbol->definition->id]] = -1;
-                    } else {
-                        augmented_matrix[n*expression_idx + symbol_id_to_column[curr_symbol->definition->id]] = 1;
-                    }
-                }
+    uint32_t end = n - n%VECTOR_DOT_LANES;
+    for (uint32_t i=0; i<end; i+=VECTOR_DOT_LANES) {
+        acc0 = _mm256_add_pd (acc0, _mm256_mul_pd (_mm256_loadu_pd (a+i), _mm256_loadu_pd (b+i)));
+        acc1 = _mm256_add_pd (acc1, _mm256_mul_pd (_mm256_loadu_pd (a+i+4), _mm256_loadu_pd (b+i+4)));
+    }
 
-                curr_symbol = curr_symbol->next;
-            }
+    double lanes[VECTOR_DOT_LANES];
+    _mm256_storeu_pd (lanes, acc0);
+    _mm256_storeu_pd (lanes+4, acc1);
+    return vector_dot_reduce (lanes, a, b, end, n);
+}
 
-            augmented_matrix[n*expression_idx+num_unassigned_symbols] = -constant;
+__attribute__((target("avx2")))
+void vector_axpy_avx2 (double *y, double alpha, double *x, uint32_t n)
+{
+    __m256d va = _mm256_set1_pd (alpha);
+    uint32_t end = n - n%4;
+    for (uint32_t i=0; i<end; i+=4) {
+        _mm256_storeu_pd (y+i, _mm256_add_pd (_mm256_loadu_pd (y+i), _mm256_mul_pd (va, _mm256_loadu_pd (x+i))));
+    }
+    vector_axpy_scalar (y+end, alpha, x+end, n-end);
+}
 
-            expression_idx++;
-            curr_expression = curr_expression->next;
-        }
+__attribute__((target("avx2")))
+void vector_xpby_avx2 (double *y, double *x, double beta, uint32_t n)
+{
+    __m256d vb = _mm256_set1_pd (beta);
+    uint32_t end = n - n%4;
+    for (uint32_t i=0; i<end; i+=4) {
+        _mm256_storeu_pd (y+i, _mm256_add_pd (_mm256_loadu_pd (x+i), _mm256_mul_pd (vb, _mm256_loadu_pd (y+i))));
+    }
+    vector_xpby_scalar (y+end, x+end, beta, n-end);
+}
 
-        // Compute row echelon form of the matrix
-        {
-            // Pivot indices
-            size_t h = 0;
-            size_t k = 0;
+__attribute__((target("avx2")))
+double vector_max_abs_avx2 (double *x, uint32_t n)
+{
+    __m256d sign = _mm256_set1_pd (-0.0);
+    __m256d maximum = _mm256_setzero_pd ();
+    uint32_t end = n - n%4;
+    for (uint32_t i=0; i<end; i+=4) {
+        maximum = _mm256_max_pd (maximum, _mm256_andnot_pd (sign, _mm256_loadu_pd (x+i)));
+    }
 
-            //str_cat_matrix (error, augmented_matrix, m, n);
+    double lanes[4];
+    _mm256_storeu_pd (lanes, maximum);
+    return MAX (MAX (MAX (lanes[0], lanes[1]), MAX (lanes[2], lanes[3])),
+                vector_max_abs_scalar (x+end, n-end));
+}
 
-            while (h<(m-1) && k<(n-1)) {
-                // Find the row with the leading coefficient of maximum absolute
-                // value.
-                size_t m_i = 0; // Index where the maximum value was found
-                double maximum = 0;
-                {
-                    for (int i=h; i<m; i++) {
-                        if (fabs(augmented_matrix[n*i+k]) > maximum) {
-                            maximum = fabs(augmented_matrix[n*i+k]);
-                            m_i = i;
-                        }
-                    }
+__attribute__((target("avx2")))
+void vector_swap_avx2 (double *x, double *y, uint32_t n)
+{
+    uint32_t end = n - n%4;
+    for (uint32_t i=0; i<end; i+=4) {
+        __m256d vx = _mm256_loadu_pd (x+i);
+        _mm256_storeu_pd (x+i, _mm256_loadu_pd (y+i));
+        _mm256_storeu_pd (y+i, vx);
+    }
+    vector_swap_scalar (x+end, y+end, n-end);
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+double vector_dot_avx512 (double *a, double *b, uint32_t n)
+{
+    __m512d acc = _mm512_setzero_pd ();
+
+    uint32_t end = n - n%VECTOR_DOT_LANES;
+    for (uint32_t i=0; i<end; i+=VECTOR_DOT_LANES) {
+        acc = _mm512_add_pd (acc, _mm512_mul_pd (_mm512_loadu_pd (a+i), _mm512_loadu_pd (b+i)));
+    }
+
+    double lanes[VECTOR_DOT_LANES];
+    _mm512_storeu_pd (lanes, acc);
+    return vector_dot_reduce (lanes, a, b, end, n);
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+void vector_axpy_avx512 (double *y, double alpha, double *x, uint32_t n)
+{
+    __m512d va = _mm512_set1_pd (alpha);
+    uint32_t end = n - n%8;
+    for (uint32_t i=0; i<end; i+=8) {
+        _mm512_storeu_pd (y+i, _mm512_add_pd (_mm512_loadu_pd (y+i), _mm512_mul_pd (va, _mm512_loadu_pd (x+i))));
+    }
+    vector_axpy_scalar (y+end, alpha, x+end, n-end);
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+void vector_xpby_avx512 (double *y, double *x, double beta, uint32_t n)
+{
+    __m512d vb = _mm512_set1_pd (beta);
+    uint32_t end = n - n%8;
+    for (uint32_t i=0; i<end; i+=8) {
+        _mm512_storeu_pd (y+i, _mm512_add_pd (_mm512_loadu_pd (x+i), _mm512_mul_pd (vb, _mm512_loadu_pd (y+i))));
+    }
+    vector_xpby_scalar (y+end, x+end, beta, n-end);
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+double vector_max_abs_avx512 (double *x, uint32_t n)
+{
+    __m512d maximum = _mm512_setzero_pd ();
+    uint32_t end = n - n%8;
+    for (uint32_t i=0; i<end; i+=8) {
+        maximum = _mm512_max_pd (maximum, _mm512_abs_pd (_mm512_loadu_pd (x+i)));
+    }
+    return MAX (_mm512_reduce_max_pd (maximum), vector_max_abs_scalar (x+end, n-end));
+}
+
+__attribute__((target("avx512f")))
+void vector_swap_avx512 (double *x, double *y, uint32_t n)
+{
+    uint32_t end = n - n%8;
+    for (uint32_t i=0; i<end; i+=8) {
+        __m512d vx = _mm512_loadu_pd (x+i);
+        _mm512_storeu_pd (x+i, _mm512_loadu_pd (y+i));
+        _mm512_storeu_pd (y+i, vx);
+    }
+    vector_swap_scalar (x+end, y+end, n-end);
+}
+#endif
+
+struct vector_kernels_t vector_kernels;
+pthread_once_t vector_kernels_once = PTHREAD_ONCE_INIT;
+
+// Setting the environment variable SOLVER_KERNELS to scalar, sse2 or avx2
+// limits the instruction set used, to compare implementations.
+void vector_kernels_select (void)
+{
+    struct vector_kernels_t scalar = {"scalar", vector_dot_scalar, vector_axpy_scalar, vector_xpby_scalar, vector_max_abs_scalar, vector_swap_scalar};
+    vector_kernels = scalar;
+
+#if defined(__x86_64__)
+    char *limit = getenv ("SOLVER_KERNELS");
+    if (limit != NULL && strcmp (limit, "scalar") == 0) return;
+
+    struct vector_kernels_t sse2 = {"sse2", vector_dot_sse2, vector_axpy_sse2, vector_xpby_sse2, vector_max_abs_sse2, vector_swap_sse2};
+    vector_kernels = sse2;
+    if (limit != NULL && strcmp (limit, "sse2") == 0) return;
+
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2")) {
+        struct vector_kernels_t avx2 = {"avx2", vector_dot_avx2, vector_axpy_avx2, vector_xpby_avx2, vector_max_abs_avx2, vector_swap_avx2};
+        vector_kernels = avx2;
+    }
+    if (limit != NULL && strcmp (limit, "avx2") == 0) return;
+
+    if (__builtin_cpu_supports ("avx512f")) {
+        struct vector_kernels_t avx512 = {"avx512", vector_dot_avx512, vector_axpy_avx512, vector_xpby_avx512, vector_max_abs_avx512, vector_swap_avx512};
+        vector_kernels = avx512;
+    }
+#endif
+}
+
+struct vector_kernels_t* vector_kernels_get (void)
+{
+    pthread_once (&vector_kernels_once, vector_kernels_select);
+    return &vector_kernels;
+}
+
+//////////////////////
+// SPARSE LU ENGINE
+//
+// Equations generated by layouts only have 2 to 4 terms, so storing the
+// augmented matrix densely wastes almost all of the memory and time in zeros.
+// Here the system is stored in CSR form and factored with Gaussian elimination
+// that only ever touches non zero coefficients.
+//
+// Pivots are chosen with the Markowitz heuristic to keep fill low: the column
+// with the least active rows is eliminated first, and from the rows in that
+// column we pick the shortest one whose coefficient isn't much smaller than the
+// largest one (threshold pivoting). Rows don't need to be physically swapped,
+// we just remember the order in which pivots were chosen.
+//
+// The factorization is kept separate from the solve. Factoring only looks at
+// coefficients, the right hand side is processed afterwards by replaying the
+// row operations (L) and doing back substitution (U).
+
+// Coefficients whose absolute value falls below this are considered to be 0.
+// Cancellations in layouts are exact most of the time, this only protects
+// against rounding noise.
+#define SOLVER_EPSILON 1e-9
+
+// A pivot candidate is accepted if its absolute value is at least this fraction
+// of the maximum absolute value in its column.
+#define SPARSE_LU_PIVOT_THRESHOLD 0.1
+
+struct sparse_matrix_t {
+    uint32_t m; // Rows
+    uint32_t n; // Columns
+
+    uint32_t *row_start; // Has m+1 elements
+    uint32_t *cols;
+    double *vals;
+};
+
+struct sparse_lu_t {
+    uint32_t m;
+    uint32_t n;
+
+    // Pivots in the order they were chosen. Row pivot_row[k] of the original
+    // matrix becomes row k of U.
+    uint32_t num_pivots;
+    uint32_t *pivot_row;
+    uint32_t *pivot_col;
+    double *pivot_value;
+
+    // Off diagonal coefficients of U, in CSR form indexed by pivot.
+    uint32_t *u_start; // Has num_pivots+1 elements
+    uint32_t *u_cols;
+    double *u_vals;
+
+    // Row operations applied during elimination, in order. Each one is
+    //   row[op_row] -= op_mult * row[pivot_row[op_pivot]]
+    uint32_t num_ops;
+    uint32_t *op_row;
+    uint32_t *op_pivot;
+    double *op_mult;
+
+    // Rows that ended up being all zeroes, they were linearly dependent on
+    // pivot rows. After the row operations are applied to a right hand side,
+    // if its value isn't 0 for one of these rows, then the system is
+    // overconstrained. dependent_blame_col is the column of the last pivot that
+    // modified the row, or -1 if the row had no coefficients to begin with.
+    uint32_t num_dependent;
+    uint32_t *dependent_row;
+    int64_t *dependent_blame_col;
+
+    // Statistics of the factorization. A row swap is counted when the pivot
+    // isn't the first active row of its column, which is the one elimination
+    // without pivoting would have used.
+    uint32_t num_nonzeros; // In the factored matrix
+    uint32_t num_row_swaps;
+    uint64_t num_flops;
+    uint64_t scratch_size;
+};
+
+// Growable arrays used while factoring, the number of pivots and operations
+// isn't known in advance.
+struct sparse_lu_builder_t {
+    DYNAMIC_ARRAY_DEFINE (uint32_t, pivot_row);
+    DYNAMIC_ARRAY_DEFINE (uint32_t, pivot_col);
+    DYNAMIC_ARRAY_DEFINE (uint32_t, op_row);
+    DYNAMIC_ARRAY_DEFINE (uint32_t, op_pivot);
+    DYNAMIC_ARRAY_DEFINE (double, op_mult);
+};
+
+struct sparse_row_t {
+    uint32_t len;
+    uint32_t size;
+    uint32_t *cols;
+    double *vals;
+};
+
+struct index_list_t {
+    uint32_t len;
+    uint32_t size;
+    uint32_t *idx;
+};
+
+void sparse_row_grow (mem_pool_t *pool, struct sparse_row_t *row)
+{
+    uint32_t new_size = row->size == 0 ? 4 : 2*row->size;
+    uint32_t *new_cols = mem_pool_push_array_aligned (pool, new_size, uint32_t);
+    double *new_vals = mem_pool_push_array_aligned (pool, new_size, double);
+    if (row->len > 0) {
+        memcpy (new_cols, row->cols, row->len*sizeof(uint32_t));
+        memcpy (new_vals, row->vals, row->len*sizeof(double));
+    }
+    row->cols = new_cols;
+    row->vals = new_vals;
+    row->size = new_size;
+}
+
+void index_list_push (mem_pool_t *pool, struct index_list_t *list, uint32_t idx)
+{
+    if (list->len == list->size) {
+        uint32_t new_size = list->size == 0 ? 4 : 2*list->size;
+        uint32_t *new_idx = mem_pool_push_array_aligned (pool, new_size, uint32_t);
+        if (list->len > 0) {
+            memcpy (new_idx, list->idx, list->len*sizeof(uint32_t));
+        }
+        list->idx = new_idx;
+        list->size = new_size;
+    }
+    list->idx[list->len++] = idx;
+}
+
+// Binary min heap of 64 bit keys. Used to find the column with least active
+// rows, keys are (count << 32 | column) so ties are broken by column index and
+// the factorization is deterministic. Entries aren't updated in place, a new
+// key is pushed every time a count changes and stale ones are skipped on pop.
+struct u64_heap_t {
+    DYNAMIC_ARRAY_DEFINE (uint64_t, keys);
+};
+
+void u64_heap_push (struct u64_heap_t *heap, uint64_t key)
+{
+    DYNAMIC_ARRAY_APPEND (heap->keys, key);
+
+    int i = heap->keys_len - 1;
+    while (i > 0) {
+        int parent = (i-1)/2;
+        if (heap->keys[parent] <= heap->keys[i]) break;
+
+        uint64_t tmp = heap->keys[parent];
+        heap->keys[parent] = heap->keys[i];
+        heap->keys[i] = tmp;
+        i = parent;
+    }
+}
+
+bool u64_heap_pop (struct u64_heap_t *heap, uint64_t *key)
+{
+    if (heap->keys_len == 0) return false;
+
+    *key = heap->keys[0];
+    heap->keys_len--;
+    heap->keys[0] = heap->keys[heap->keys_len];
+
+    int i = 0;
+    while (true) {
+        int smallest = i;
+        int l = 2*i + 1;
+        int r = 2*i + 2;
+        if (l < heap->keys_len && heap->keys[l] < heap->keys[smallest]) smallest = l;
+        if (r < heap->keys_len && heap->keys[r] < heap->keys[smallest]) smallest = r;
+        if (smallest == i) break;
+
+        uint64_t tmp = heap->keys[smallest];
+        heap->keys[smallest] = heap->keys[i];
+        heap->keys[i] = tmp;
+        i = smallest;
+    }
+
+    return true;
+}
+
+void u64_heap_destroy (struct u64_heap_t *heap)
+{
+    free (heap->keys);
+    *heap = ZERO_INIT (struct u64_heap_t);
+}
+
+#define SPARSE_LU_COL_KEY(count,col) (((uint64_t)(count) << 32) | (col))
+
+// Factors A, the result is allocated in pool. Scratch memory is released before
+// returning.
+void sparse_lu_factor (mem_pool_t *pool, struct sparse_matrix_t *A, struct sparse_lu_t *lu)
+{
+    uint32_t m = A->m;
+    uint32_t n = A->n;
+
+    mem_pool_t scratch = {0};
+
+    *lu = ZERO_INIT (struct sparse_lu_t);
+    lu->m = m;
+    lu->n = n;
+
+    // Load rows into growable storage, fill will be appended at the end of
+    // each row.
+    struct sparse_row_t *rows = mem_pool_push_array_aligned (&scratch, m, struct sparse_row_t);
+    struct index_list_t *col_rows = mem_pool_push_array_aligned (&scratch, n, struct index_list_t);
+    uint32_t *col_count = mem_pool_push_array_aligned (&scratch, n, uint32_t);
+    bool *row_active = mem_pool_push_array (&scratch, m, bool);
+    bool *col_done = mem_pool_push_array (&scratch, n, bool);
+    int64_t *row_blame = mem_pool_push_array_aligned (&scratch, m, int64_t);
+    memset (col_rows, 0, n*sizeof(struct index_list_t));
+    memset (col_count, 0, n*sizeof(uint32_t));
+    memset (col_done, 0, n*sizeof(bool));
+
+    for (uint32_t i=0; i<m; i++) {
+        struct sparse_row_t *row = &rows[i];
+        *row = ZERO_INIT (struct sparse_row_t);
+        row_active[i] = true;
+        row_blame[i] = -1;
+
+        uint32_t len = A->row_start[i+1] - A->row_start[i];
+        if (len > 0) {
+            row->size = len;
+            row->cols = mem_pool_push_array_aligned (&scratch, len, uint32_t);
+            row->vals = mem_pool_push_array_aligned (&scratch, len, double);
+            memcpy (row->cols, A->cols + A->row_start[i], len*sizeof(uint32_t));
+            memcpy (row->vals, A->vals + A->row_start[i], len*sizeof(double));
+            row->len = len;
+        }
+
+        for (uint32_t e=0; e<row->len; e++) {
+            index_list_push (&scratch, &col_rows[row->cols[e]], i);
+            col_count[row->cols[e]]++;
+        }
+    }
+
+    struct u64_heap_t heap = {0};
+    for (uint32_t j=0; j<n; j++) {
+        u64_heap_push (&heap, SPARSE_LU_COL_KEY(col_count[j], j));
+    }
+
+    // Position+1 of each column inside the row currently being updated, 0 if
+    // the column isn't there.
+    uint32_t *work_pos = mem_pool_push_array_aligned (&scratch, n, uint32_t);
+    memset (work_pos, 0, n*sizeof(uint32_t));
+
+    struct sparse_lu_builder_t _b = {0};
+    struct sparse_lu_builder_t *b = &_b;
+
+    uint64_t key;
+    while (u64_heap_pop (&heap, &key)) {
+        uint32_t c = key & 0xFFFFFFFF;
+        uint32_t count = key >> 32;
+        if (col_done[c] || count != col_count[c]) continue;
+
+        col_done[c] = true;
+        if (count == 0) {
+            // No active row has this column, it will stay free.
+            continue;
+        }
+
+        // Find the maximum absolute value in the column among active rows.
+        double maximum = 0;
+        for (uint32_t r=0; r<col_rows[c].len; r++) {
+            uint32_t i = col_rows[c].idx[r];
+            if (!row_active[i]) continue;
+
+            struct sparse_row_t *row = &rows[i];
+            for (uint32_t e=0; e<row->len; e++) {
+                if (row->cols[e] == c && fabs(row->vals[e]) > maximum) {
+                    maximum = fabs(row->vals[e]);
+                }
+            }
+        }
+
+        // Choose the shortest row with an acceptable coefficient.
+        int64_t p = -1;
+        int64_t first_active = -1;
+        for (uint32_t r=0; r<col_rows[c].len; r++) {
+            uint32_t i = col_rows[c].idx[r];
+            if (!row_active[i]) continue;
+
+            if (first_active == -1 || i < first_active) first_active = i;
+
+            struct sparse_row_t *row = &rows[i];
+            for (uint32_t e=0; e<row->len; e++) {
+                if (row->cols[e] == c && fabs(row->vals[e]) >= SPARSE_LU_PIVOT_THRESHOLD*maximum) {
+                    if (p == -1 || row->len < rows[p].len || (row->len == rows[p].len && i < p)) {
+                        p = i;
+                    }
+                }
+            }
+        }
+        assert (p != -1);
+        if (p != first_active) lu->num_row_swaps++;
+
+        struct sparse_row_t *prow = &rows[p];
+        double pivot_value = 0;
+        for (uint32_t e=0; e<prow->len; e++) {
+            if (prow->cols[e] == c) pivot_value = prow->vals[e];
+        }
+
+        uint32_t k = b->pivot_row_len;
+        DYNAMIC_ARRAY_APPEND (b->pivot_row, p);
+        DYNAMIC_ARRAY_APPEND (b->pivot_col, c);
+        row_active[p] = false;
+
+        // The pivot row leaves the active submatrix.
+        for (uint32_t e=0; e<prow->len; e++) {
+            uint32_t j = prow->cols[e];
+            col_count[j]--;
+            if (!col_done[j]) u64_heap_push (&heap, SPARSE_LU_COL_KEY(col_count[j], j));
+        }
+
+        // Eliminate column c from all other active rows.
+        for (uint32_t r=0; r<col_rows[c].len; r++) {
+            uint32_t i = col_rows[c].idx[r];
+            if (!row_active[i]) continue;
+
+            struct sparse_row_t *row = &rows[i];
+            double a_ic = 0;
+            for (uint32_t e=0; e<row->len; e++) {
+                work_pos[row->cols[e]] = e+1;
+                if (row->cols[e] == c) a_ic = row->vals[e];
+            }
+
+            if (a_ic != 0) {
+                double mult = a_ic/pivot_value;
+                DYNAMIC_ARRAY_APPEND (b->op_row, i);
+                DYNAMIC_ARRAY_APPEND (b->op_pivot, k);
+                DYNAMIC_ARRAY_APPEND (b->op_mult, mult);
+                row_blame[i] = c;
+                lu->num_flops += 1 + 2*(prow->len - 1);
+
+                for (uint32_t e=0; e<prow->len; e++) {
+                    uint32_t j = prow->cols[e];
+                    if (j == c) continue;
+
+                    if (work_pos[j] != 0) {
+                        row->vals[work_pos[j]-1] -= mult*prow->vals[e];
+
+                    } else {
+                        // Fill in
+                        if (row->len == row->size) {
+                            sparse_row_grow (&scratch, row);
+                        }
+                        row->cols[row->len] = j;
+                        row->vals[row->len] = -mult*prow->vals[e];
+                        row->len++;
+                        work_pos[j] = row->len;
+
+                        index_list_push (&scratch, &col_rows[j], i);
+                        col_count[j]++;
+                        if (!col_done[j]) u64_heap_push (&heap, SPARSE_LU_COL_KEY(col_count[j], j));
+                    }
+                }
+
+            }
+
+            // Remove the eliminated coefficient and any cancellation.
+            uint32_t new_len = 0;
+            for (uint32_t e=0; e<row->len; e++) {
+                uint32_t j = row->cols[e];
+                work_pos[j] = 0;
+
+                if (j == c || fabs(row->vals[e]) < SOLVER_EPSILON) {
+                    col_count[j]--;
+                    if (!col_done[j]) u64_heap_push (&heap, SPARSE_LU_COL_KEY(col_count[j], j));
+
+                } else {
+                    row->cols[new_len] = j;
+                    row->vals[new_len] = row->vals[e];
+                    new_len++;
+                }
+            }
+            row->len = new_len;
+        }
+    }
+
+    // Copy the result into the output pool.
+    lu->num_pivots = b->pivot_row_len;
+    lu->pivot_row = mem_pool_push_array_aligned (pool, lu->num_pivots, uint32_t);
+    lu->pivot_col = mem_pool_push_array_aligned (pool, lu->num_pivots, uint32_t);
+    lu->pivot_value = mem_pool_push_array_aligned (pool, lu->num_pivots, double);
+    lu->u_start = mem_pool_push_array_aligned (pool, lu->num_pivots+1, uint32_t);
+
+    uint32_t u_nnz = 0;
+    for (uint32_t k=0; k<lu->num_pivots; k++) {
+        u_nnz += rows[b->pivot_row[k]].len - 1;
+    }
+    lu->u_cols = mem_pool_push_array_aligned (pool, u_nnz, uint32_t);
+    lu->u_vals = mem_pool_push_array_aligned (pool, u_nnz, double);
+
+    uint32_t u_pos = 0;
+    for (uint32_t k=0; k<lu->num_pivots; k++) {
+        struct sparse_row_t *row = &rows[b->pivot_row[k]];
+        lu->pivot_row[k] = b->pivot_row[k];
+        lu->pivot_col[k] = b->pivot_col[k];
+        lu->u_start[k] = u_pos;
+        for (uint32_t e=0; e<row->len; e++) {
+            if (row->cols[e] == b->pivot_col[k]) {
+                lu->pivot_value[k] = row->vals[e];
+            } else {
+                lu->u_cols[u_pos] = row->cols[e];
+                lu->u_vals[u_pos] = row->vals[e];
+                u_pos++;
+            }
+        }
+    }
+    lu->u_start[lu->num_pivots] = u_pos;
+
+    lu->num_ops = b->op_row_len;
+    lu->op_row = mem_pool_push_array_aligned (pool, lu->num_ops, uint32_t);
+    lu->op_pivot = mem_pool_push_array_aligned (pool, lu->num_ops, uint32_t);
+    lu->op_mult = mem_pool_push_array_aligned (pool, lu->num_ops, double);
+    if (lu->num_ops > 0) {
+        memcpy (lu->op_row, b->op_row, lu->num_ops*sizeof(uint32_t));
+        memcpy (lu->op_pivot, b->op_pivot, lu->num_ops*sizeof(uint32_t));
+        memcpy (lu->op_mult, b->op_mult, lu->num_ops*sizeof(double));
+    }
+
+    lu->num_dependent = 0;
+    for (uint32_t i=0; i<m; i++) {
+        if (row_active[i]) lu->num_dependent++;
+    }
+    lu->dependent_row = mem_pool_push_array_aligned (pool, lu->num_dependent, uint32_t);
+    lu->dependent_blame_col = mem_pool_push_array_aligned (pool, lu->num_dependent, int64_t);
+    uint32_t dependent_idx = 0;
+    for (uint32_t i=0; i<m; i++) {
+        if (row_active[i]) {
+            // All columns were processed, so active rows can't have any
+            // coefficient left.
+            assert (rows[i].len == 0);
+            lu->dependent_row[dependent_idx] = i;
+            lu->dependent_blame_col[dependent_idx] = row_blame[i];
+            dependent_idx++;
+        }
+    }
+
+    lu->num_nonzeros = A->row_start[m];
+    lu->scratch_size = scratch.total_data;
+
+    free (b->pivot_row);
+    free (b->pivot_col);
+    free (b->op_row);
+    free (b->op_pivot);
+    free (b->op_mult);
+    u64_heap_destroy (&heap);
+    mem_pool_destroy (&scratch);
+}
+
+// Floating point operations done by sparse_lu_solve().
+uint64_t sparse_lu_solve_flops (struct sparse_lu_t *lu)
+{
+    return 2*(uint64_t)lu->num_ops + 2*(uint64_t)lu->u_start[lu->num_pivots] + lu->num_pivots;
+}
+
+// Solves for the right hand side b, which is overwritten by the row operations.
+// Only columns that got a pivot, and whose U row doesn't depend on a free
+// column, get a value. These are marked in the known array. After this
+// returns, b[lu->dependent_row[i]] is the residual of each dependent row.
+void sparse_lu_solve (struct sparse_lu_t *lu, double *b, double *x, bool *known)
+{
+    for (uint32_t o=0; o<lu->num_ops; o++) {
+        b[lu->op_row[o]] -= lu->op_mult[o]*b[lu->pivot_row[lu->op_pivot[o]]];
+    }
+
+    for (uint32_t j=0; j<lu->n; j++) {
+        known[j] = false;
+        x[j] = 0;
+    }
+
+    for (int64_t k=(int64_t)lu->num_pivots-1; k>=0; k--) {
+        bool is_known = true;
+        double value = b[lu->pivot_row[k]];
+        for (uint32_t e=lu->u_start[k]; e<lu->u_start[k+1]; e++) {
+            uint32_t j = lu->u_cols[e];
+            if (!known[j]) {
+                is_known = false;
+                break;
+            }
+            value -= lu->u_vals[e]*x[j];
+        }
+
+        uint32_t c = lu->pivot_col[k];
+        if (is_known) {
+            x[c] = value/lu->pivot_value[k];
+            known[c] = true;
+        }
+    }
+}
+
+// Prints the factored system as a dense matrix in row echelon form, the pivot
+// rows first, then the dependent ones. This is only useful for debugging small
+// systems, for big ones nothing is printed.
+#define SPARSE_LU_MAX_PRINTED_SIZE 4096
+void str_cat_sparse_lu (string_t *str, struct sparse_lu_t *lu, double *b)
+{
+    size_t m = lu->m;
+    size_t n = lu->n + 1;
+    if (m*n > SPARSE_LU_MAX_PRINTED_SIZE) {
+        str_cat_printf (str, "(%u x %u matrix not printed)\n\n", lu->m, lu->n);
+        return;
+    }
+
+    double *matrix = calloc (m*n, sizeof(double));
+    size_t h = 0;
+    for (uint32_t k=0; k<lu->num_pivots; k++, h++) {
+        matrix[n*h + lu->pivot_col[k]] = lu->pivot_value[k];
+        for (uint32_t e=lu->u_start[k]; e<lu->u_start[k+1]; e++) {
+            matrix[n*h + lu->u_cols[e]] = lu->u_vals[e];
+        }
+        matrix[n*h + n-1] = b[lu->pivot_row[k]];
+    }
+
+    for (uint32_t i=0; i<lu->num_dependent; i++, h++) {
+        matrix[n*h + n-1] = b[lu->dependent_row[i]];
+    }
+
+    str_cat_matrix (str, matrix, m, n);
+    free (matrix);
+}
+
+//////////////////////
+// DENSE LU ENGINE
+//
+// Components where a good fraction of the coefficients are non zero gain
+// nothing from sparse storage, the bookkeeping of sparse LU just slows them
+// down. These are stored as a column major dense matrix and factored with
+// partial pivoting, the same way LAPACK's dgetrf does:
+//
+//  - Columns are processed in panels of DENSE_LU_PANEL_WIDTH. A panel is
+//    factored column by column only updating the columns of the panel.
+//
+//  - The update of the trailing columns is delayed until the panel is done,
+//    then applied one block of DENSE_LU_ROW_BLOCK rows at a time. The part of
+//    the panel in a row block stays in cache while it's applied to every
+//    trailing column, instead of streaming the whole trailing matrix from
+//    memory once per pivot.
+//
+// Columns without a pivot above SOLVER_EPSILON are left free and rows left
+// without pivot at the end are dependent, with the same meaning they have in
+// sparse_lu_t. Which symbols are determined is computed exactly, from the null
+// space of U, instead of by looking at which U rows reference free columns. That
+// depends on the pivot order, and partial pivoting doesn't choose pivots that
+// keep rows short like Markowitz does.
+
+#define DENSE_LU_PANEL_WIDTH 32
+#define DENSE_LU_ROW_BLOCK 512
+
+// Trailing updates are only split across threads if they take at least this
+// many flops, and each thread gets at least DENSE_LU_MIN_TASK_ROWS rows.
+// Smaller factorizations stay single threaded.
+#define DENSE_LU_PARALLEL_MIN_FLOPS (1 << 22)
+#define DENSE_LU_MIN_TASK_ROWS 64
+
+// Components with at least this many columns and this fraction of non zero
+// coefficients are factored with dense LU.
+#define DENSE_LU_MIN_COLUMNS 32
+#define DENSE_LU_MIN_DENSITY 0.05
+
+#define DENSE_LU_FREE_COLUMN UINT32_MAX
+
+struct dense_lu_t {
+    uint32_t m;
+    uint32_t n;
+
+    // Factored matrix, column major. Position k holds row k of U, pivot
+    // included, and the multipliers of L below the pivot of each column.
+    double *a;
+
+    // Row of A that ended up in each position.
+    uint32_t *row_perm;
+
+    // Column of the pivot in position k, and position of the pivot of each
+    // column, DENSE_LU_FREE_COLUMN if it didn't get one.
+    uint32_t num_pivots;
+    uint32_t *pivot_col;
+    uint32_t *col_pivot;
+
+    // Columns that have the same value in all solutions.
+    bool *col_determined;
+
+    // Positions num_pivots to m-1, like in sparse_lu_t.
+    uint32_t num_dependent;
+    uint32_t *dependent_row;
+    int64_t *dependent_blame_col;
+
+    uint32_t num_nonzeros; // In A
+    uint32_t num_row_swaps;
+    uint64_t num_flops;
+};
+
+bool dense_lu_is_worth_it (struct sparse_matrix_t *A)
+{
+    return A->n >= DENSE_LU_MIN_COLUMNS &&
+        A->row_start[A->m] >= DENSE_LU_MIN_DENSITY*(double)A->m*(double)A->n;
+}
+
+// Storage is column major, so the elements of a row are m apart. Exchanging
+// them is a strided gather and scatter that doesn't vectorize, unlike the
+// contiguous rows of banded LU that use the swap kernel.
+void dense_lu_swap_rows (struct dense_lu_t *lu, uint32_t r1, uint32_t r2)
+{
+    double *a = lu->a;
+    size_t m = lu->m;
+    for (size_t j=0; j<lu->n; j++) {
+        double tmp = a[j*m + r1];
+        a[j*m + r1] = a[j*m + r2];
+        a[j*m + r2] = tmp;
+    }
+
+    uint32_t tmp = lu->row_perm[r1];
+    lu->row_perm[r1] = lu->row_perm[r2];
+    lu->row_perm[r2] = tmp;
+}
+
+// Factors the panel of columns [j0, j1), starting at pivot position k. Returns
+// the position of the next pivot.
+uint32_t dense_lu_factor_panel (struct dense_lu_t *lu, struct vector_kernels_t *kernels,
+                                uint32_t j0, uint32_t j1, uint32_t k)
+{
+    size_t m = lu->m;
+    for (uint32_t j=j0; j<j1; j++) {
+        double *col = lu->a + j*m;
+        double maximum = k < m ? kernels->max_abs (col+k, m-k) : 0;
+        if (maximum <= SOLVER_EPSILON) {
+            // Leave remaining rows exactly 0, so this column doesn't get
+            // updated by later pivots.
+            for (uint32_t r=k; r<m; r++) col[r] = 0;
+            lu->col_pivot[j] = DENSE_LU_FREE_COLUMN;
+            continue;
+        }
+
+        // First row with the maximum, so ties are broken the same way as the
+        // scalar search would.
+        uint32_t p = k;
+        while (fabs(col[p]) != maximum) p++;
+        if (p != k) {
+            dense_lu_swap_rows (lu, k, p);
+            lu->num_row_swaps++;
+        }
+
+        double pivot_value = col[k];
+        for (uint32_t r=k+1; r<m; r++) {
+            col[r] /= pivot_value;
+        }
+
+        for (uint32_t jj=j+1; jj<j1; jj++) {
+            double u = lu->a[jj*m + k];
+            if (u != 0) {
+                kernels->axpy (lu->a + jj*m + k+1, -u, col + k+1, m-k-1);
+            }
+        }
+        lu->num_flops += (m-k-1) + 2*(uint64_t)(m-k-1)*(j1-j-1);
+
+        lu->pivot_col[k] = j;
+        lu->col_pivot[j] = k;
+        k++;
+    }
+    return k;
+}
+
+// Applies the pivots in positions [k0, k1), which belong to the panel ending
+// at column j1, to rows [r0, r1) of the trailing columns.
+void dense_lu_update_rows (struct dense_lu_t *lu, struct vector_kernels_t *kernels,
+                           uint32_t j1, uint32_t k0, uint32_t k1, uint32_t r0, uint32_t r1)
+{
+    size_t m = lu->m;
+    for (uint32_t jj=j1; jj<lu->n; jj++) {
+        double *col = lu->a + jj*m;
+        for (uint32_t t=k0; t<k1; t++) {
+            // Rows of U in the panel are themselves updated by the pivots
+            // above them, only rows below t depend on u.
+            uint32_t start = MAX (r0, t+1);
+            double u = col[t];
+            if (u != 0 && start < r1) {
+                kernels->axpy (col + start, -u, lu->a + lu->pivot_col[t]*m + start, r1-start);
+            }
+        }
+    }
+}
+
+// Back substitution of U with the values of free columns already set in x.
+void dense_lu_back_substitute (struct dense_lu_t *lu, double *x)
+{
+    size_t m = lu->m;
+    for (int64_t t=(int64_t)lu->num_pivots-1; t>=0; t--) {
+        double value = x[lu->pivot_col[t]];
+        for (uint32_t j=0; j<lu->n; j++) {
+            // Row t of U only has the columns pivoted after it and the free
+            // ones, the others hold multipliers of L.
+            uint32_t pivot = lu->col_pivot[j];
+            if (pivot != DENSE_LU_FREE_COLUMN && pivot <= t) continue;
+            value -= lu->a[j*m + t]*x[j];
+        }
+
+        uint32_t c = lu->pivot_col[t];
+        x[c] = value/lu->a[c*m + t];
+    }
+}
+
+// Trailing updates of rows [r0, r1), split into DENSE_LU_ROW_BLOCK blocks.
+struct dense_lu_update_task_t {
+    struct dense_lu_t *lu;
+    struct vector_kernels_t *kernels;
+    uint32_t j1, k0, k1;
+    uint32_t r0, r1;
+};
+
+THREAD_POOL_TASK (dense_lu_update_task)
+{
+    struct dense_lu_update_task_t *task = (struct dense_lu_update_task_t*)data;
+    for (uint32_t r0=task->r0; r0<task->r1; r0+=DENSE_LU_ROW_BLOCK) {
+        dense_lu_update_rows (task->lu, task->kernels, task->j1, task->k0, task->k1,
+                              r0, MIN (r0 + DENSE_LU_ROW_BLOCK, task->r1));
+    }
+}
+
+// Factors A, the result is allocated in pool. If threads isn't NULL, trailing
+// updates with enough work are split by rows across its workers. Every entry
+// is still updated by the same pivots in the same order, so the result
+// doesn't depend on the number of threads.
+void dense_lu_factor (mem_pool_t *pool, struct sparse_matrix_t *A, struct dense_lu_t *lu,
+                      struct thread_pool_t *threads)
+{
+    struct vector_kernels_t *kernels = vector_kernels_get ();
+    size_t m = A->m;
+    size_t n = A->n;
+
+    *lu = ZERO_INIT (struct dense_lu_t);
+    lu->m = m;
+    lu->n = n;
+    lu->num_nonzeros = A->row_start[m];
+
+    lu->a = mem_pool_push_array_aligned (pool, m*n, double);
+    for (size_t e=0; e<m*n; e++) {
+        lu->a[e] = 0;
+    }
+    for (uint32_t i=0; i<m; i++) {
+        for (uint32_t e=A->row_start[i]; e<A->row_start[i+1]; e++) {
+            lu->a[A->cols[e]*m + i] = A->vals[e];
+        }
+    }
+
+    lu->row_perm = mem_pool_push_array_aligned (pool, m, uint32_t);
+    for (uint32_t i=0; i<m; i++) {
+        lu->row_perm[i] = i;
+    }
+    lu->pivot_col = mem_pool_push_array_aligned (pool, MIN(m, n), uint32_t);
+    lu->col_pivot = mem_pool_push_array_aligned (pool, n, uint32_t);
+
+    mem_pool_t scratch = {0};
+    int num_workers = threads != NULL ? threads->num_workers : 1;
+    struct dense_lu_update_task_t *task_data =
+        mem_pool_push_array_aligned (&scratch, num_workers, struct dense_lu_update_task_t);
+    struct thread_pool_task_info_t *tasks =
+        mem_pool_push_array_aligned (&scratch, num_workers, struct thread_pool_task_info_t);
+
+    uint32_t k = 0;
+    for (uint32_t j0=0; j0<n; j0+=DENSE_LU_PANEL_WIDTH) {
+        uint32_t j1 = MIN (j0 + DENSE_LU_PANEL_WIDTH, n);
+        uint32_t k0 = k;
+        k = dense_lu_factor_panel (lu, kernels, j0, j1, k0);
+
+        // Rows of the panel's pivots first, their values are used by the
+        // updates of all rows below.
+        if (k > k0 && j1 < n) {
+            dense_lu_update_rows (lu, kernels, j1, k0, k, k0, k);
+
+            // Rows below are independent from each other. Thread pool runs
+            // return after all tasks are done, which is the barrier before
+            // the next panel.
+            uint64_t update_flops = 2*(uint64_t)(k-k0)*(n-j1)*(m-k);
+            uint32_t num_rows = m - k;
+            int num_tasks = 1;
+            if (num_workers > 1 && update_flops >= DENSE_LU_PARALLEL_MIN_FLOPS) {
+                num_tasks = MIN (num_workers, num_rows/DENSE_LU_MIN_TASK_ROWS);
+                num_tasks = MAX (num_tasks, 1);
+            }
+
+            // Multiples of 8 rows, so tasks don't share cache lines.
+            uint32_t task_rows = ((num_rows + num_tasks - 1)/num_tasks + 7) & ~7;
+            int t = 0;
+            for (uint32_t r0=k; r0<m; r0+=task_rows, t++) {
+                task_data[t] = (struct dense_lu_update_task_t){lu, kernels, j1, k0, k, r0, MIN (r0 + task_rows, m)};
+                tasks[t].task = dense_lu_update_task;
+                tasks[t].data = &task_data[t];
+            }
+
+            if (t > 1) {
+                thread_pool_run (threads, tasks, t);
+            } else if (t == 1) {
+                dense_lu_update_task (NULL, &task_data[0]);
+            }
+            lu->num_flops += 2*(uint64_t)(k-k0)*(n-j1)*(m-k0);
+        }
+    }
+    lu->num_pivots = k;
+
+    lu->num_dependent = m - k;
+    lu->dependent_row = mem_pool_push_array_aligned (pool, lu->num_dependent, uint32_t);
+    lu->dependent_blame_col = mem_pool_push_array_aligned (pool, lu->num_dependent, int64_t);
+    for (uint32_t r=k; r<m; r++) {
+        // Blame the last pivot that modified the row.
+        int64_t blame = -1;
+        for (uint32_t t=0; t<k; t++) {
+            if (lu->a[lu->pivot_col[t]*m + r] != 0) blame = lu->pivot_col[t];
+        }
+
+        lu->dependent_row[r-k] = lu->row_perm[r];
+        lu->dependent_blame_col[r-k] = blame;
+    }
+
+    // Each free column gives a vector of the null space, with 1 in that column
+    // and 0 in the other free ones. A pivot column is determined if it's 0 in
+    // all of them.
+    lu->col_determined = mem_pool_push_array (pool, n, bool);
+    for (uint32_t j=0; j<n; j++) {
+        lu->col_determined[j] = lu->col_pivot[j] != DENSE_LU_FREE_COLUMN;
+    }
+
+    double *null_vector = mem_pool_push_array_aligned (&scratch, n, double);
+    for (uint32_t f=0; f<n; f++) {
+        if (lu->col_pivot[f] != DENSE_LU_FREE_COLUMN) continue;
+
+        for (uint32_t j=0; j<n; j++) {
+            null_vector[j] = 0;
+        }
+        null_vector[f] = 1;
+        dense_lu_back_substitute (lu, null_vector);
+        lu->num_flops += 2*(uint64_t)k*n;
+
+        for (uint32_t t=0; t<k; t++) {
+            if (fabs(null_vector[lu->pivot_col[t]]) > SOLVER_EPSILON) {
+                lu->col_determined[lu->pivot_col[t]] = false;
+            }
+        }
+    }
+    mem_pool_destroy (&scratch);
+}
+
+// Floating point operations done by dense_lu_solve().
+uint64_t dense_lu_solve_flops (struct dense_lu_t *lu)
+{
+    uint64_t k = lu->num_pivots;
+    return k*(2*(uint64_t)lu->m - k - 1) + 2*k*lu->n;
+}
+
+// Same as sparse_lu_solve(). Free columns are set to 0, which gives one of
+// the solutions, only values of determined columns are marked as known.
+void dense_lu_solve (struct dense_lu_t *lu, double *b, double *x, bool *known)
+{
+    size_t m = lu->m;
+    double *a = lu->a;
+    uint32_t *row_perm = lu->row_perm;
+
+    for (uint32_t t=0; t<lu->num_pivots; t++) {
+        double *l = a + lu->pivot_col[t]*m;
+        double b_t = b[row_perm[t]];
+        for (uint32_t r=t+1; r<m; r++) {
+            b[row_perm[r]] -= l[r]*b_t;
+        }
+    }
+
+    for (uint32_t j=0; j<lu->n; j++) {
+        x[j] = 0;
+        known[j] = lu->col_determined[j];
+    }
+    for (uint32_t t=0; t<lu->num_pivots; t++) {
+        x[lu->pivot_col[t]] = b[row_perm[t]];
+    }
+    dense_lu_back_substitute (lu, x);
+}
+
+// Like str_cat_sparse_lu().
+void str_cat_dense_lu (string_t *str, struct dense_lu_t *lu, double *b)
+{
+    size_t m = lu->m;
+    size_t n = lu->n + 1;
+    if (m*n > SPARSE_LU_MAX_PRINTED_SIZE) {
+        str_cat_printf (str, "(%u x %u matrix not printed)\n\n", lu->m, lu->n);
+        return;
+    }
+
+    double *matrix = calloc (m*n, sizeof(double));
+    for (uint32_t t=0; t<m; t++) {
+        for (uint32_t j=0; j<lu->n && t<lu->num_pivots; j++) {
+            uint32_t pivot = lu->col_pivot[j];
+            if (pivot == DENSE_LU_FREE_COLUMN || pivot >= t) {
+                matrix[n*t + j] = lu->a[j*m + t];
+            }
+        }
+        matrix[n*t + n-1] = b[lu->row_perm[t]];
+    }
+
+    str_cat_matrix (str, matrix, m, n);
+    free (matrix);
+}
+
+//////////////////////
+// BANDED LU ENGINE
+//
+// Columns of a component are numbered in symbol id order, which is the order
+// symbols were created in. Layouts create all symbols of a rectangle together,
+// so symbols of a chain or a grid that are related by equations through
+// different rectangles end up far apart in the matrix. Reverse Cuthill-McKee
+// renumbers columns by walking the graph where two columns are neighbors if
+// they share an equation, in breadth first order starting from a peripheral
+// node. Rows are then sorted by their first column. Chains and grids end up
+// with all their coefficients in a narrow band around the diagonal.
+//
+// A square system with lower bandwidth kl and upper bandwidth ku can be
+// factored with partial pivoting without leaving a band of width 2*kl+ku+1,
+// because only the kl rows below a pivot can have a coefficient in its
+// column, and swapping one of them up widens U by at most kl. That's what
+// LAPACK's dgbtrf does. Each row is stored as a dense window of the band,
+// there is no fill to track.
+//
+// Banded LU only handles systems with a unique solution, if it finds a zero
+// pivot the component is factored with one of the general methods instead.
+
+// Components with at least this many columns, whose band is at most this
+// wide after ordering, are factored with banded LU.
+#define BAND_LU_MIN_COLUMNS 32
+#define BAND_LU_MAX_WIDTH 64
+
+struct band_lu_t {
+    uint32_t n;
+    uint32_t kl; // Lower bandwidth
+    uint32_t ku; // Upper bandwidth of A, U has kl+ku
+
+    // Row i holds columns i-kl to i+kl+ku, width is 2*kl+ku+1. Multipliers of
+    // L are stored below the diagonal.
+    uint32_t width;
+    double *band;
+
+    // Row swapped with row k before eliminating column k.
+    uint32_t *pivot_swap;
+
+    // Position of each row and column in the ordered matrix, row_order[i] is
+    // the row of A that goes in position i.
+    uint32_t *row_order;
+    uint32_t *col_order;
+
+    uint32_t num_nonzeros; // In A
+    uint32_t num_row_swaps;
+    uint64_t num_flops;
+    uint64_t scratch_size;
+};
+
+// Returns the column order computed with reverse Cuthill-McKee, allocated in
+// pool. Each connected set of columns starts from a column of minimum degree,
+// then from the last column found by the breadth first search from there,
+// which is far away from most other columns.
+uint32_t* reverse_cuthill_mckee (mem_pool_t *pool, mem_pool_t *scratch, struct sparse_matrix_t *A)
+{
+    uint32_t m = A->m;
+    uint32_t n = A->n;
+    uint32_t nnz = A->row_start[m];
+
+    // Allocated before the temporary memory, pool may be the same as
+    // scratch.
+    uint32_t *order = mem_pool_push_array_aligned (pool, n, uint32_t);
+    mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (scratch);
+
+    // Rows of each column, in CSC form. The degree counts neighbors once for
+    // each row they share, that's good enough to sort them.
+    uint32_t *col_start = mem_pool_push_array_aligned (scratch, n+1, uint32_t);
+    uint32_t *col_rows = mem_pool_push_array_aligned (scratch, nnz, uint32_t);
+    uint32_t *degree = mem_pool_push_array_aligned (scratch, n, uint32_t);
+    for (uint32_t j=0; j<=n; j++) {
+        col_start[j] = 0;
+    }
+    for (uint32_t j=0; j<n; j++) {
+        degree[j] = 0;
+    }
+    for (uint32_t i=0; i<m; i++) {
+        for (uint32_t e=A->row_start[i]; e<A->row_start[i+1]; e++) {
+            col_start[A->cols[e]+1]++;
+            degree[A->cols[e]] += A->row_start[i+1] - A->row_start[i] - 1;
+        }
+    }
+    for (uint32_t j=0; j<n; j++) {
+        col_start[j+1] += col_start[j];
+    }
+    uint32_t *col_pos = mem_pool_push_array_aligned (scratch, n, uint32_t);
+    for (uint32_t j=0; j<n; j++) {
+        col_pos[j] = col_start[j];
+    }
+    for (uint32_t i=0; i<m; i++) {
+        for (uint32_t e=A->row_start[i]; e<A->row_start[i+1]; e++) {
+            col_rows[col_pos[A->cols[e]]++] = i;
+        }
+    }
+
+    bool *visited = mem_pool_push_array (scratch, n, bool);
+    for (uint32_t j=0; j<n; j++) {
+        visited[j] = false;
+    }
+
+    uint32_t num_ordered = 0;
+    for (uint32_t start_candidate=0; start_candidate<n; start_candidate++) {
+        if (visited[start_candidate]) continue;
+
+        // Two searches, the first one only finds the start column and is
+        // undone afterwards.
+        uint32_t start = start_candidate;
+        for (int pass=0; pass<2; pass++) {
+            uint32_t first = num_ordered;
+            uint32_t end = num_ordered;
+            order[end++] = start;
+            visited[start] = true;
+
+            for (uint32_t head=first; head<end; head++) {
+                uint32_t j = order[head];
+                uint32_t first_new = end;
+                for (uint32_t r=col_start[j]; r<col_start[j+1]; r++) {
+                    uint32_t i = col_rows[r];
+                    for (uint32_t e=A->row_start[i]; e<A->row_start[i+1]; e++) {
+                        uint32_t neighbor = A->cols[e];
+                        if (!visited[neighbor]) {
+                            visited[neighbor] = true;
+                            order[end++] = neighbor;
+                        }
+                    }
+                }
+
+                // Insertion sort of the new columns by degree, these are only
+                // the neighbors of a single column.
+                for (uint32_t a=first_new+1; a<end; a++) {
+                    uint32_t col = order[a];
+                    uint32_t b = a;
+                    while (b > first_new && degree[order[b-1]] > degree[col]) {
+                        order[b] = order[b-1];
+                        b--;
+                    }
+                    order[b] = col;
+                }
+            }
+
+            if (pass == 0) {
+                start = order[end-1];
+                for (uint32_t o=first; o<end; o++) {
+                    visited[order[o]] = false;
+                }
+
+            } else {
+                // Reverse
+                for (uint32_t a=first, b=end-1; a<b; a++, b--) {
+                    uint32_t tmp = order[a];
+                    order[a] = order[b];
+                    order[b] = tmp;
+                }
+                num_ordered = end;
+            }
+        }
+    }
+
+    mem_pool_end_temporary_memory (mrkr);
+    return order;
+}
+
+// Returns false if A can't be factored with banded LU, in that case nothing is
+// allocated.
+bool band_lu_factor (mem_pool_t *pool, mem_pool_t *scratch, struct sparse_matrix_t *A, struct band_lu_t *lu)
+{
+    if (A->m != A->n || A->n < BAND_LU_MIN_COLUMNS) return false;
+
+    mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (scratch);
+    uint32_t n = A->n;
+
+    uint32_t *col_order = reverse_cuthill_mckee (scratch, scratch, A);
+    uint32_t *col_position = mem_pool_push_array_aligned (scratch, n, uint32_t);
+    for (uint32_t j=0; j<n; j++) {
+        col_position[col_order[j]] = j;
+    }
+
+    // Counting sort of rows by their first column. Empty rows go last, the
+    // system is singular anyway.
+    uint32_t *row_first = mem_pool_push_array_aligned (scratch, n, uint32_t);
+    uint32_t *bucket_start = mem_pool_push_array_aligned (scratch, n+2, uint32_t);
+    for (uint32_t j=0; j<n+2; j++) {
+        bucket_start[j] = 0;
+    }
+    for (uint32_t i=0; i<n; i++) {
+        row_first[i] = n;
+        for (uint32_t e=A->row_start[i]; e<A->row_start[i+1]; e++) {
+            row_first[i] = MIN (row_first[i], col_position[A->cols[e]]);
+        }
+        bucket_start[row_first[i]+1]++;
+    }
+    for (uint32_t j=0; j<n+1; j++) {
+        bucket_start[j+1] += bucket_start[j];
+    }
+    uint32_t *row_order = mem_pool_push_array_aligned (scratch, n, uint32_t);
+    for (uint32_t i=0; i<n; i++) {
+        row_order[bucket_start[row_first[i]]++] = i;
+    }
+
+    uint32_t kl = 0, ku = 0;
+    for (uint32_t p=0; p<n; p++) {
+        uint32_t i = row_order[p];
+        for (uint32_t e=A->row_start[i]; e<A->row_start[i+1]; e++) {
+            uint32_t j = col_position[A->cols[e]];
+            if (j < p) kl = MAX (kl, p - j);
+            if (j > p) ku = MAX (ku, j - p);
+        }
+    }
+
+    uint32_t width = 2*kl + ku + 1;
+    if (width > BAND_LU_MAX_WIDTH) {
+        mem_pool_end_temporary_memory (mrkr);
+        return false;
+    }
+
+    // Factor in scratch, it's copied to pool if it succeeds.
+    double *band = mem_pool_push_array_aligned (scratch, (size_t)n*width, double);
+    uint32_t *pivot_swap = mem_pool_push_array_aligned (scratch, n, uint32_t);
+    for (size_t e=0; e<(size_t)n*width; e++) {
+        band[e] = 0;
+    }
+    for (uint32_t p=0; p<n; p++) {
+        uint32_t i = row_order[p];
+        for (uint32_t e=A->row_start[i]; e<A->row_start[i+1]; e++) {
+            uint32_t j = col_position[A->cols[e]];
+            band[(size_t)p*width + j - p + kl] += A->vals[e];
+        }
+    }
+
+    struct vector_kernels_t *kernels = vector_kernels_get ();
+    uint32_t num_row_swaps = 0;
+    uint64_t num_flops = 0;
+    bool success = true;
+    for (uint32_t k=0; k<n; k++) {
+        // Element (i,j) is at band[i*width + j-i+kl].
+        uint32_t last_row = MIN (n-1, k+kl);
+        uint32_t last_col = MIN (n-1, k+kl+ku);
+
+        uint32_t p = k;
+        double maximum = 0;
+        for (uint32_t i=k; i<=last_row; i++) {
+            double value = fabs(band[(size_t)i*width + k-i+kl]);
+            if (value > maximum) {
+                maximum = value;
+                p = i;
+            }
+        }
+        if (maximum <= SOLVER_EPSILON) {
+            success = false;
+            break;
+        }
+
+        pivot_swap[k] = p;
+        if (p != k) {
+            num_row_swaps++;
+            kernels->swap (&band[(size_t)k*width + kl], &band[(size_t)p*width + k-p+kl], last_col-k+1);
+        }
+
+        double *pivot_row = &band[(size_t)k*width + kl];
+        for (uint32_t i=k+1; i<=last_row; i++) {
+            double *row = &band[(size_t)i*width + k-i+kl];
+            if (row[0] == 0) continue;
+
+            row[0] /= pivot_row[0];
+            kernels->axpy (row+1, -row[0], pivot_row+1, last_col-k);
+            num_flops += 1 + 2*(uint64_t)(last_col-k);
+        }
+    }
+
+    if (success) {
+        *lu = ZERO_INIT (struct band_lu_t);
+        lu->n = n;
+        lu->kl = kl;
+        lu->ku = ku;
+        lu->width = width;
+        lu->num_nonzeros = A->row_start[n];
+        lu->num_row_swaps = num_row_swaps;
+        lu->num_flops = num_flops;
+        lu->scratch_size = scratch->total_data - mrkr.total_data;
+
+        lu->band = mem_pool_push_array_aligned (pool, (size_t)n*width, double);
+        lu->pivot_swap = mem_pool_push_array_aligned (pool, n, uint32_t);
+        lu->row_order = mem_pool_push_array_aligned (pool, n, uint32_t);
+        lu->col_order = mem_pool_push_array_aligned (pool, n, uint32_t);
+        memcpy (lu->band, band, (size_t)n*width*sizeof(double));
+        memcpy (lu->pivot_swap, pivot_swap, n*sizeof(uint32_t));
+        memcpy (lu->row_order, row_order, n*sizeof(uint32_t));
+        memcpy (lu->col_order, col_order, n*sizeof(uint32_t));
+    }
+
+    mem_pool_end_temporary_memory (mrkr);
+    return success;
+}
+
+// Floating point operations done by band_lu_solve().
+uint64_t band_lu_solve_flops (struct band_lu_t *lu)
+{
+    return (uint64_t)lu->n*(2*lu->kl + 2*(lu->kl + lu->ku) + 1);
+}
+
+// Solves for the right hand side b, the solution is always unique. Temporary
+// vectors are allocated in scratch.
+void band_lu_solve (struct band_lu_t *lu, mem_pool_t *scratch, double *b, double *x, bool *known)
+{
+    mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (scratch);
+    uint32_t n = lu->n;
+    uint32_t kl = lu->kl;
+    uint32_t width = lu->width;
+
+    double *y = mem_pool_push_array_aligned (scratch, n, double);
+    for (uint32_t p=0; p<n; p++) {
+        y[p] = b[lu->row_order[p]];
+    }
+
+    for (uint32_t k=0; k<n; k++) {
+        uint32_t p = lu->pivot_swap[k];
+        double tmp = y[k];
+        y[k] = y[p];
+        y[p] = tmp;
+
+        for (uint32_t i=k+1; i<=MIN (n-1, k+kl); i++) {
+            y[i] -= lu->band[(size_t)i*width + k-i+kl]*y[k];
+        }
+    }
+
+    for (int64_t k=(int64_t)n-1; k>=0; k--) {
+        double *row = &lu->band[(size_t)k*width + kl];
+        uint32_t last_col = MIN (n-1, k+kl+lu->ku);
+        double value = y[k];
+        for (uint32_t j=k+1; j<=last_col; j++) {
+            value -= row[j-k]*y[j];
+        }
+        y[k] = value/row[0];
+    }
+
+    for (uint32_t j=0; j<n; j++) {
+        x[lu->col_order[j]] = y[j];
+        known[lu->col_order[j]] = true;
+    }
+
+    mem_pool_end_temporary_memory (mrkr);
+}
+
+//////////////////////////
+// DIFFERENCE CONSTRAINTS
+//
+// Layouts mostly generate equations of the form 'a + d - b = 0', that relate
+// the positions of two unknowns by an offset that only depends on known
+// symbols. A matrix where every row has exactly two coefficients, c and -c, is
+// the incidence matrix of a graph with unknowns as nodes and equations as
+// edges. Rows with a single coefficient anchor their node to a value. Such a
+// system is solved in linear time by walking a spanning tree of the graph
+// from each anchor, each edge gives the value of a node from its parent's.
+// Edges and anchors not in the tree close cycles, their residual is the sum of
+// offsets around the cycle, which isn't 0 if the cycle is inconsistent.
+//
+// A full factorization presolves anchored equations first, so only floating
+// components get here, which are solved relative to a root and left unknown.
+// Incremental factorization doesn't extend presolve, new expressions with a
+// single unknown go to a component and the graph propagates from them.
+
+#define DIFFERENCE_GRAPH_NO_ROW UINT32_MAX
+#define DIFFERENCE_GRAPH_NO_COLUMN UINT32_MAX
+
+struct difference_graph_t {
+    uint32_t m; // Edges and anchors
+    uint32_t n; // Nodes
+    uint32_t nnz;
+
+    // Root of each tree of the spanning forest, in the order they are visited.
+    // Anchored roots get their value from x[root] = b[root_row]/root_coefficient,
+    // the rest have root_row set to DIFFERENCE_GRAPH_NO_ROW.
+    uint32_t num_roots;
+    uint32_t *root_col;
+    uint32_t *root_row;
+    double *root_coefficient;
+
+    // Edges of the spanning forest in the order they are visited. Each one
+    // computes the child from the parent with
+    //   x[child] = (b[row] - parent_coefficient*x[parent])/child_coefficient
+    uint32_t num_tree_edges;
+    uint32_t *tree_row;
+    uint32_t *tree_parent;
+    uint32_t *tree_child;
+    double *tree_parent_coefficient;
+    double *tree_child_coefficient;
+
+    // Edges and anchors outside of the forest. Like for sparse_lu_t,
+    // b[dependent_row[i]] is their residual after solving.
+    // dependent_blame_col is the endpoint visited last. Anchors have
+    // dependent_col_b set to DIFFERENCE_GRAPH_NO_COLUMN.
+    uint32_t num_dependent;
+    uint32_t *dependent_row;
+    int64_t *dependent_blame_col;
+    uint32_t *dependent_col_a;
+    uint32_t *dependent_col_b;
+    double *dependent_coefficient_a;
+    double *dependent_coefficient_b;
+};
+
+// Returns false if A isn't the incidence matrix of a difference graph, in that
+// case nothing is allocated.
+bool difference_graph_build (mem_pool_t *pool, mem_pool_t *scratch, struct sparse_matrix_t *A,
+                             struct difference_graph_t *graph)
+{
+    for (uint32_t i=0; i<A->m; i++) {
+        uint32_t e = A->row_start[i];
+        uint32_t num_entries = A->row_start[i+1] - e;
+        if (num_entries == 1) {
+            if (fabs(A->vals[e]) < SOLVER_EPSILON) return false;
+
+        } else if (num_entries != 2 || A->vals[e] != -A->vals[e+1]) {
+            return false;
+        }
+    }
+
+    mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (scratch);
+
+    *graph = ZERO_INIT (struct difference_graph_t);
+    graph->m = A->m;
+    graph->n = A->n;
+    graph->nnz = A->row_start[A->m];
+
+    // Edges incident to each node, in CSR form. Anchors aren't edges.
+    uint32_t *node_start = mem_pool_push_array_aligned (scratch, A->n+1, uint32_t);
+    memset (node_start, 0, (A->n+1)*sizeof(uint32_t));
+    for (uint32_t i=0; i<A->m; i++) {
+        if (A->row_start[i+1] - A->row_start[i] != 2) continue;
+        node_start[A->cols[A->row_start[i]]+1]++;
+        node_start[A->cols[A->row_start[i]+1]+1]++;
+    }
+    for (uint32_t j=0; j<A->n; j++) {
+        node_start[j+1] += node_start[j];
+    }
+    uint32_t *node_edges = mem_pool_push_array_aligned (scratch, node_start[A->n], uint32_t);
+    uint32_t *fill = mem_pool_push_array_aligned (scratch, A->n, uint32_t);
+    memcpy (fill, node_start, A->n*sizeof(uint32_t));
+    for (uint32_t i=0; i<A->m; i++) {
+        if (A->row_start[i+1] - A->row_start[i] != 2) continue;
+        node_edges[fill[A->cols[A->row_start[i]]]++] = i;
+        node_edges[fill[A->cols[A->row_start[i]+1]]++] = i;
+    }
+
+    graph->root_col = mem_pool_push_array_aligned (pool, A->n, uint32_t);
+    graph->root_row = mem_pool_push_array_aligned (pool, A->n, uint32_t);
+    graph->root_coefficient = mem_pool_push_array_aligned (pool, A->n, double);
+    graph->tree_row = mem_pool_push_array_aligned (pool, A->n, uint32_t);
+    graph->tree_parent = mem_pool_push_array_aligned (pool, A->n, uint32_t);
+    graph->tree_child = mem_pool_push_array_aligned (pool, A->n, uint32_t);
+    graph->tree_parent_coefficient = mem_pool_push_array_aligned (pool, A->n, double);
+    graph->tree_child_coefficient = mem_pool_push_array_aligned (pool, A->n, double);
+
+    bool *node_visited = mem_pool_push_array (scratch, A->n, bool);
+    bool *edge_used = mem_pool_push_array (scratch, A->m, bool);
+    uint32_t *queue = mem_pool_push_array_aligned (scratch, A->n, uint32_t);
+    for (uint32_t j=0; j<A->n; j++) {
+        node_visited[j] = false;
+    }
+    for (uint32_t i=0; i<A->m; i++) {
+        edge_used[i] = false;
+    }
+
+    // Position in which each node was visited, used to blame inconsistent
+    // cycles on the node that closes them.
+    uint32_t *visit_order = mem_pool_push_array_aligned (scratch, A->n, uint32_t);
+    uint32_t num_visited = 0;
+
+    // Trees are grown from the first anchor of each node, then from the
+    // nodes no anchor reached.
+    for (uint32_t k=0; k<A->m + A->n; k++) {
+        uint32_t root, row = DIFFERENCE_GRAPH_NO_ROW;
+        if (k < A->m) {
+            if (A->row_start[k+1] - A->row_start[k] != 1) continue;
+            row = k;
+            root = A->cols[A->row_start[k]];
+        } else {
+            root = k - A->m;
+        }
+        if (node_visited[root]) continue;
+
+        uint32_t r = graph->num_roots++;
+        graph->root_col[r] = root;
+        graph->root_row[r] = row;
+        graph->root_coefficient[r] = row != DIFFERENCE_GRAPH_NO_ROW ? A->vals[A->row_start[row]] : 0;
+        if (row != DIFFERENCE_GRAPH_NO_ROW) {
+            edge_used[row] = true;
+        }
+
+        uint32_t queue_start = 0, queue_end = 0;
+        queue[queue_end++] = root;
+        node_visited[root] = true;
+        visit_order[root] = num_visited++;
+
+        while (queue_start < queue_end) {
+            uint32_t node = queue[queue_start++];
+            for (uint32_t k=node_start[node]; k<node_start[node+1]; k++) {
+                uint32_t i = node_edges[k];
+                uint32_t e = A->row_start[i];
+                uint32_t other = A->cols[e] == node ? e+1 : e;
+                uint32_t self = A->cols[e] == node ? e : e+1;
+                if (edge_used[i] || node_visited[A->cols[other]]) continue;
+
+                edge_used[i] = true;
+                node_visited[A->cols[other]] = true;
+                visit_order[A->cols[other]] = num_visited++;
+                queue[queue_end++] = A->cols[other];
+
+                uint32_t t = graph->num_tree_edges++;
+                graph->tree_row[t] = i;
+                graph->tree_parent[t] = node;
+                graph->tree_child[t] = A->cols[other];
+                graph->tree_parent_coefficient[t] = A->vals[self];
+                graph->tree_child_coefficient[t] = A->vals[other];
+            }
+        }
+    }
+
+    uint32_t num_anchored = 0;
+    for (uint32_t r=0; r<graph->num_roots; r++) {
+        if (graph->root_row[r] != DIFFERENCE_GRAPH_NO_ROW) num_anchored++;
+    }
+
+    graph->num_dependent = A->m - graph->num_tree_edges - num_anchored;
+    graph->dependent_row = mem_pool_push_array_aligned (pool, graph->num_dependent, uint32_t);
+    graph->dependent_blame_col = mem_pool_push_array_aligned (pool, graph->num_dependent, int64_t);
+    graph->dependent_col_a = mem_pool_push_array_aligned (pool, graph->num_dependent, uint32_t);
+    graph->dependent_col_b = mem_pool_push_array_aligned (pool, graph->num_dependent, uint32_t);
+    graph->dependent_coefficient_a = mem_pool_push_array_aligned (pool, graph->num_dependent, double);
+    graph->dependent_coefficient_b = mem_pool_push_array_aligned (pool, graph->num_dependent, double);
+
+    uint32_t d = 0;
+    for (uint32_t i=0; i<A->m; i++) {
+        if (edge_used[i]) continue;
+
+        uint32_t e = A->row_start[i];
+        uint32_t a = A->cols[e];
+        graph->dependent_row[d] = i;
+        graph->dependent_col_a[d] = a;
+        graph->dependent_coefficient_a[d] = A->vals[e];
+        if (A->row_start[i+1] - e == 2) {
+            uint32_t b = A->cols[e+1];
+            graph->dependent_blame_col[d] = visit_order[a] > visit_order[b] ? a : b;
+            graph->dependent_col_b[d] = b;
+            graph->dependent_coefficient_b[d] = A->vals[e+1];
+        } else {
+            graph->dependent_blame_col[d] = a;
+            graph->dependent_col_b[d] = DIFFERENCE_GRAPH_NO_COLUMN;
+            graph->dependent_coefficient_b[d] = 0;
+        }
+        d++;
+    }
+
+    mem_pool_end_temporary_memory (mrkr);
+
+    return true;
+}
+
+// Same interface as sparse_lu_solve(). Nodes in trees grown from an anchor are
+// known. Roots of the other trees are set to 0 and every node in them is
+// relative to its root, so they aren't known.
+void difference_graph_solve (struct difference_graph_t *graph, double *b, double *x, bool *known)
+{
+    for (uint32_t r=0; r<graph->num_roots; r++) {
+        uint32_t root = graph->root_col[r];
+        if (graph->root_row[r] != DIFFERENCE_GRAPH_NO_ROW) {
+            x[root] = b[graph->root_row[r]]/graph->root_coefficient[r];
+            known[root] = true;
+        } else {
+            x[root] = 0;
+            known[root] = false;
+        }
+    }
+
+    for (uint32_t t=0; t<graph->num_tree_edges; t++) {
+        uint32_t parent = graph->tree_parent[t];
+        uint32_t child = graph->tree_child[t];
+        x[child] = (b[graph->tree_row[t]] - graph->tree_parent_coefficient[t]*x[parent])/
+            graph->tree_child_coefficient[t];
+        known[child] = known[parent];
+    }
+
+    for (uint32_t d=0; d<graph->num_dependent; d++) {
+        double value = graph->dependent_coefficient_a[d]*x[graph->dependent_col_a[d]];
+        if (graph->dependent_col_b[d] != DIFFERENCE_GRAPH_NO_COLUMN) {
+            value += graph->dependent_coefficient_b[d]*x[graph->dependent_col_b[d]];
+        }
+        b[graph->dependent_row[d]] -= value;
+    }
+}
+
+// Like str_cat_sparse_lu(), prints the anchors and edges of the spanning
+// forest first, then the ones that close cycles with their residual.
+void str_cat_difference_graph (string_t *str, struct difference_graph_t *graph, double *b)
+{
+    size_t m = graph->m;
+    size_t n = graph->n + 1;
+    if (m*n > SPARSE_LU_MAX_PRINTED_SIZE) {
+        str_cat_printf (str, "(%u x %u matrix not printed)\n\n", graph->m, graph->n);
+        return;
+    }
+
+    double *matrix = calloc (m*n, sizeof(double));
+    size_t h = 0;
+    for (uint32_t r=0; r<graph->num_roots; r++) {
+        if (graph->root_row[r] == DIFFERENCE_GRAPH_NO_ROW) continue;
+
+        matrix[n*h + graph->root_col[r]] = graph->root_coefficient[r];
+        matrix[n*h + n-1] = b[graph->root_row[r]];
+        h++;
+    }
+
+    for (uint32_t t=0; t<graph->num_tree_edges; t++, h++) {
+        matrix[n*h + graph->tree_parent[t]] = graph->tree_parent_coefficient[t];
+        matrix[n*h + graph->tree_child[t]] = graph->tree_child_coefficient[t];
+        matrix[n*h + n-1] = b[graph->tree_row[t]];
+    }
+
+    for (uint32_t d=0; d<graph->num_dependent; d++, h++) {
+        matrix[n*h + n-1] = b[graph->dependent_row[d]];
+    }
+
+    str_cat_matrix (str, matrix, m, n);
+    free (matrix);
+}
+
+// Floating point operations done by difference_graph_solve().
+uint64_t difference_graph_solve_flops (struct difference_graph_t *graph)
+{
+    return (uint64_t)graph->num_roots + 3*(uint64_t)graph->num_tree_edges + 4*(uint64_t)graph->num_dependent;
+}
+
+//////////////////////////
+// ITERATIVE SOLVER
+//
+// For very large components storing the LU factors may take more memory than
+// the system itself. Instead, they can be solved with conjugate gradient on
+// the normal equations A^T*A*x = A^T*b, which only needs A and a few vectors.
+// Each iteration costs two products with A, and the result is the least
+// squares solution closest to the starting point, so starting from the values
+// of the previous solve makes re-solves after small edits converge in a few
+// iterations.
+//
+// Iterating doesn't tell which symbols are determined by the equations. An
+// underconstrained component converges like any other, free symbols just keep
+// whatever value they started from. Overconstrained components that can't be
+// satisfied never reach the tolerance and are reported as not converged.
+//
+// The preconditioner is the diagonal of A^T*A, the squared norm of each
+// column, which makes the result independent of how equations are scaled.
+
+#define SOLVER_ITERATIVE_DEFAULT_TOLERANCE 1e-10
+
+struct sparse_cg_t {
+    struct sparse_matrix_t A;
+
+    // Inverse of the squared norm of each column, 0 for empty columns so
+    // their symbol keeps its starting value.
+    double *inverse_diagonal;
+};
+
+// Copies A into pool and computes the preconditioner.
+void sparse_cg_init (mem_pool_t *pool, struct sparse_matrix_t *A, struct sparse_cg_t *cg)
+{
+    uint32_t nnz = A->row_start[A->m];
+    cg->A.m = A->m;
+    cg->A.n = A->n;
+    cg->A.row_start = mem_pool_push_array_aligned (pool, A->m+1, uint32_t);
+    cg->A.cols = mem_pool_push_array_aligned (pool, nnz, uint32_t);
+    cg->A.vals = mem_pool_push_array_aligned (pool, nnz, double);
+    memcpy (cg->A.row_start, A->row_start, (A->m+1)*sizeof(uint32_t));
+    memcpy (cg->A.cols, A->cols, nnz*sizeof(uint32_t));
+    memcpy (cg->A.vals, A->vals, nnz*sizeof(double));
+
+    cg->inverse_diagonal = mem_pool_push_array_aligned (pool, A->n, double);
+    for (uint32_t j=0; j<A->n; j++) {
+        cg->inverse_diagonal[j] = 0;
+    }
+    for (uint32_t e=0; e<nnz; e++) {
+        cg->inverse_diagonal[A->cols[e]] += A->vals[e]*A->vals[e];
+    }
+    for (uint32_t j=0; j<A->n; j++) {
+        if (cg->inverse_diagonal[j] != 0) {
+            cg->inverse_diagonal[j] = 1/cg->inverse_diagonal[j];
+        }
+    }
+}
+
+// y = A*x
+void sparse_matrix_multiply (struct sparse_matrix_t *A, double *x, double *y)
+{
+    for (uint32_t i=0; i<A->m; i++) {
+        double sum = 0;
+        for (uint32_t e=A->row_start[i]; e<A->row_start[i+1]; e++) {
+            sum += A->vals[e]*x[A->cols[e]];
+        }
+        y[i] = sum;
+    }
+}
+
+// y = A^T*x
+void sparse_matrix_multiply_transpose (struct sparse_matrix_t *A, double *x, double *y)
+{
+    for (uint32_t j=0; j<A->n; j++) {
+        y[j] = 0;
+    }
+    for (uint32_t i=0; i<A->m; i++) {
+        for (uint32_t e=A->row_start[i]; e<A->row_start[i+1]; e++) {
+            y[A->cols[e]] += A->vals[e]*x[i];
+        }
+    }
+}
+
+// Iterates starting from the values in x until the norm of the residual
+// b - A*x is at most tolerance times the norm of b (or 1 if that is larger),
+// or until max_iterations are done. The residual is left in b. Returns the
+// number of iterations, the relative norm of the residual reached is returned
+// in relative_residual. Vectors used while iterating are pushed into scratch
+// and left there, so the caller can measure them.
+uint32_t sparse_cg_solve (struct sparse_cg_t *cg, mem_pool_t *scratch, double *b, double *x,
+                          double tolerance, uint32_t max_iterations,
+                          double *relative_residual, uint64_t *flops)
+{
+    struct vector_kernels_t *kernels = vector_kernels_get ();
+    struct sparse_matrix_t *A = &cg->A;
+    uint32_t m = A->m, n = A->n;
+    uint64_t nnz = A->row_start[m];
+    double *r = b;
+    double *q = mem_pool_push_array_aligned (scratch, m, double);
+    double *s = mem_pool_push_array_aligned (scratch, n, double);
+    double *z = mem_pool_push_array_aligned (scratch, n, double);
+    double *p = mem_pool_push_array_aligned (scratch, n, double);
+
+    double scale = MAX (sqrt (kernels->dot (b, b, m)), 1);
+
+    sparse_matrix_multiply (A, x, q);
+    kernels->axpy (r, -1, q, m);
+    double residual = sqrt (kernels->dot (r, r, m));
+
+    sparse_matrix_multiply_transpose (A, r, s);
+    for (uint32_t j=0; j<n; j++) {
+        z[j] = cg->inverse_diagonal[j]*s[j];
+        p[j] = z[j];
+    }
+    double gamma = kernels->dot (s, z, n);
+    *flops += 4*nnz + 5*(uint64_t)m + 3*(uint64_t)n;
+
+    uint32_t iteration = 0;
+    while (residual > tolerance*scale && iteration < max_iterations && gamma > 0) {
+        sparse_matrix_multiply (A, p, q);
+        double q_norm = kernels->dot (q, q, m);
+        if (q_norm == 0) break;
+
+        double alpha = gamma/q_norm;
+        kernels->axpy (x, alpha, p, n);
+        kernels->axpy (r, -alpha, q, m);
+        residual = sqrt (kernels->dot (r, r, m));
+
+        sparse_matrix_multiply_transpose (A, r, s);
+        for (uint32_t j=0; j<n; j++) {
+            z[j] = cg->inverse_diagonal[j]*s[j];
+        }
+        double new_gamma = kernels->dot (s, z, n);
+        double beta = new_gamma/gamma;
+        gamma = new_gamma;
+        kernels->xpby (p, z, beta, n);
+
+        iteration++;
+    }
+    *flops += iteration*(4*nnz + 6*(uint64_t)m + 7*(uint64_t)n);
+
+    *relative_residual = residual/scale;
+    return iteration;
+}
+
+// Builds the coefficient matrix for the passed expressions. Columns are
+// unassigned symbols as mapped by symbol_id_to_column, rows are expressions.
+// Terms with assigned symbols go to the right hand side, they are handled by
+// component_build_rhs(). Repeated symbols in the same expression are merged
+// into a single coefficient.
+void system_build_sparse_matrix (struct linear_system_t *system, mem_pool_t *pool,
+                                 uint32_t *expressions, uint32_t num_expressions,
+                                 uint64_t *symbol_id_to_column, uint32_t num_columns,
+                                 struct sparse_matrix_t *A)
+{
+    uint32_t nnz = 0;
+    for (uint32_t i=0; i<num_expressions; i++) {
+        struct term_t *terms = expression_terms (system, expressions[i]);
+        for (uint32_t t=0; t<system->expressions[expressions[i]].num_terms; t++) {
+            if (!symbol_is_known (system, symbol_representative (system, terms[t].symbol))) nnz++;
+        }
+    }
+
+    A->m = num_expressions;
+    A->n = num_columns;
+    A->row_start = mem_pool_push_array_aligned (pool, num_expressions+1, uint32_t);
+    A->cols = mem_pool_push_array_aligned (pool, nnz, uint32_t);
+    A->vals = mem_pool_push_array_aligned (pool, nnz, double);
+
+    mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (pool);
+    uint32_t *work_pos = mem_pool_push_array_aligned (pool, num_columns, uint32_t);
+    memset (work_pos, 0, num_columns*sizeof(uint32_t));
+
+    uint32_t pos = 0;
+    for (uint32_t i=0; i<num_expressions; i++) {
+        A->row_start[i] = pos;
+
+        struct term_t *terms = expression_terms (system, expressions[i]);
+        for (uint32_t t=0; t<system->expressions[expressions[i]].num_terms; t++) {
+            double coefficient = terms[t].coefficient;
+            uint64_t symbol = symbol_representative (system, terms[t].symbol);
+
+            if (!symbol_is_known (system, symbol)) {
+                uint32_t col = symbol_id_to_column[symbol];
+                if (work_pos[col] == 0) {
+                    A->cols[pos] = col;
+                    A->vals[pos] = coefficient;
+                    pos++;
+                    work_pos[col] = pos;
+                } else {
+                    A->vals[work_pos[col]-1] += coefficient;
+                }
+            }
+        }
+
+        // Drop coefficients that cancelled out and reset the work array.
+        uint32_t row_end = A->row_start[i];
+        for (uint32_t e=A->row_start[i]; e<pos; e++) {
+            work_pos[A->cols[e]] = 0;
+            if (A->vals[e] != 0) {
+                A->cols[row_end] = A->cols[e];
+                A->vals[row_end] = A->vals[e];
+                row_end++;
+            }
+        }
+        pos = row_end;
+    }
+    A->row_start[num_expressions] = pos;
+
+    mem_pool_end_temporary_memory (mrkr);
+}
+
+// Expression text as it would be written in solver_expr_equals_zero().
+void str_cat_expression (string_t *str, struct linear_system_t *system, uint32_t expression)
+{
+    struct term_t *terms = expression_terms (system, expression);
+    for (uint32_t t=0; t<system->expressions[expression].num_terms; t++) {
+        double coefficient = terms[t].coefficient;
+        if (t == 0) {
+            if (coefficient < 0) str_cat_c (str, "-");
+        } else {
+            str_cat_c (str, coefficient < 0 ? " - " : " + ");
+        }
+
+        if (fabs(coefficient) != 1) {
+            str_cat_printf (str, "%g*", fabs(coefficient));
+        }
+        str_cat_c (str, symbol_name (system, terms[t].symbol));
+    }
+
+    double constant = system->expressions[expression].constant;
+    if (system->expressions[expression].num_terms == 0) {
+        str_cat_printf (str, "%g", constant);
+    } else if (constant != 0) {
+        str_cat_printf (str, constant < 0 ? " - %g" : " + %g", fabs(constant));
+    }
+
+    // Equalities are shown without relation, like they are parsed.
+    if (system->expressions[expression].relation == SOLVER_LESS_EQUAL) {
+        str_cat_c (str, " <= 0");
+    } else if (system->expressions[expression].relation == SOLVER_GREATER_EQUAL) {
+        str_cat_c (str, " >= 0");
+    }
+}
+
+// Value of an expression when all of its symbols are assigned, if this isn't 0
+// the equation can't be satisfied.
+double expression_residual (struct linear_system_t *system, uint32_t expression)
+{
+    double residual = system->expressions[expression].constant;
+    struct term_t *terms = expression_terms (system, expression);
+    for (uint32_t t=0; t<system->expressions[expression].num_terms; t++) {
+        residual += terms[t].coefficient*system->value[symbol_representative (system, terms[t].symbol)];
+    }
+    return residual;
+}
+
+uint64_t union_find_root (uint64_t *parent, uint64_t id)
+{
+    uint64_t root = id;
+    while (parent[root] != root) {
+        root = parent[root];
+    }
+
+    // Path compression
+    while (parent[id] != root) {
+        uint64_t next = parent[id];
+        parent[id] = root;
+        id = next;
+    }
+
+    return root;
+}
+
+void union_find_union (uint64_t *parent, uint64_t a, uint64_t b)
+{
+    uint64_t root_a = union_find_root (parent, a);
+    uint64_t root_b = union_find_root (parent, b);
+    if (root_a != root_b) {
+        // Keep the smallest id as root, so the result doesn't depend on the
+        // order in which expressions are processed.
+        if (root_a < root_b) {
+            parent[root_b] = root_a;
+        } else {
+            parent[root_a] = root_b;
+        }
+    }
+}
+
+//////////////////////////
+// SIMPLEX
+//
+// Inequalities and constraints that aren't required can't be solved by
+// elimination. When a system has any of them, all of its expressions are
+// solved with the incremental simplex of the Cassowary algorithm instead of by
+// components.
+//
+// Each constraint is a row of a tableau that expresses one basic symbol in
+// terms of parametric ones, which are 0, so the value of a basic symbol is the
+// constant of its row. Besides one external symbol for each unassigned symbol
+// of the system, constraints add slack symbols to inequalities, error symbols
+// to constraints that aren't required and a dummy symbol to required
+// equalities. Slack and error symbols are never negative, and the objective
+// row adds up error symbols weighted by the strength of their constraint.
+//
+// The tableau is kept across solves. Adding or removing a constraint costs a
+// few pivots to make it feasible and optimal again, instead of a solve from
+// scratch. Assigned symbols are constants of the rows, changing their values
+// builds the tableau again.
+//
+// Symbols that the constraints don't determine get any value that satisfies
+// them instead of being reported as unsolved.
+
+#define SIMPLEX_EPSILON 1e-8
+
+// Removed constraints leave unused symbols behind, once there are this many
+// and they are more than the used ones the tableau is built again.
+#define SIMPLEX_REBUILD_MIN_SYMBOLS 4096
+
+enum simplex_symbol_type_t {
+    SIMPLEX_INVALID,
+    SIMPLEX_EXTERNAL,
+    SIMPLEX_SLACK,
+    SIMPLEX_ERROR,
+    SIMPLEX_DUMMY
+};
+
+// Sparse row, cells are sorted by symbol.
+struct simplex_row_t {
+    double constant;
+    uint32_t len;
+    uint32_t size;
+    uint32_t *symbols;
+    double *coefficients;
+};
+
+// Symbols added to the tableau for a constraint. Marker is 0 if the
+// constraint isn't in the tableau, other is 0 if it has a single one.
+struct simplex_tag_t {
+    uint32_t marker;
+    uint32_t other;
+    double strength;
+};
+
+struct simplex_t {
+    // Indexed by tableau symbol, symbol 0 is invalid. Only basic symbols have
+    // a row. symbol_id is the system symbol of external symbols.
+    uint32_t num_symbols;
+    uint32_t symbols_size;
+    enum simplex_symbol_type_t *type;
+    struct simplex_row_t **rows;
+    uint64_t *symbol_id;
+
+    // Basic symbols in no particular order, and the position of each one.
+    uint32_t num_basic;
+    uint32_t *basic;
+    uint32_t *basic_position;
+
+    // External symbol of each system symbol, or 0. Edit symbols are
+    // externals too, edit_marker is the dummy symbol of the row that makes
+    // them equal to their value.
+    uint64_t external_size;
+    uint32_t *external;
+    uint32_t *edit_marker;
+
+    // Tag of each expression.
+    uint32_t tags_size;
+    struct simplex_tag_t *tags;
+
+    struct simplex_row_t objective;
+
+    // Only used while adding a constraint with an artificial symbol.
+    struct simplex_row_t *artificial;
+
+    // Basic symbols whose row may have a negative constant.
+    DYNAMIC_ARRAY_DEFINE (uint32_t, infeasible);
+
+    // Space to merge rows.
+    uint32_t scratch_size;
+    uint32_t *scratch_symbols;
+    double *scratch_coefficients;
+
+    uint32_t num_constraints;
+    uint32_t num_used_symbols;
+    uint64_t num_pivots;
+};
+
+static inline
+bool simplex_near_zero (double value)
+{
+    return fabs (value) < SIMPLEX_EPSILON;
+}
+
+void simplex_row_destroy (struct simplex_row_t *row)
+{
+    free (row->symbols);
+    free (row->coefficients);
+    *row = ZERO_INIT (struct simplex_row_t);
+}
+
+void simplex_row_reserve (struct simplex_row_t *row, uint32_t size)
+{
+    if (size > row->size) {
+        row->size = MAX (size, 2*row->size);
+        row->symbols = realloc (row->symbols, row->size*sizeof(uint32_t));
+        row->coefficients = realloc (row->coefficients, row->size*sizeof(double));
+    }
+}
+
+void simplex_row_copy (struct simplex_row_t *dest, struct simplex_row_t *src)
+{
+    simplex_row_reserve (dest, src->len);
+    dest->len = src->len;
+    dest->constant = src->constant;
+    if (src->len > 0) {
+        memcpy (dest->symbols, src->symbols, src->len*sizeof(uint32_t));
+        memcpy (dest->coefficients, src->coefficients, src->len*sizeof(double));
+    }
+}
+
+// Position of symbol in row, or where it would be inserted.
+uint32_t simplex_row_find (struct simplex_row_t *row, uint32_t symbol)
+{
+    uint32_t low = 0, high = row->len;
+    while (low < high) {
+        uint32_t mid = low + (high - low)/2;
+        if (row->symbols[mid] < symbol) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+double simplex_row_coefficient (struct simplex_row_t *row, uint32_t symbol)
+{
+    uint32_t i = simplex_row_find (row, symbol);
+    return i < row->len && row->symbols[i] == symbol ? row->coefficients[i] : 0;
+}
+
+void simplex_row_erase (struct simplex_row_t *row, uint32_t i)
+{
+    memmove (row->symbols + i, row->symbols + i + 1, (row->len - i - 1)*sizeof(uint32_t));
+    memmove (row->coefficients + i, row->coefficients + i + 1, (row->len - i - 1)*sizeof(double));
+    row->len--;
+}
+
+void simplex_row_remove (struct simplex_row_t *row, uint32_t symbol)
+{
+    uint32_t i = simplex_row_find (row, symbol);
+    if (i < row->len && row->symbols[i] == symbol) {
+        simplex_row_erase (row, i);
+    }
+}
+
+// Adds coefficient*symbol to row, cells that become 0 are removed.
+void simplex_row_insert_symbol (struct simplex_row_t *row, uint32_t symbol, double coefficient)
+{
+    uint32_t i = simplex_row_find (row, symbol);
+    if (i < row->len && row->symbols[i] == symbol) {
+        row->coefficients[i] += coefficient;
+        if (simplex_near_zero (row->coefficients[i])) {
+            simplex_row_erase (row, i);
+        }
+
+    } else if (!simplex_near_zero (coefficient)) {
+        simplex_row_reserve (row, row->len+1);
+        memmove (row->symbols + i + 1, row->symbols + i, (row->len - i)*sizeof(uint32_t));
+        memmove (row->coefficients + i + 1, row->coefficients + i, (row->len - i)*sizeof(double));
+        row->symbols[i] = symbol;
+        row->coefficients[i] = coefficient;
+        row->len++;
+    }
+}
+
+// Adds coefficient*other to row.
+void simplex_row_insert_row (struct simplex_t *simplex, struct simplex_row_t *row,
+                             struct simplex_row_t *other, double coefficient)
+{
+    row->constant += coefficient*other->constant;
+
+    uint32_t max_len = row->len + other->len;
+    if (max_len > simplex->scratch_size) {
+        simplex->scratch_size = MAX (max_len, 2*simplex->scratch_size);
+        simplex->scratch_symbols = realloc (simplex->scratch_symbols, simplex->scratch_size*sizeof(uint32_t));
+        simplex->scratch_coefficients = realloc (simplex->scratch_coefficients, simplex->scratch_size*sizeof(double));
+    }
+
+    uint32_t len = 0, i = 0, j = 0;
+    uint32_t *symbols = simplex->scratch_symbols;
+    double *coefficients = simplex->scratch_coefficients;
+    while (i < row->len || j < other->len) {
+        uint32_t symbol;
+        double value;
+        if (j == other->len || (i < row->len && row->symbols[i] < other->symbols[j])) {
+            symbol = row->symbols[i];
+            value = row->coefficients[i++];
+        } else if (i == row->len || other->symbols[j] < row->symbols[i]) {
+            symbol = other->symbols[j];
+            value = coefficient*other->coefficients[j++];
+        } else {
+            symbol = row->symbols[i];
+            value = row->coefficients[i++] + coefficient*other->coefficients[j++];
+        }
+
+        if (!simplex_near_zero (value)) {
+            symbols[len] = symbol;
+            coefficients[len] = value;
+            len++;
+        }
+    }
+
+    simplex_row_reserve (row, len);
+    memcpy (row->symbols, symbols, len*sizeof(uint32_t));
+    memcpy (row->coefficients, coefficients, len*sizeof(double));
+    row->len = len;
+}
+
+void simplex_row_scale (struct simplex_row_t *row, double factor)
+{
+    row->constant *= factor;
+    for (uint32_t i=0; i<row->len; i++) {
+        row->coefficients[i] *= factor;
+    }
+}
+
+// Turns the row symbol = constant + cells into one for the passed symbol,
+// which must be in it.
+void simplex_row_solve_for (struct simplex_row_t *row, uint32_t symbol)
+{
+    uint32_t i = simplex_row_find (row, symbol);
+    assert (i < row->len && row->symbols[i] == symbol);
+    double factor = -1/row->coefficients[i];
+    simplex_row_erase (row, i);
+    simplex_row_scale (row, factor);
+}
+
+// Turns the row of basic symbol lhs into the row of rhs.
+void simplex_row_solve_for_pair (struct simplex_row_t *row, uint32_t lhs, uint32_t rhs)
+{
+    simplex_row_insert_symbol (row, lhs, -1);
+    simplex_row_solve_for (row, rhs);
+}
+
+// Replaces symbol in row by other, which is its row.
+void simplex_row_substitute (struct simplex_t *simplex, struct simplex_row_t *row,
+                             uint32_t symbol, struct simplex_row_t *other)
+{
+    uint32_t i = simplex_row_find (row, symbol);
+    if (i < row->len && row->symbols[i] == symbol) {
+        double coefficient = row->coefficients[i];
+        simplex_row_erase (row, i);
+        simplex_row_insert_row (simplex, row, other, coefficient);
+    }
+}
+
+uint32_t simplex_new_symbol (struct simplex_t *simplex, enum simplex_symbol_type_t type)
+{
+    if (simplex->num_symbols == simplex->symbols_size) {
+        simplex->symbols_size = MAX (64, 2*simplex->symbols_size);
+        simplex->type = realloc (simplex->type, simplex->symbols_size*sizeof(enum simplex_symbol_type_t));
+        simplex->rows = realloc (simplex->rows, simplex->symbols_size*sizeof(struct simplex_row_t*));
+        simplex->symbol_id = realloc (simplex->symbol_id, simplex->symbols_size*sizeof(uint64_t));
+        simplex->basic = realloc (simplex->basic, simplex->symbols_size*sizeof(uint32_t));
+        simplex->basic_position = realloc (simplex->basic_position, simplex->symbols_size*sizeof(uint32_t));
+    }
+
+    uint32_t symbol = simplex->num_symbols++;
+    simplex->type[symbol] = type;
+    simplex->rows[symbol] = NULL;
+    simplex->symbol_id[symbol] = 0;
+    simplex->num_used_symbols++;
+    return symbol;
+}
+
+void simplex_init (struct simplex_t *simplex)
+{
+    *simplex = ZERO_INIT (struct simplex_t);
+    simplex_new_symbol (simplex, SIMPLEX_INVALID);
+    simplex->num_used_symbols = 0;
+}
+
+void simplex_destroy (struct simplex_t *simplex)
+{
+    for (uint32_t i=0; i<simplex->num_basic; i++) {
+        simplex_row_destroy (simplex->rows[simplex->basic[i]]);
+        free (simplex->rows[simplex->basic[i]]);
+    }
+    free (simplex->type);
+    free (simplex->rows);
+    free (simplex->symbol_id);
+    free (simplex->basic);
+    free (simplex->basic_position);
+    free (simplex->external);
+    free (simplex->edit_marker);
+    free (simplex->tags);
+    simplex_row_destroy (&simplex->objective);
+    free (simplex->infeasible);
+    free (simplex->scratch_symbols);
+    free (simplex->scratch_coefficients);
+    *simplex = ZERO_INIT (struct simplex_t);
+}
+
+void simplex_set_row (struct simplex_t *simplex, uint32_t symbol, struct simplex_row_t *row)
+{
+    simplex->rows[symbol] = row;
+    simplex->basic_position[symbol] = simplex->num_basic;
+    simplex->basic[simplex->num_basic++] = symbol;
+}
+
+struct simplex_row_t* simplex_take_row (struct simplex_t *simplex, uint32_t symbol)
+{
+    struct simplex_row_t *row = simplex->rows[symbol];
+    simplex->rows[symbol] = NULL;
+
+    uint32_t position = simplex->basic_position[symbol];
+    uint32_t last = simplex->basic[--simplex->num_basic];
+    simplex->basic[position] = last;
+    simplex->basic_position[last] = position;
+    return row;
+}
+
+// Replaces symbol by row in the whole tableau. Rows of restricted symbols that
+// become negative are queued to be fixed by simplex_dual_optimize().
+void simplex_substitute (struct simplex_t *simplex, uint32_t symbol, struct simplex_row_t *row)
+{
+    for (uint32_t i=0; i<simplex->num_basic; i++) {
+        uint32_t basic = simplex->basic[i];
+        struct simplex_row_t *basic_row = simplex->rows[basic];
+        simplex_row_substitute (simplex, basic_row, symbol, row);
+        if (simplex->type[basic] != SIMPLEX_EXTERNAL && basic_row->constant < 0) {
+            DYNAMIC_ARRAY_APPEND (simplex->infeasible, basic);
+        }
+    }
+
+    simplex_row_substitute (simplex, &simplex->objective, symbol, row);
+    if (simplex->artificial != NULL) {
+        simplex_row_substitute (simplex, simplex->artificial, symbol, row);
+    }
+}
+
+// Makes entering basic in place of leaving.
+void simplex_pivot (struct simplex_t *simplex, uint32_t leaving, uint32_t entering)
+{
+    struct simplex_row_t *row = simplex_take_row (simplex, leaving);
+    simplex_row_solve_for_pair (row, leaving, entering);
+    simplex_substitute (simplex, entering, row);
+    simplex_set_row (simplex, entering, row);
+    simplex->num_pivots++;
+}
+
+// Primal simplex, minimizes objective keeping the tableau feasible.
+void simplex_optimize (struct simplex_t *simplex, struct simplex_row_t *objective)
+{
+    while (true) {
+        uint32_t entering = 0;
+        for (uint32_t i=0; i<objective->len; i++) {
+            if (simplex->type[objective->symbols[i]] != SIMPLEX_DUMMY && objective->coefficients[i] < 0) {
+                entering = objective->symbols[i];
+                break;
+            }
+        }
+        if (entering == 0) break;
+
+        uint32_t leaving = 0;
+        double min_ratio = INFINITY;
+        for (uint32_t i=0; i<simplex->num_basic; i++) {
+            uint32_t basic = simplex->basic[i];
+            if (simplex->type[basic] == SIMPLEX_EXTERNAL) continue;
+
+            double coefficient = simplex_row_coefficient (simplex->rows[basic], entering);
+            if (coefficient < 0) {
+                double ratio = -simplex->rows[basic]->constant/coefficient;
+                if (ratio < min_ratio) {
+                    min_ratio = ratio;
+                    leaving = basic;
+                }
+            }
+        }
+
+        // Objectives only have error symbols, which can't be negative, so
+        // they are bounded.
+        assert (leaving != 0 && "The objective is unbounded.");
+        if (leaving == 0) break;
+
+        simplex_pivot (simplex, leaving, entering);
+    }
+}
+
+// Dual simplex, makes the queued infeasible rows feasible again keeping the
+// tableau optimal. Returns false if a row can't be made feasible, which only
+// happens when the value of an edit symbol conflicts with required
+// constraints.
+bool simplex_dual_optimize (struct simplex_t *simplex)
+{
+    while (simplex->infeasible_len > 0) {
+        uint32_t leaving = simplex->infeasible[--simplex->infeasible_len];
+        struct simplex_row_t *row = simplex->rows[leaving];
+        if (row == NULL || simplex_near_zero (row->constant) || row->constant >= 0) continue;
+
+        uint32_t entering = 0;
+        double min_ratio = INFINITY;
+        for (uint32_t i=0; i<row->len; i++) {
+            uint32_t symbol = row->symbols[i];
+            if (row->coefficients[i] > 0 && simplex->type[symbol] != SIMPLEX_DUMMY) {
+                double ratio = simplex_row_coefficient (&simplex->objective, symbol)/row->coefficients[i];
+                if (ratio < min_ratio) {
+                    min_ratio = ratio;
+                    entering = symbol;
+                }
+            }
+        }
+
+        if (entering == 0) {
+            simplex->infeasible_len = 0;
+            return false;
+        }
+
+        simplex_pivot (simplex, leaving, entering);
+    }
+    return true;
+}
+
+// Adds the error symbols of a constraint to the objective, or removes them
+// when strength is negative.
+void simplex_objective_insert (struct simplex_t *simplex, uint32_t symbol, double strength)
+{
+    if (simplex->rows[symbol] != NULL) {
+        simplex_row_insert_row (simplex, &simplex->objective, simplex->rows[symbol], strength);
+    } else {
+        simplex_row_insert_symbol (&simplex->objective, symbol, strength);
+    }
+}
+
+uint32_t simplex_external_symbol (struct simplex_t *simplex, uint64_t id)
+{
+    if (id >= simplex->external_size) {
+        uint64_t size = MAX (id+1, 2*simplex->external_size);
+        simplex->external = realloc (simplex->external, size*sizeof(uint32_t));
+        simplex->edit_marker = realloc (simplex->edit_marker, size*sizeof(uint32_t));
+        memset (simplex->external + simplex->external_size, 0, (size - simplex->external_size)*sizeof(uint32_t));
+        memset (simplex->edit_marker + simplex->external_size, 0, (size - simplex->external_size)*sizeof(uint32_t));
+        simplex->external_size = size;
+    }
+
+    if (simplex->external[id] == 0) {
+        simplex->external[id] = simplex_new_symbol (simplex, SIMPLEX_EXTERNAL);
+        simplex->symbol_id[simplex->external[id]] = id;
+    }
+    return simplex->external[id];
+}
+
+// Builds the row of an expression in terms of the current parametric symbols,
+// creating the marker symbols of its tag.
+void simplex_expression_row (struct simplex_t *simplex, struct linear_system_t *system, uint32_t expression,
+                             struct simplex_row_t *row, struct simplex_tag_t *tag)
+{
+    struct expression_t *expr = &system->expressions[expression];
+    row->constant = expr->constant;
+
+    struct term_t *terms = expression_terms (system, expression);
+    for (uint32_t t=0; t<expr->num_terms; t++) {
+        uint64_t id = terms[t].symbol;
+        if (system->state[id] == SYMBOL_ASSIGNED && !system->is_edit[id]) {
+            row->constant += terms[t].coefficient*system->value[id];
+
+        } else if (!simplex_near_zero (terms[t].coefficient)) {
+            uint32_t symbol = simplex_external_symbol (simplex, id);
+            if (simplex->rows[symbol] != NULL) {
+                simplex_row_insert_row (simplex, row, simplex->rows[symbol], terms[t].coefficient);
+            } else {
+                simplex_row_insert_symbol (row, symbol, terms[t].coefficient);
+            }
+        }
+    }
+
+    tag->strength = expr->strength;
+    if (expr->relation != SOLVER_EQUAL) {
+        double coefficient = expr->relation == SOLVER_LESS_EQUAL ? 1 : -1;
+        tag->marker = simplex_new_symbol (simplex, SIMPLEX_SLACK);
+        simplex_row_insert_symbol (row, tag->marker, coefficient);
+        if (expr->strength < SOLVER_REQUIRED) {
+            tag->other = simplex_new_symbol (simplex, SIMPLEX_ERROR);
+            simplex_row_insert_symbol (row, tag->other, -coefficient);
+            simplex_row_insert_symbol (&simplex->objective, tag->other, expr->strength);
+        }
+
+    } else if (expr->strength >= SOLVER_REQUIRED) {
+        tag->marker = simplex_new_symbol (simplex, SIMPLEX_DUMMY);
+        simplex_row_insert_symbol (row, tag->marker, 1);
+
+    } else {
+        tag->marker = simplex_new_symbol (simplex, SIMPLEX_ERROR);
+        tag->other = simplex_new_symbol (simplex, SIMPLEX_ERROR);
+        simplex_row_insert_symbol (row, tag->marker, -1);
+        simplex_row_insert_symbol (row, tag->other, 1);
+        simplex_row_insert_symbol (&simplex->objective, tag->marker, expr->strength);
+        simplex_row_insert_symbol (&simplex->objective, tag->other, expr->strength);
+    }
+}
+
+// Symbol that can be made basic in a new row without breaking feasibility.
+uint32_t simplex_choose_subject (struct simplex_t *simplex, struct simplex_row_t *row, struct simplex_tag_t *tag)
+{
+    for (uint32_t i=0; i<row->len; i++) {
+        if (simplex->type[row->symbols[i]] == SIMPLEX_EXTERNAL) {
+            return row->symbols[i];
+        }
+    }
+
+    uint32_t markers[] = {tag->marker, tag->other};
+    for (int i=0; i<ARRAY_SIZE(markers); i++) {
+        enum simplex_symbol_type_t type = simplex->type[markers[i]];
+        if ((type == SIMPLEX_SLACK || type == SIMPLEX_ERROR) && simplex_row_coefficient (row, markers[i]) < 0) {
+            return markers[i];
+        }
+    }
+    return 0;
+}
+
+// Adds a row that has no valid subject by first making it basic on an
+// artificial symbol, and minimizing that symbol. If it can't be made 0 the
+// row can't be satisfied, the tableau is left as it was, only the basis may
+// have changed.
+bool simplex_add_with_artificial_symbol (struct simplex_t *simplex, struct simplex_row_t *row)
+{
+    uint32_t artificial = simplex_new_symbol (simplex, SIMPLEX_SLACK);
+    simplex_set_row (simplex, artificial, row);
+
+    struct simplex_row_t artificial_objective = {0};
+    simplex_row_copy (&artificial_objective, row);
+    simplex->artificial = &artificial_objective;
+    simplex_optimize (simplex, &artificial_objective);
+    simplex->artificial = NULL;
+    bool success = simplex_near_zero (artificial_objective.constant);
+    simplex_row_destroy (&artificial_objective);
+
+    if (simplex->rows[artificial] != NULL) {
+        struct simplex_row_t *artificial_row = simplex_take_row (simplex, artificial);
+
+        // All symbols of the row cancelled out, the constraint is redundant
+        // and no other row has the artificial symbol because it was basic.
+        if (artificial_row->len == 0) {
+            simplex_row_destroy (artificial_row);
+            free (artificial_row);
+            simplex->num_used_symbols--;
+            return success;
+        }
+
+        uint32_t entering = 0;
+        for (uint32_t i=0; i<artificial_row->len; i++) {
+            enum simplex_symbol_type_t type = simplex->type[artificial_row->symbols[i]];
+            if (type == SIMPLEX_SLACK || type == SIMPLEX_ERROR) {
+                entering = artificial_row->symbols[i];
+                break;
+            }
+        }
+
+        // Pivots never used this row, so without it the tableau is the one
+        // before adding the constraint.
+        if (!success || entering == 0) {
+            simplex_row_destroy (artificial_row);
+            free (artificial_row);
+            simplex->num_used_symbols--;
+            return false;
+        }
+
+        simplex_row_solve_for_pair (artificial_row, artificial, entering);
+        simplex_substitute (simplex, entering, artificial_row);
+        simplex_set_row (simplex, entering, artificial_row);
+        simplex->num_pivots++;
+    }
+
+    for (uint32_t i=0; i<simplex->num_basic; i++) {
+        simplex_row_remove (simplex->rows[simplex->basic[i]], artificial);
+    }
+    simplex_row_remove (&simplex->objective, artificial);
+    simplex->num_used_symbols--;
+    return success;
+}
+
+void simplex_remove_tag_symbols (struct simplex_t *simplex, struct simplex_tag_t *tag)
+{
+    simplex->num_used_symbols -= tag->other != 0 ? 2 : 1;
+    *tag = ZERO_INIT (struct simplex_tag_t);
+}
+
+// Makes some symbol basic in the row of a constraint, returns false if it can't
+// be satisfied together with the constraints already in the tableau. Then the
+// row is discarded and the tableau is left as it was.
+bool simplex_add_row (struct simplex_t *simplex, struct simplex_row_t *row, struct simplex_tag_t *tag)
+{
+    if (row->constant < 0) {
+        simplex_row_scale (row, -1);
+    }
+
+    uint32_t subject = simplex_choose_subject (simplex, row, tag);
+    if (subject == 0) {
+        bool all_dummies = true;
+        for (uint32_t i=0; i<row->len; i++) {
+            if (simplex->type[row->symbols[i]] != SIMPLEX_DUMMY) {
+                all_dummies = false;
+                break;
+            }
+        }
+
+        if (all_dummies) {
+            if (!simplex_near_zero (row->constant)) {
+                simplex_row_destroy (row);
+                free (row);
+                return false;
+            }
+
+            // The constraint is redundant. Its dummy symbol stays basic, with
+            // a row of other dummies, until removing a constraint changes
+            // that, see simplex_fix_dummy_rows().
+            subject = tag->marker;
+        }
+    }
+
+    if (subject == 0) {
+        return simplex_add_with_artificial_symbol (simplex, row);
+    }
+
+    simplex_row_solve_for (row, subject);
+    simplex_substitute (simplex, subject, row);
+    simplex_set_row (simplex, subject, row);
+    return true;
+}
+
+// Adds an expression to the tableau, returns false if it's required and can't
+// be satisfied together with the ones already added. Then the tableau is left
+// as it was.
+bool simplex_add_expression (struct simplex_t *simplex, struct linear_system_t *system, uint32_t expression)
+{
+    if (expression >= simplex->tags_size) {
+        uint32_t size = MAX (expression+1, 2*simplex->tags_size);
+        simplex->tags = realloc (simplex->tags, size*sizeof(struct simplex_tag_t));
+        memset (simplex->tags + simplex->tags_size, 0, (size - simplex->tags_size)*sizeof(struct simplex_tag_t));
+        simplex->tags_size = size;
+    }
+
+    struct simplex_tag_t *tag = &simplex->tags[expression];
+    struct simplex_row_t *row = calloc (1, sizeof(struct simplex_row_t));
+    simplex_expression_row (simplex, system, expression, row, tag);
+
+    bool success = simplex_add_row (simplex, row, tag);
+    if (success) {
+        simplex->num_constraints++;
+    } else {
+        simplex_remove_tag_symbols (simplex, tag);
+    }
+
+    // Adding the row may leave other rows infeasible, like the dual simplex
+    // does, so they are fixed before optimizing.
+    simplex_dual_optimize (simplex);
+    simplex_optimize (simplex, &simplex->objective);
+
+    return success;
+}
+
+// Row to pivot out when removing a constraint whose marker isn't basic.
+// Restricted rows are preferred, choosing the one that keeps the tableau
+// feasible.
+uint32_t simplex_marker_leaving_row (struct simplex_t *simplex, uint32_t marker)
+{
+    double min_ratio_negative = INFINITY, min_ratio_positive = INFINITY;
+    uint32_t first = 0, second = 0, third = 0;
+    for (uint32_t i=0; i<simplex->num_basic; i++) {
+        uint32_t basic = simplex->basic[i];
+        struct simplex_row_t *row = simplex->rows[basic];
+        double coefficient = simplex_row_coefficient (row, marker);
+        if (coefficient == 0) continue;
+
+        if (simplex->type[basic] == SIMPLEX_EXTERNAL) {
+            third = basic;
+        } else if (coefficient < 0) {
+            double ratio = -row->constant/coefficient;
+            if (ratio < min_ratio_negative) {
+                min_ratio_negative = ratio;
+                first = basic;
+            }
+        } else {
+            double ratio = row->constant/coefficient;
+            if (ratio < min_ratio_positive) {
+                min_ratio_positive = ratio;
+                second = basic;
+            }
+        }
+    }
+
+    return first != 0 ? first : (second != 0 ? second : third);
+}
+
+// Redundant required equalities keep a basic dummy symbol whose row only has
+// other dummies. Removing a constraint may bring other symbols into that row,
+// then the dummy is no longer 0 and the row is added again as a constraint.
+void simplex_fix_dummy_rows (struct simplex_t *simplex)
+{
+    uint32_t i = 0;
+    while (i < simplex->num_basic) {
+        uint32_t basic = simplex->basic[i];
+        struct simplex_row_t *row = simplex->rows[basic];
+
+        bool all_dummies = true;
+        for (uint32_t j=0; j<row->len; j++) {
+            if (simplex->type[row->symbols[j]] != SIMPLEX_DUMMY) {
+                all_dummies = false;
+                break;
+            }
+        }
+        if (simplex->type[basic] != SIMPLEX_DUMMY || all_dummies) {
+            i++;
+            continue;
+        }
+
+        // Removing constraints can't make the others unsatisfiable. Pivots
+        // only bring in symbols that aren't dummies, so rows already checked
+        // still only have dummies. Taking the row moved another one to
+        // position i, which is checked next.
+        row = simplex_take_row (simplex, basic);
+        simplex_row_insert_symbol (row, basic, -1);
+        struct simplex_tag_t tag = {.marker = basic};
+        if (!simplex_add_row (simplex, row, &tag)) {
+            assert (false && "Failed to add redundant constraint.");
+        }
+    }
+}
+
+void simplex_remove_expression (struct simplex_t *simplex, uint32_t expression)
+{
+    if (expression >= simplex->tags_size || simplex->tags[expression].marker == 0) return;
+    struct simplex_tag_t *tag = &simplex->tags[expression];
+
+    if (simplex->type[tag->marker] == SIMPLEX_ERROR) {
+        simplex_objective_insert (simplex, tag->marker, -tag->strength);
+    }
+    if (tag->other != 0 && simplex->type[tag->other] == SIMPLEX_ERROR) {
+        simplex_objective_insert (simplex, tag->other, -tag->strength);
+    }
+
+    struct simplex_row_t *row;
+    if (simplex->rows[tag->marker] != NULL) {
+        row = simplex_take_row (simplex, tag->marker);
+
+    } else {
+        // The marker isn't basic, pivot it into the row chosen by
+        // simplex_marker_leaving_row() so that row can be dropped.
+        uint32_t leaving = simplex_marker_leaving_row (simplex, tag->marker);
+        if (leaving != 0) {
+            row = simplex_take_row (simplex, leaving);
+            simplex_row_solve_for_pair (row, leaving, tag->marker);
+            simplex_substitute (simplex, tag->marker, row);
+            simplex->num_pivots++;
+        } else {
+            // If no row has the marker, the constraint has no effect on the
+            // tableau. It shouldn't happen unless cells cancelled by rounding.
+            row = NULL;
+        }
+    }
+
+    if (row != NULL) {
+        simplex_row_destroy (row);
+        free (row);
+    }
+
+    simplex_remove_tag_symbols (simplex, tag);
+    simplex->num_constraints--;
+
+    simplex_fix_dummy_rows (simplex);
+    simplex_dual_optimize (simplex);
+    simplex_optimize (simplex, &simplex->objective);
+}
+
+// Forgets the external symbol of a removed system symbol, its id may be
+// reused by a new one. No constraint uses it, so it's basic at most in a row
+// nothing else refers to.
+void simplex_remove_symbol (struct simplex_t *simplex, uint64_t id)
+{
+    if (id >= simplex->external_size || simplex->external[id] == 0) return;
+
+    uint32_t symbol = simplex->external[id];
+    if (simplex->rows[symbol] != NULL) {
+        struct simplex_row_t *row = simplex_take_row (simplex, symbol);
+        simplex_row_destroy (row);
+        free (row);
+    }
+    simplex->external[id] = 0;
+    simplex->num_used_symbols--;
+}
+
+// Adds the row that makes an edit symbol equal to its value, returns false if
+// the value conflicts with required constraints. Suggesting a value changes
+// the constants of rows with its dummy symbol instead of building the row
+// again, see system_simplex_suggest().
+bool simplex_add_edit (struct simplex_t *simplex, struct linear_system_t *system, symbol_handle_t id)
+{
+    if (id < simplex->external_size && simplex->edit_marker[id] != 0) return true;
+
+    struct simplex_row_t *row = calloc (1, sizeof(struct simplex_row_t));
+    row->constant = -system->value[id];
+    uint32_t symbol = simplex_external_symbol (simplex, id);
+    if (simplex->rows[symbol] != NULL) {
+        simplex_row_insert_row (simplex, row, simplex->rows[symbol], 1);
+    } else {
+        simplex_row_insert_symbol (row, symbol, 1);
+    }
+
+    struct simplex_tag_t tag = {.marker = simplex_new_symbol (simplex, SIMPLEX_DUMMY)};
+    simplex_row_insert_symbol (row, tag.marker, 1);
+
+    bool success = simplex_add_row (simplex, row, &tag);
+    if (success) {
+        simplex->edit_marker[id] = tag.marker;
+    } else {
+        simplex->num_used_symbols--;
+    }
+
+    simplex_dual_optimize (simplex);
+    simplex_optimize (simplex, &simplex->objective);
+    return success;
+}
+
+static inline
+void simplex_store_value (struct linear_system_t *system, struct simplex_t *simplex, symbol_handle_t id)
+{
+    uint32_t symbol = id < simplex->external_size ? simplex->external[id] : 0;
+    double value = symbol != 0 && simplex->rows[symbol] != NULL ? simplex->rows[symbol]->constant : 0;
+    system->value[id] = simplex_near_zero (value) ? 0 : value;
+}
+
+void system_simplex_destroy (struct linear_system_t *system)
+{
+    if (system->simplex != NULL) {
+        simplex_destroy (system->simplex);
+        free (system->simplex);
+        system->simplex = NULL;
+    }
+    system->simplex_removed_expressions_len = 0;
+    system->simplex_removed_symbols_len = 0;
+}
+
+// Updates the tableau with the changes since the last solve and sets the
+// values of all unassigned symbols.
+bool system_solve_simplex (struct linear_system_t *system, string_t *error)
+{
+    bool success = true;
+    struct solver_stats_t *stats = &system->stats;
+
+    if (system->simplex != NULL && (system->simplex_is_stale ||
+        (system->simplex->num_symbols >= SIMPLEX_REBUILD_MIN_SYMBOLS &&
+         system->simplex->num_symbols > 2*system->simplex->num_used_symbols))) {
+        system_simplex_destroy (system);
+    }
+
+    if (system->simplex == NULL) {
+        system->simplex = malloc (sizeof(struct simplex_t));
+        simplex_init (system->simplex);
+    }
+    system->simplex_is_stale = false;
+
+    struct simplex_t *simplex = system->simplex;
+    uint64_t num_pivots = simplex->num_pivots;
+
+    for (uint32_t i=0; i<system->simplex_removed_expressions_len; i++) {
+        simplex_remove_expression (simplex, system->simplex_removed_expressions[i]);
+    }
+    system->simplex_removed_expressions_len = 0;
+
+    for (uint32_t i=0; i<system->simplex_removed_symbols_len; i++) {
+        simplex_remove_symbol (simplex, system->simplex_removed_symbols[i]);
+    }
+    system->simplex_removed_symbols_len = 0;
+
+    for (uint32_t i=0; i<system->expressions_len; i++) {
+        if (system->expressions[i].is_removed) continue;
+        if (i < simplex->tags_size && simplex->tags[i].marker != 0) continue;
+
+        if (!simplex_add_expression (simplex, system, i)) {
+            if (error != NULL) {
+                str_cat_c (error, "Unsatisfiable constraint '");
+                str_cat_expression (error, system, i);
+                str_cat_c (error, "'\n\n");
+            }
+            success = false;
+        }
+    }
+
+    for (uint64_t i=0; i<system->edit_symbols_len; i++) {
+        symbol_handle_t symbol = system->edit_symbols[i].symbol;
+        if (!simplex_add_edit (simplex, system, symbol)) {
+            if (error != NULL) {
+                str_cat_printf (error, "Unsatisfiable value of edit symbol '%s'\n\n",
+                                symbol_name (system, symbol));
+            }
+            success = false;
+        }
+    }
+
+    for (uint64_t id=0; id<system->last_id; id++) {
+        if (system->is_removed[id] || system->state[id] == SYMBOL_ASSIGNED) continue;
+
+        simplex_store_value (system, simplex, id);
+        system->state[id] = SYMBOL_SOLVED;
+        system->is_presolved[id] = false;
+        system->alias[id] = id;
+    }
+
+    stats->num_simplex_constraints = simplex->num_constraints;
+    stats->num_simplex_rows = simplex->num_basic;
+    stats->num_simplex_pivots = simplex->num_pivots - num_pivots;
+
+    return success;
+}
+
+// Changes the value of an edit symbol that has a row in the tableau. Like
+// changing the constant of a constraint, this only changes the constants of
+// the rows that have its dummy symbol, then the dual simplex restores
+// feasibility. Returns false if the value conflicts with required
+// constraints, then the tableau is stale.
+bool system_simplex_suggest (struct linear_system_t *system, symbol_handle_t symbol, double value)
+{
+    struct simplex_t *simplex = system->simplex;
+    uint32_t marker = simplex->edit_marker[symbol];
+    uint64_t num_pivots = simplex->num_pivots;
+
+    double delta = value - system->value[symbol];
+    system->value[symbol] = value;
+
+    bool success = true;
+    if (simplex->rows[marker] != NULL) {
+        // Required constraints already fix the value of the symbol.
+        simplex->rows[marker]->constant += delta;
+        success = simplex_near_zero (simplex->rows[marker]->constant);
+
+    } else {
+        for (uint32_t i=0; i<simplex->num_basic; i++) {
+            uint32_t basic = simplex->basic[i];
+            struct simplex_row_t *row = simplex->rows[basic];
+            double coefficient = simplex_row_coefficient (row, marker);
+            if (coefficient == 0) continue;
+
+            row->constant -= delta*coefficient;
+            if (simplex->type[basic] != SIMPLEX_EXTERNAL) {
+                if (row->constant < 0) {
+                    DYNAMIC_ARRAY_APPEND (simplex->infeasible, basic);
+                }
+
+            } else if (system->state[simplex->symbol_id[basic]] != SYMBOL_ASSIGNED) {
+                simplex_store_value (system, simplex, simplex->symbol_id[basic]);
+            }
+        }
+        success = simplex_dual_optimize (simplex);
+    }
+
+    if (!success) {
+        system->simplex_is_stale = true;
+        return false;
+    }
+
+    // Pivots change other rows, externals never leave the basis in the dual
+    // simplex so only basic ones need their value updated.
+    if (simplex->num_pivots != num_pivots) {
+        for (uint32_t i=0; i<simplex->num_basic; i++) {
+            uint32_t basic = simplex->basic[i];
+            if (simplex->type[basic] == SIMPLEX_EXTERNAL &&
+                system->state[simplex->symbol_id[basic]] != SYMBOL_ASSIGNED) {
+                simplex_store_value (system, simplex, simplex->symbol_id[basic]);
+            }
+        }
+    }
+    return true;
+}
+
+//////////////////////////
+// PRESOLVE
+//
+// Most equations generated by layouts have a single unknown once assignments
+// are taken into account, like 'min.x + size.x - max.x' when min and size are
+// fixed. Those are solved directly, which may leave other equations with a
+// single unknown, and so on. Only the equations that still have several
+// unknowns after this propagation are factored, for tree shaped layouts there
+// are none.
+//
+// Which expression computes which symbol only depends on the structure of the
+// system, so the order is computed once by system_presolve() and kept with
+// the factorization. Each solve just evaluates it with
+// system_presolve_solve().
+
+// Expressions like 'id.min.x - id.b.x' only say that two symbols are equal,
+// layouts generate lots of them when adding anchors. Instead of solving them,
+// unknown symbols tied by these expressions are merged into a single class,
+// represented by the symbol with the smallest id. The expressions are dropped
+// and everything afterwards sees the representative in place of each symbol.
+// After solving, system_expand_aliases() copies the value of representatives
+// back to every symbol in their class.
+void system_merge_aliases (struct linear_system_t *system, mem_pool_t *pool, mem_pool_t *scratch)
+{
+    mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (scratch);
+
+    uint32_t num_expressions = system->expressions_len;
+    uint64_t *parent = mem_pool_push_array_aligned (scratch, system->last_id, uint64_t);
+    bool *is_alias = mem_pool_push_array (scratch, num_expressions, bool);
+    for (uint64_t id=0; id<system->last_id; id++) {
+        parent[id] = id;
+    }
+
+    uint32_t num_alias_expressions = 0;
+    for (uint32_t i=0; i<num_expressions; i++) {
+        is_alias[i] = false;
+
+        struct expression_t *expression = &system->expressions[i];
+        if (expression->num_terms != 2 || expression->constant != 0) continue;
+
+        struct term_t *terms = expression_terms (system, i);
+        uint64_t a = terms[0].symbol;
+        uint64_t b = terms[1].symbol;
+        if (a == b || system->state[a] != SYMBOL_UNASSIGNED || system->state[b] != SYMBOL_UNASSIGNED) continue;
+        if (terms[0].coefficient == 0 || terms[0].coefficient != -terms[1].coefficient) continue;
+
+        union_find_union (parent, a, b);
+        is_alias[i] = true;
+        num_alias_expressions++;
+    }
+
+    if (num_alias_expressions > 0) {
+        system->expression_is_alias = mem_pool_push_array (pool, num_expressions, bool);
+        memcpy (system->expression_is_alias, is_alias, num_expressions*sizeof(bool));
+
+        uint64_t num_aliases = 0;
+        for (uint64_t id=0; id<system->last_id; id++) {
+            if (union_find_root (parent, id) != id) num_aliases++;
+        }
+
+        system->num_aliases = 0;
+        system->aliases = mem_pool_push_array_aligned (pool, num_aliases, uint64_t);
+        for (uint64_t id=0; id<system->last_id; id++) {
+            uint64_t root = union_find_root (parent, id);
+            if (root != id) {
+                system->alias[id] = root;
+                system->aliases[system->num_aliases++] = id;
+            }
+        }
+    }
+
+    mem_pool_end_temporary_memory (mrkr);
+}
+
+void system_expand_aliases (struct linear_system_t *system, struct solver_stats_t *stats)
+{
+    for (uint64_t k=0; k<system->num_aliases; k++) {
+        uint64_t id = system->aliases[k];
+        system->value[id] = system->value[system->alias[id]];
+        system->state[id] = system->state[system->alias[id]];
+    }
+    stats->num_aliases = system->num_aliases;
+}
+
+void system_presolve (struct linear_system_t *system, mem_pool_t *pool, mem_pool_t *scratch)
+{
+    mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (scratch);
+
+    uint32_t num_expressions = system->expressions_len;
+    uint32_t *num_unknowns = mem_pool_push_array_aligned (scratch, num_expressions, uint32_t);
+
+    // Expressions where each unknown symbol appears, in CSR form indexed by
+    // symbol id. Unknowns are counted once per expression even if they are in
+    // several terms, like after merging aliases in 'a + b - c' when a and b
+    // are aliases. last_expression holds the last expression that counted
+    // each symbol.
+    uint64_t *symbol_start = mem_pool_push_array_aligned (scratch, system->last_id+1, uint64_t);
+    memset (symbol_start, 0, (system->last_id+1)*sizeof(uint64_t));
+    uint32_t *last_expression = mem_pool_push_array_aligned (scratch, system->last_id, uint32_t);
+    memset (last_expression, 0xFF, system->last_id*sizeof(uint32_t));
+
+    for (uint32_t i=0; i<num_expressions; i++) {
+        num_unknowns[i] = 0;
+        if (system_expression_is_alias (system, i)) continue;
+
+        struct term_t *terms = expression_terms (system, i);
+        for (uint32_t t=0; t<system->expressions[i].num_terms; t++) {
+            uint64_t symbol = symbol_representative (system, terms[t].symbol);
+            if (!symbol_is_known (system, symbol) && last_expression[symbol] != i) {
+                last_expression[symbol] = i;
+                num_unknowns[i]++;
+                symbol_start[symbol+1]++;
+            }
+        }
+    }
+
+    for (uint64_t id=0; id<system->last_id; id++) {
+        symbol_start[id+1] += symbol_start[id];
+    }
+
+    uint32_t *symbol_expressions = mem_pool_push_array_aligned (scratch, symbol_start[system->last_id], uint32_t);
+    memset (last_expression, 0xFF, system->last_id*sizeof(uint32_t));
+    for (uint32_t i=0; i<num_expressions; i++) {
+        if (system_expression_is_alias (system, i)) continue;
+
+        struct term_t *terms = expression_terms (system, i);
+        for (uint32_t t=0; t<system->expressions[i].num_terms; t++) {
+            uint64_t symbol = symbol_representative (system, terms[t].symbol);
+            if (!symbol_is_known (system, symbol) && last_expression[symbol] != i) {
+                last_expression[symbol] = i;
+                symbol_expressions[symbol_start[symbol]++] = i;
+            }
+        }
+    }
+
+    // Filling moved each start to the start of the next symbol, move them back.
+    for (uint64_t id=system->last_id; id>0; id--) {
+        symbol_start[id] = symbol_start[id-1];
+    }
+    symbol_start[0] = 0;
+
+    uint32_t *queue = mem_pool_push_array_aligned (scratch, num_expressions, uint32_t);
+    uint32_t queue_start = 0, queue_end = 0;
+    for (uint32_t i=0; i<num_expressions; i++) {
+        if (num_unknowns[i] == 1) queue[queue_end++] = i;
+    }
+
+    // An expression enters the queue once, when it gets to a single unknown,
+    // so at most one symbol is computed from each one.
+    uint32_t *presolve_expressions = mem_pool_push_array_aligned (scratch, num_expressions, uint32_t);
+    uint64_t *presolve_symbols = mem_pool_push_array_aligned (scratch, num_expressions, uint64_t);
+    uint64_t num_presolved = 0;
+
+    while (queue_start < queue_end) {
+        uint32_t i = queue[queue_start++];
+
+        // The unknown may be in several terms, its coefficient is their sum.
+        uint64_t id = UINT64_MAX;
+        double coefficient = 0;
+        struct term_t *terms = expression_terms (system, i);
+        for (uint32_t t=0; t<system->expressions[i].num_terms; t++) {
+            uint64_t symbol = symbol_representative (system, terms[t].symbol);
+            if (!symbol_is_known (system, symbol)) {
+                id = symbol;
+                coefficient += terms[t].coefficient;
+            }
+        }
+
+        // Only happens if the coefficient is 0, the expression is left for
+        // elimination so it gets reported if the symbol can't be solved.
+        if (id == UINT64_MAX || fabs(coefficient) < SOLVER_EPSILON) continue;
+
+        system->is_presolved[id] = true;
+        presolve_expressions[num_presolved] = i;
+        presolve_symbols[num_presolved] = id;
+        num_presolved++;
+
+        for (uint64_t e=symbol_start[id]; e<symbol_start[id+1]; e++) {
+            uint32_t k = symbol_expressions[e];
+            num_unknowns[k]--;
+            if (num_unknowns[k] == 1) queue[queue_end++] = k;
+        }
+    }
+
+    system->num_presolved = num_presolved;
+    system->presolve_expressions = mem_pool_push_array_aligned (pool, num_presolved, uint32_t);
+    system->presolve_symbols = mem_pool_push_array_aligned (pool, num_presolved, uint64_t);
+    if (num_presolved > 0) {
+        memcpy (system->presolve_expressions, presolve_expressions, num_presolved*sizeof(uint32_t));
+        memcpy (system->presolve_symbols, presolve_symbols, num_presolved*sizeof(uint64_t));
+    }
+
+    mem_pool_end_temporary_memory (mrkr);
+}
+
+// Computes the values of presolved symbols from the current values of assigned
+// ones.
+void system_presolve_solve (struct linear_system_t *system, struct solver_stats_t *stats)
+{
+    for (uint64_t k=0; k<system->num_presolved; k++) {
+        uint32_t i = system->presolve_expressions[k];
+        uint64_t id = system->presolve_symbols[k];
+
+        double coefficient = 0;
+        double value = system->expressions[i].constant;
+        struct term_t *terms = expression_terms (system, i);
+        for (uint32_t t=0; t<system->expressions[i].num_terms; t++) {
+            uint64_t symbol = symbol_representative (system, terms[t].symbol);
+            if (symbol == id) {
+                coefficient += terms[t].coefficient;
+            } else {
+                value += terms[t].coefficient*system->value[symbol];
+            }
+        }
+
+        system->value[id] = -value/coefficient;
+        system->state[id] = SYMBOL_SOLVED;
+        stats->num_flops += 2*system->expressions[i].num_terms;
+    }
+    stats->num_presolved = system->num_presolved;
+}
+
+//////////////////////////
+// CONNECTED COMPONENTS
+//
+// Two unassigned symbols are connected if they appear together in an
+// expression. Symbols in different connected components can be solved
+// independently, so instead of solving a single big system we solve one small
+// system for each component. This also lets us tell which parts of the system
+// are overconstrained or underconstrained.
+//
+// The partition and the factorization of each component only depend on the
+// structure of the system: which symbols appear in each expression and which
+// ones are assigned. They are kept in linear_system_t and reused by
+// solver_solve() until the structure changes, so when only the values of
+// assigned symbols change, solving is just building the right hand side and
+// doing forward and back substitution. Adding expressions or symbols only
+// rebuilds the components they connect, see system_factor_incremental().
+
+struct system_component_t {
+    // Unassigned symbols in the component, in column order. The position of a
+    // symbol in this array is its column in the component's matrix.
+    uint32_t num_symbols;
+    uint64_t *symbol_ids;
+
+    // Indices into the system's expressions.
+    uint32_t num_expressions;
+    uint32_t *expressions;
+
+    bool is_factored;
+    struct sparse_lu_t lu;
+
+    // Set instead of lu if the component is a difference graph.
+    struct difference_graph_t *graph;
+
+    // Set instead of lu if the component is solved iteratively.
+    struct sparse_cg_t *cg;
+
+    // Set instead of lu if the component is dense, see dense_lu_is_worth_it().
+    struct dense_lu_t *dense;
+
+    // Set instead of lu if the component is banded after ordering.
+    struct band_lu_t *band;
+
+    // Terms of assigned symbols in each expression, in CSR form. These are the
+    // only ones needed to compute the right hand side.
+    uint32_t *rhs_start; // Has num_expressions+1 elements
+    uint64_t *rhs_symbols;
+    double *rhs_coefficients;
+};
+
+// Partitions the unassigned symbols and the expressions that contain them into
+// connected components. Components are ordered by their first symbol in
+// columns, which is the order used to number columns. Expressions without
+// unassigned symbols are returned in constant_expressions.
+//
+// The result is allocated in pool, temporary data in scratch.
+void system_compute_components (struct linear_system_t *system, mem_pool_t *pool, mem_pool_t *scratch,
+                                uint64_t *columns, uint32_t num_columns,
+                                uint32_t num_expressions,
+                                struct system_component_t **components, uint32_t *num_components,
+                                uint32_t **constant_expressions, uint32_t *num_constant_expressions)
+{
+    mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (scratch);
+
+    uint64_t *parent = mem_pool_push_array_aligned (scratch, system->last_id, uint64_t);
+    for (uint64_t id=0; id<system->last_id; id++) {
+        parent[id] = id;
+    }
+
+    int64_t *expression_root = mem_pool_push_array_aligned (scratch, num_expressions, int64_t);
+    for (uint32_t i=0; i<num_expressions; i++) {
+        int64_t first = -1;
+        struct term_t *terms = expression_terms (system, i);
+        for (uint32_t t=0; t<system->expressions[i].num_terms; t++) {
+            uint64_t symbol = symbol_representative (system, terms[t].symbol);
+            if (!symbol_is_known (system, symbol)) {
+                if (first == -1) {
+                    first = symbol;
+                } else {
+                    union_find_union (parent, first, symbol);
                 }
+            }
+        }
+        expression_root[i] = first;
+    }
+
+    // Number components in column order.
+    int64_t *root_component = mem_pool_push_array_aligned (scratch, system->last_id, int64_t);
+    for (uint64_t id=0; id<system->last_id; id++) {
+        root_component[id] = -1;
+    }
+
+    uint32_t component_count = 0;
+    for (uint32_t j=0; j<num_columns; j++) {
+        uint64_t root = union_find_root (parent, columns[j]);
+        if (root_component[root] == -1) {
+            root_component[root] = component_count++;
+        }
+    }
+
+    struct system_component_t *result = mem_pool_push_array_aligned (pool, component_count, struct system_component_t);
+    for (uint32_t c=0; c<component_count; c++) {
+        result[c] = ZERO_INIT (struct system_component_t);
+    }
+
+    uint32_t constant_count = 0;
+    for (uint32_t j=0; j<num_columns; j++) {
+        result[root_component[union_find_root (parent, columns[j])]].num_symbols++;
+    }
+    for (uint32_t i=0; i<num_expressions; i++) {
+        if (system_expression_is_alias (system, i)) {
+            continue;
+
+        } else if (expression_root[i] == -1) {
+            constant_count++;
+        } else {
+            result[root_component[union_find_root (parent, expression_root[i])]].num_expressions++;
+        }
+    }
+
+    for (uint32_t c=0; c<component_count; c++) {
+        result[c].symbol_ids = mem_pool_push_array_aligned (pool, result[c].num_symbols, uint64_t);
+        result[c].expressions = mem_pool_push_array_aligned (pool, result[c].num_expressions, uint32_t);
+        result[c].num_symbols = 0;
+        result[c].num_expressions = 0;
+    }
+
+    uint32_t *constant = mem_pool_push_array_aligned (pool, constant_count, uint32_t);
+    constant_count = 0;
+
+    for (uint32_t j=0; j<num_columns; j++) {
+        struct system_component_t *component = &result[root_component[union_find_root (parent, columns[j])]];
+        component->symbol_ids[component->num_symbols++] = columns[j];
+    }
+    for (uint32_t i=0; i<num_expressions; i++) {
+        if (system_expression_is_alias (system, i)) {
+            continue;
+
+        } else if (expression_root[i] == -1) {
+            constant[constant_count++] = i;
+        } else {
+            struct system_component_t *component = &result[root_component[union_find_root (parent, expression_root[i])]];
+            component->expressions[component->num_expressions++] = i;
+        }
+    }
+
+    mem_pool_end_temporary_memory (mrkr);
+
+    *components = result;
+    *num_components = component_count;
+    *constant_expressions = constant;
+    *num_constant_expressions = constant_count;
+}
+
+// Computes the factorization of a component and the list of terms needed to
+// build its right hand side. The result is allocated in pool, scratch is used
+// for temporary data.
+//
+// symbol_id_to_column is indexed by symbol id, only the entries of symbols in
+// this component are written.
+//
+// Large dense components are factored using threads, which is NULL when
+// called from one of its workers or if multithreading is disabled. The thread
+// pool is initialized here if it wasn't already.
+void system_factor_component (struct linear_system_t *system, mem_pool_t *pool, mem_pool_t *scratch,
+                              struct system_component_t *component, uint64_t *symbol_id_to_column,
+                              struct thread_pool_t *threads, struct solver_stats_t *stats)
+{
+    mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (scratch);
+    double start = wall_time_ms ();
+
+    for (uint32_t j=0; j<component->num_symbols; j++) {
+        symbol_id_to_column[component->symbol_ids[j]] = j;
+    }
+
+    struct sparse_matrix_t A;
+    system_build_sparse_matrix (system, scratch,
+                                component->expressions, component->num_expressions,
+                                symbol_id_to_column, component->num_symbols,
+                                &A);
+    uint64_t matrix_size = scratch->total_data - mrkr.total_data;
+
+    double factorization_start = wall_time_ms ();
+    struct difference_graph_t graph;
+    struct band_lu_t band;
+    uint64_t band_scratch_size = 0;
+    if (difference_graph_build (pool, scratch, &A, &graph)) {
+        component->graph = mem_pool_push_struct_aligned (pool, struct difference_graph_t);
+        *component->graph = graph;
+        component->cg = NULL;
+        component->dense = NULL;
+        component->band = NULL;
+        component->lu = ZERO_INIT (struct sparse_lu_t);
+
+    } else if (system->use_iterative_solver) {
+        component->graph = NULL;
+        component->cg = mem_pool_push_struct_aligned (pool, struct sparse_cg_t);
+        sparse_cg_init (pool, &A, component->cg);
+        component->dense = NULL;
+        component->band = NULL;
+        component->lu = ZERO_INIT (struct sparse_lu_t);
+
+    } else if (band_lu_factor (pool, scratch, &A, &band)) {
+        component->graph = NULL;
+        component->cg = NULL;
+        component->dense = NULL;
+        component->band = mem_pool_push_struct_aligned (pool, struct band_lu_t);
+        *component->band = band;
+        component->lu = ZERO_INIT (struct sparse_lu_t);
+        stats->num_flops += band.num_flops;
+        band_scratch_size = band.scratch_size;
+
+    } else if (dense_lu_is_worth_it (&A)) {
+        component->graph = NULL;
+        component->cg = NULL;
+        component->band = NULL;
+        // Don't start threads unless some trailing update can be split.
+        struct thread_pool_t *dense_threads = NULL;
+        if (threads != NULL && 2*(double)A.m*A.n*DENSE_LU_PANEL_WIDTH >= DENSE_LU_PARALLEL_MIN_FLOPS) {
+            if (threads->workers == NULL) {
+                thread_pool_init (threads, system->num_threads);
+            }
+            dense_threads = threads;
+        }
+
+        component->dense = mem_pool_push_struct_aligned (pool, struct dense_lu_t);
+        dense_lu_factor (pool, &A, component->dense, dense_threads);
+        component->lu = ZERO_INIT (struct sparse_lu_t);
+        stats->num_flops += component->dense->num_flops;
+
+    } else {
+        component->graph = NULL;
+        component->cg = NULL;
+        component->dense = NULL;
+        component->band = NULL;
+        sparse_lu_factor (pool, &A, &component->lu);
+    }
+    double factorization_end = wall_time_ms ();
+
+    uint32_t num_rhs_terms = 0;
+    for (uint32_t i=0; i<component->num_expressions; i++) {
+        struct term_t *terms = expression_terms (system, component->expressions[i]);
+        for (uint32_t t=0; t<system->expressions[component->expressions[i]].num_terms; t++) {
+            if (symbol_is_known (system, symbol_representative (system, terms[t].symbol))) num_rhs_terms++;
+        }
+    }
+
+    component->rhs_start = mem_pool_push_array_aligned (pool, component->num_expressions+1, uint32_t);
+    component->rhs_symbols = mem_pool_push_array_aligned (pool, num_rhs_terms, uint64_t);
+    component->rhs_coefficients = mem_pool_push_array_aligned (pool, num_rhs_terms, double);
+
+    uint32_t pos = 0;
+    for (uint32_t i=0; i<component->num_expressions; i++) {
+        component->rhs_start[i] = pos;
+
+        struct term_t *terms = expression_terms (system, component->expressions[i]);
+        for (uint32_t t=0; t<system->expressions[component->expressions[i]].num_terms; t++) {
+            uint64_t symbol = symbol_representative (system, terms[t].symbol);
+            if (symbol_is_known (system, symbol)) {
+                component->rhs_symbols[pos] = symbol;
+                component->rhs_coefficients[pos] = terms[t].coefficient;
+                pos++;
+            }
+        }
+    }
+    component->rhs_start[component->num_expressions] = pos;
+
+    component->is_factored = true;
+
+    stats->num_factored_components++;
+    stats->num_flops += component->lu.num_flops;
+    stats->peak_temporary_size = MAX (stats->peak_temporary_size,
+                                      matrix_size + component->lu.scratch_size + band_scratch_size);
+    stats->factorization_ms += factorization_end - factorization_start;
+    stats->matrix_build_ms += (factorization_start - start) + (wall_time_ms () - factorization_end);
+
+    mem_pool_end_temporary_memory (mrkr);
+}
+
+void component_build_rhs (struct linear_system_t *system, struct system_component_t *component, double *b)
+{
+    for (uint32_t i=0; i<component->num_expressions; i++) {
+        double constant = system->expressions[component->expressions[i]].constant;
+        for (uint32_t e=component->rhs_start[i]; e<component->rhs_start[i+1]; e++) {
+            constant += component->rhs_coefficients[e]*system->value[component->rhs_symbols[e]];
+        }
+        b[i] = -constant;
+    }
+}
+
+// Solves a factored component and copies the solution into the symbol
+// definitions. If error is not NULL, problems are reported into it and false
+// is returned if the component couldn't be fully solved.
+bool system_solve_component (struct linear_system_t *system, mem_pool_t *scratch,
+                             struct system_component_t *component, uint32_t component_idx,
+                             struct solver_stats_t *stats, string_t *error)
+{
+    bool success = true;
+
+    mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (scratch);
+    double start = wall_time_ms ();
+
+    struct sparse_lu_t *lu = &component->lu;
+    double *b = mem_pool_push_array_aligned (scratch, component->num_expressions, double);
+    double *x = mem_pool_push_array_aligned (scratch, component->num_symbols, double);
+    bool *known = mem_pool_push_array (scratch, component->num_symbols, bool);
+    component_build_rhs (system, component, b);
+
+    // Direct solvers leave the residuals of dependent rows in b, the iterative
+    // one leaves the residual of all rows.
+    uint32_t num_dependent = 0;
+    uint32_t *dependent_row = NULL;
+    int64_t *dependent_blame_col = NULL;
+    bool converged = true;
+    uint32_t num_iterations = 0;
+    double relative_residual = 0;
+    if (component->cg != NULL) {
+        // Start from the values of the previous solve.
+        for (uint32_t j=0; j<component->num_symbols; j++) {
+            x[j] = system->value[component->symbol_ids[j]];
+        }
 
-                if (maximum == 0) {
-                    k++;
+        double tolerance = system->iterative_tolerance > 0 ?
+            system->iterative_tolerance : SOLVER_ITERATIVE_DEFAULT_TOLERANCE;
+        uint32_t max_iterations = system->iterative_max_iterations > 0 ?
+            system->iterative_max_iterations : 2*component->num_symbols;
+        num_iterations = sparse_cg_solve (component->cg, scratch, b, x, tolerance, max_iterations,
+                                          &relative_residual, &stats->num_flops);
+        converged = relative_residual <= tolerance;
+
+        // Values are kept even if the solver didn't converge, so the next
+        // solve continues from them.
+        for (uint32_t j=0; j<component->num_symbols; j++) {
+            known[j] = converged;
+            system->value[component->symbol_ids[j]] = x[j];
+        }
 
-                } else {
-                    // Swap the found row into row h.
-                    for (int j=0; j<n; j++) {
-                        double tmp = augmented_matrix[n*m_i+j];
-                        augmented_matrix[n*m_i+j] = augmented_matrix[n*h+j];
-                        augmented_matrix[n*h+j] = tmp;
-                    }
+        stats->num_iterations += num_iterations;
+        stats->max_relative_residual = MAX (stats->max_relative_residual, relative_residual);
+        if (!converged) stats->num_unconverged_components++;
+
+    } else if (component->graph != NULL) {
+        struct difference_graph_t *graph = component->graph;
+        difference_graph_solve (graph, b, x, known);
+        num_dependent = graph->num_dependent;
+        dependent_row = graph->dependent_row;
+        dependent_blame_col = graph->dependent_blame_col;
+        stats->num_flops += difference_graph_solve_flops (graph);
+
+    } else if (component->band != NULL) {
+        band_lu_solve (component->band, scratch, b, x, known);
+        stats->num_flops += band_lu_solve_flops (component->band);
+
+    } else if (component->dense != NULL) {
+        struct dense_lu_t *dense = component->dense;
+        dense_lu_solve (dense, b, x, known);
+        num_dependent = dense->num_dependent;
+        dependent_row = dense->dependent_row;
+        dependent_blame_col = dense->dependent_blame_col;
+        stats->num_flops += dense_lu_solve_flops (dense);
 
-                    // Operate all expressions below pivot to make 0 the k column
-                    for (int i=h+1; i<m; i++) {
-                        // We want to know if a row becomes zero except for the
-                        // constant coefficient, this means the symbol
-                        // represented by the pivot's column was
-                        // overconstrained. Store if this symbol was already
-                        // zero, and check if after the update it becomes a zero
-                        // row except for the element in the last column.
-                        //
-                        // TODO: We really can't know the specific
-                        // overconstrained symbol, it can be any one in that
-                        // connected component. We should mark the whole
-                        // connected component as overconstrained. We can,
-                        // however, keep track of the row positions and compute
-                        // which expression couldn't be satisfied.
-                        bool was_zero = augmented_matrix[n*i+k] == 0;
-                        bool is_overconstrained = true;
-
-                        double c = augmented_matrix[n*i+k]/augmented_matrix[n*h+k];
-                        augmented_matrix[n*i+k] = 0;
-                        for (int j=k+1; j<n; j++) {
-                            augmented_matrix[n*i+j] -= augmented_matrix[n*h+j]*c;
-
-                            if (j < n-1) {
-                                is_overconstrained &= (augmented_matrix[n*i+j] == 0);
-                            } else {
-                                is_overconstrained &= (augmented_matrix[n*i+j] != 0);
-                            }
-                        }
+    } else {
+        sparse_lu_solve (lu, b, x, known);
+        num_dependent = lu->num_dependent;
+        dependent_row = lu->dependent_row;
+        dependent_blame_col = lu->dependent_blame_col;
+        stats->num_flops += sparse_lu_solve_flops (lu);
+    }
+    double copy_back_start = wall_time_ms ();
 
-                        if (is_overconstrained && !was_zero) {
-                            struct symbol_definition_t *symbol = id_to_symbol_definition_get(&system->id_to_symbol_definition, column_to_symbol_id[k]);
-                            str_cat_printf (error, "Overconstrained symbol '%s'\n", str_data(&symbol->name));
-                            success = false;
-                        }
-                    }
+    // Copy result back into symbol values as a solution
+    uint32_t num_unsolved = 0;
+    for (uint32_t j=0; j<component->num_symbols; j++) {
+        if (known[j]) {
+            system->value[component->symbol_ids[j]] = x[j];
+            system->state[component->symbol_ids[j]] = SYMBOL_SOLVED;
 
-                    // Go to next pivot
-                    h++;
-                    k++;
-                }
+        } else {
+            num_unsolved++;
+        }
+    }
 
-                //str_cat_matrix (error, augmented_matrix, m, n);
+    stats->peak_temporary_size = MAX (stats->peak_temporary_size, scratch->total_data - mrkr.total_data);
+    stats->substitution_ms += copy_back_start - start;
+    stats->copy_back_ms += wall_time_ms () - copy_back_start;
+
+    if (error != NULL && !converged) {
+        success = false;
+
+        str_cat_printf (error, "Component %u of '%s' (%u symbols, %u equations) didn't converge, relative residual is %g after %u iterations:\n",
+                        component_idx, symbol_name (system, component->symbol_ids[0]),
+                        component->num_symbols, component->num_expressions,
+                        relative_residual, num_iterations);
+        for (uint32_t i=0; i<component->num_expressions; i++) {
+            if (fabs(b[i]) > SOLVER_EPSILON) {
+                str_cat_printf (error, "Residual %g in equation '", b[i]);
+                str_cat_expression (error, system, component->expressions[i]);
+                str_cat_c (error, "'\n");
             }
         }
-
-        // Perform back substitution
-        {
-            // For each linearly dependent equation in the beginning, we will
-            // get a row with all zeroes at the end. For each equation that
-            // overconstrains the systemm, we get a row with all zeroes except
-            // for the constant term. Make h start at the last non zero row.
-            int h = m-1;
-            while (augmented_matrix[h*n + n - 1] == 0 && augmented_matrix[h*n + n - 2] == 0) {
-                h--;
+        str_cat_c (error, "\n");
+
+    } else if (error != NULL && component->cg == NULL) {
+        // Rows that became zero except for the constant term mean the symbol
+        // represented by the last pivot that modified them was
+        // overconstrained.
+        //
+        // TODO: We really can't know the specific overconstrained symbol, it
+        // can be any one in the component. We can, however, keep track of the
+        // row positions and compute which expression couldn't be satisfied.
+        uint32_t num_overconstrained = 0;
+        for (uint32_t i=0; i<num_dependent; i++) {
+            if (fabs(b[dependent_row[i]]) > SOLVER_EPSILON) {
+                num_overconstrained++;
             }
+        }
 
-            //str_cat_matrix (error, augmented_matrix, m, n);
+        if (num_overconstrained > 0 || num_unsolved > 0) {
+            success = false;
+
+            str_cat_printf (error, "Component %u of '%s' (%u symbols, %u equations) is ",
+                            component_idx, symbol_name (system, component->symbol_ids[0]),
+                            component->num_symbols, component->num_expressions);
+            if (num_overconstrained > 0 && num_unsolved > 0) {
+                str_cat_c (error, "overconstrained and underconstrained:\n");
+            } else if (num_overconstrained > 0) {
+                str_cat_c (error, "overconstrained:\n");
+            } else {
+                str_cat_c (error, "underconstrained:\n");
+            }
 
-            while (h>=0) {
-                // Compute index of the leading coefficient. We don't assume
-                // leading coefficients are in a straight diagonal. This
-                // produces a partially solution, even in systems that are not
-                // fully solvable.
-                int k = 0;
-                while (augmented_matrix[h*n + k] == 0) {
-                    k++;
+            for (uint32_t i=0; i<num_dependent; i++) {
+                if (fabs(b[dependent_row[i]]) > SOLVER_EPSILON) {
+                    int64_t col = dependent_blame_col[i];
+                    if (col != -1) {
+                        str_cat_printf (error, "Overconstrained symbol '%s'\n",
+                                        symbol_name (system, component->symbol_ids[col]));
 
-                    // If we get a row of zeros in the middle, the matrix isn't in echelon form.
-                    //assert (k < n - 1);
+                    } else {
+                        str_cat_c (error, "Unsatisfiable equation '");
+                        str_cat_expression (error, system, component->expressions[dependent_row[i]]);
+                        str_cat_c (error, "'\n");
+                    }
                 }
+            }
 
-                // Only do back substitution if the only non zero coefficient is
-                // the leading one. Otherwise, skip the row.
-                bool back_substitute = true;
-                for (int i=k+1; i < n - 1 && back_substitute; i++) {
-                    if (augmented_matrix[n*h+i] != 0) back_substitute = false;
+            for (uint32_t j=0; j<component->num_symbols; j++) {
+                if (!known[j]) {
+                    str_cat_printf (error, "Unsolved symbol '%s'\n", symbol_name (system, component->symbol_ids[j]));
                 }
+            }
+
+            str_cat_c (error, "\n");
+            if (component->graph != NULL) {
+                str_cat_difference_graph (error, component->graph, b);
+            } else if (component->dense != NULL) {
+                str_cat_dense_lu (error, component->dense, b);
+            } else {
+                str_cat_sparse_lu (error, lu, b);
+            }
+        }
+    }
+
+    mem_pool_end_temporary_memory (mrkr);
+
+    return success;
+}
+
+// Systems with less components than this are solved in the calling thread,
+// waking up workers isn't worth it for them.
+#define SOLVER_PARALLEL_MIN_COMPONENTS 64
+
+// Components are grouped into tasks of at least this many expressions so that
+// the overhead of scheduling a task is amortized over thousands of tiny
+// components.
+#define SOLVER_TASK_MIN_EXPRESSIONS 256
+
+struct solve_components_task_t {
+    struct linear_system_t *system;
+    struct system_component_t *components;
+    uint32_t first_component;
+    uint32_t num_components;
+
+    // One per component, so the output doesn't depend on the order in which
+    // tasks are executed. NULL if errors aren't being reported.
+    string_t *errors;
+    bool *success;
+
+    // One per worker, indexed by worker id.
+    struct solver_stats_t *worker_stats;
+};
+
+THREAD_POOL_TASK (solve_components_task)
+{
+    struct solve_components_task_t *task = (struct solve_components_task_t*)data;
+    struct linear_system_t *system = task->system;
+
+    for (uint32_t c=task->first_component; c<task->first_component+task->num_components; c++) {
+        struct system_component_t *component = &task->components[c];
+        struct solver_stats_t *stats = &task->worker_stats[worker->id];
+        if (system->is_solved && component->is_factored) {
+            task->success[c] = true;
+            continue;
+        }
+
+        if (!component->is_factored) {
+            system_factor_component (system, &system->factor_pools[worker->id], &worker->pool,
+                                     component, system->symbol_id_to_column, NULL, stats);
+        }
+
+        task->success[c] = system_solve_component (system, &worker->pool, component, c, stats,
+                                                   task->errors != NULL ? &task->errors[c] : NULL);
+    }
+}
+
+// Factors (if necessary) and solves all components in parallel using the
+// system's thread pool. Symbols of different components are disjoint, so tasks
+// never write to the same symbol definition or the same entry of
+// symbol_id_to_column. Each worker allocates factorizations in its own pool
+// from system->factor_pools.
+bool system_solve_components_parallel (struct linear_system_t *system, string_t *error)
+{
+    bool success = true;
+
+    uint32_t num_components = system->num_components;
+    struct system_component_t *components = system->components;
+
+    mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (&system->pool);
+
+    bool *component_success = mem_pool_push_array (&system->pool, num_components, bool);
+    string_t *errors = NULL;
+    if (error != NULL) {
+        errors = mem_pool_push_array_aligned (&system->pool, num_components, string_t);
+        for (uint32_t c=0; c<num_components; c++) {
+            errors[c] = ZERO_INIT (string_t);
+        }
+    }
+
+    int num_workers = system->thread_pool.num_workers;
+    struct solver_stats_t *worker_stats = mem_pool_push_array_aligned (&system->pool, num_workers, struct solver_stats_t);
+    for (int i=0; i<num_workers; i++) {
+        worker_stats[i] = ZERO_INIT (struct solver_stats_t);
+    }
+
+    // There can't be more tasks than components.
+    struct solve_components_task_t *task_data =
+        mem_pool_push_array_aligned (&system->pool, num_components, struct solve_components_task_t);
+    struct thread_pool_task_info_t *tasks =
+        mem_pool_push_array_aligned (&system->pool, num_components, struct thread_pool_task_info_t);
+
+    int num_tasks = 0;
+    uint32_t c = 0;
+    while (c < num_components) {
+        struct solve_components_task_t *curr_task = &task_data[num_tasks];
+        curr_task->system = system;
+        curr_task->components = components;
+        curr_task->first_component = c;
+        curr_task->num_components = 0;
+        curr_task->errors = errors;
+        curr_task->success = component_success;
+        curr_task->worker_stats = worker_stats;
+
+        uint32_t num_expressions = 0;
+        while (c < num_components && num_expressions < SOLVER_TASK_MIN_EXPRESSIONS) {
+            num_expressions += components[c].num_expressions;
+            curr_task->num_components++;
+            c++;
+        }
+
+        tasks[num_tasks].task = solve_components_task;
+        tasks[num_tasks].data = curr_task;
+        num_tasks++;
+    }
+
+    thread_pool_run (&system->thread_pool, tasks, num_tasks);
+
+    struct solver_stats_t *stats = &system->stats;
+    for (int i=0; i<num_workers; i++) {
+        stats->matrix_build_ms += worker_stats[i].matrix_build_ms;
+        stats->factorization_ms += worker_stats[i].factorization_ms;
+        stats->substitution_ms += worker_stats[i].substitution_ms;
+        stats->copy_back_ms += worker_stats[i].copy_back_ms;
+        stats->num_factored_components += worker_stats[i].num_factored_components;
+        stats->num_flops += worker_stats[i].num_flops;
+        stats->peak_temporary_size = MAX (stats->peak_temporary_size, worker_stats[i].peak_temporary_size);
+        stats->num_iterations += worker_stats[i].num_iterations;
+        stats->num_unconverged_components += worker_stats[i].num_unconverged_components;
+        stats->max_relative_residual = MAX (stats->max_relative_residual, worker_stats[i].max_relative_residual);
+    }
+
+    for (uint32_t c=0; c<num_components; c++) {
+        success &= component_success[c];
+        if (error != NULL) {
+            str_cat (error, &errors[c]);
+            str_free (&errors[c]);
+        }
+    }
 
-                if (!back_substitute) {
-                    h--;
+    mem_pool_end_temporary_memory (mrkr);
 
+    return success;
+}
+
+#define SOLVER_NO_COMPONENT UINT32_MAX
+#define SOLVER_NO_MARK UINT32_MAX
+
+// Makes the arrays indexed by symbol id large enough for all symbols. Old
+// arrays are left in the factorization pool.
+void system_grow_symbol_arrays (struct linear_system_t *system)
+{
+    if (system->last_id <= system->symbol_arrays_size) return;
+
+    mem_pool_t *pool = &system->factorization_pool;
+    uint64_t old_size = system->symbol_arrays_size;
+    uint64_t new_size = MAX (system->last_id, 2*old_size);
+
+    uint64_t *symbol_id_to_column = mem_pool_push_array_aligned (pool, new_size, uint64_t);
+    uint32_t *symbol_component = mem_pool_push_array_aligned (pool, new_size, uint32_t);
+    uint32_t *symbol_mark = mem_pool_push_array_aligned (pool, new_size, uint32_t);
+    if (old_size > 0) {
+        memcpy (symbol_id_to_column, system->symbol_id_to_column, old_size*sizeof(uint64_t));
+        memcpy (symbol_component, system->symbol_component, old_size*sizeof(uint32_t));
+        memcpy (symbol_mark, system->symbol_mark, old_size*sizeof(uint32_t));
+    }
+    for (uint64_t id=old_size; id<new_size; id++) {
+        symbol_component[id] = SOLVER_NO_COMPONENT;
+        symbol_mark[id] = SOLVER_NO_MARK;
+    }
+
+    system->symbol_id_to_column = symbol_id_to_column;
+    system->symbol_component = symbol_component;
+    system->symbol_mark = symbol_mark;
+    system->symbol_arrays_size = new_size;
+}
+
+// Symbols involved in an incremental update. Each one is a node of a union
+// find, identified by its position in the symbol array, and symbol_mark maps
+// symbol ids back to it.
+struct incremental_nodes_t {
+    uint32_t num_nodes;
+    uint64_t *symbol;
+    uint64_t *parent;
+};
+
+uint64_t system_incremental_node (struct linear_system_t *system, struct incremental_nodes_t *nodes, uint64_t id)
+{
+    if (system->symbol_mark[id] == SOLVER_NO_MARK) {
+        uint32_t node = nodes->num_nodes++;
+        nodes->symbol[node] = id;
+        nodes->parent[node] = node;
+        system->symbol_mark[id] = node;
+
+        // All symbols of a component end up in the same group, joining them
+        // with the first symbol of the component is enough.
+        uint32_t c = system->symbol_component[id];
+        if (c != SOLVER_NO_COMPONENT && system->components[c].symbol_ids[0] != id) {
+            uint64_t first = system_incremental_node (system, nodes, system->components[c].symbol_ids[0]);
+            union_find_union (nodes->parent, first, node);
+        }
+    }
+    return system->symbol_mark[id];
+}
+
+// Updates the partition with the expressions and symbols added since the last
+// call to system_factor() or to this function, without factoring the whole
+// system again. Components connected by new expressions, together with new
+// unknown symbols, are replaced by merged components. Only these get factored
+// again the next time the system is solved, the rest keep their factorization.
+// New expressions without unknowns are added to the constant expressions.
+//
+// Presolve isn't extended, new expressions always go to a component even if
+// they have a single unknown. The result is the same, only slower to solve.
+// Returns false, without changing anything, if the system should be factored
+// from scratch instead. This happens when the components rebuilt since the
+// last full factorization add up to more symbols than the system had, then
+// the factorization pool has more garbage than live data, and presolve
+// would remove most of the merged components.
+bool system_factor_incremental (struct linear_system_t *system)
+{
+    bool success = true;
+    mem_pool_t *pool = &system->factorization_pool;
+    mem_pool_t *scratch = &system->pool;
+    mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (scratch);
+
+    system_grow_symbol_arrays (system);
+
+    uint32_t first_expression = system->num_factored_expressions;
+    uint32_t num_new_expressions = system->expressions_len - first_expression;
+    uint64_t first_new_term = num_new_expressions > 0 ?
+        system->expressions[first_expression].first_term : system->terms_len;
+    uint64_t first_new_symbol = system->num_factored_symbols;
+
+    // Each term and new symbol adds at most two nodes, its own and the one of
+    // its component's first symbol.
+    uint64_t max_nodes = 2*(system->terms_len - first_new_term + system->last_id - first_new_symbol);
+    struct incremental_nodes_t nodes = {0};
+    nodes.symbol = mem_pool_push_array_aligned (scratch, max_nodes, uint64_t);
+    nodes.parent = mem_pool_push_array_aligned (scratch, max_nodes, uint64_t);
+
+    int64_t *expression_node = mem_pool_push_array_aligned (scratch, num_new_expressions, int64_t);
+    for (uint32_t e=0; e<num_new_expressions; e++) {
+        int64_t first = -1;
+        struct term_t *terms = expression_terms (system, first_expression + e);
+        for (uint32_t t=0; t<system->expressions[first_expression + e].num_terms; t++) {
+            uint64_t symbol = symbol_representative (system, terms[t].symbol);
+            if (!symbol_is_known (system, symbol)) {
+                uint64_t node = system_incremental_node (system, &nodes, symbol);
+                if (first == -1) {
+                    first = node;
                 } else {
-                    augmented_matrix[n*h+n-1] /= augmented_matrix[n*h+k];
-                    augmented_matrix[n*h+k] = 1;
+                    union_find_union (nodes.parent, first, node);
+                }
+            }
+        }
+        expression_node[e] = first;
+    }
 
-                    for (int i=h-1; i>=0; i--) {
-                        augmented_matrix[n*i+n-1] -= augmented_matrix[n*h+n-1]*augmented_matrix[n*i+k];
-                        augmented_matrix[n*i+k] = 0;
-                    }
+    // New symbols that aren't used by any expression are unsolved, like with
+    // a full factorization they get a component of their own.
+    for (uint64_t id=first_new_symbol; id<system->last_id; id++) {
+        if (!symbol_is_known (system, id)) {
+            system_incremental_node (system, &nodes, id);
+        }
+    }
+
+    // Number groups in the order their first node was found, and list the
+    // components being replaced, which will be reused for the groups.
+    int64_t *root_group = mem_pool_push_array_aligned (scratch, nodes.num_nodes, int64_t);
+    for (uint32_t node=0; node<nodes.num_nodes; node++) {
+        root_group[node] = -1;
+    }
+
+    uint32_t num_groups = 0;
+    uint32_t num_replaced = 0;
+    uint32_t *replaced = mem_pool_push_array_aligned (scratch, nodes.num_nodes, uint32_t);
+    for (uint32_t node=0; node<nodes.num_nodes; node++) {
+        uint64_t root = union_find_root (nodes.parent, node);
+        if (root_group[root] == -1) {
+            root_group[root] = num_groups++;
+        }
+
+        uint64_t id = nodes.symbol[node];
+        uint32_t c = system->symbol_component[id];
+        if (c != SOLVER_NO_COMPONENT && system->components[c].symbol_ids[0] == id) {
+            replaced[num_replaced++] = c;
+        }
+    }
+
+    struct system_component_t *groups = mem_pool_push_array_aligned (scratch, num_groups, struct system_component_t);
+    for (uint32_t g=0; g<num_groups; g++) {
+        groups[g] = ZERO_INIT (struct system_component_t);
+    }
+
+    uint64_t num_group_symbols = 0;
+    for (uint32_t node=0; node<nodes.num_nodes; node++) {
+        struct system_component_t *group = &groups[root_group[union_find_root (nodes.parent, node)]];
+        uint64_t id = nodes.symbol[node];
+        uint32_t c = system->symbol_component[id];
+        if (c == SOLVER_NO_COMPONENT) {
+            group->num_symbols++;
+            num_group_symbols++;
+        } else if (system->components[c].symbol_ids[0] == id) {
+            group->num_symbols += system->components[c].num_symbols;
+            group->num_expressions += system->components[c].num_expressions;
+            num_group_symbols += system->components[c].num_symbols;
+        }
+    }
+
+    uint32_t num_constant = 0;
+    for (uint32_t e=0; e<num_new_expressions; e++) {
+        if (expression_node[e] == -1) {
+            num_constant++;
+        } else {
+            groups[root_group[union_find_root (nodes.parent, expression_node[e])]].num_expressions++;
+        }
+    }
+
+    if (system->num_incremental_symbols + num_group_symbols > system->num_factored_symbols) {
+        success = false;
+    }
 
-                    h--;
+    if (success) {
+        for (uint32_t g=0; g<num_groups; g++) {
+            groups[g].symbol_ids = mem_pool_push_array_aligned (pool, groups[g].num_symbols, uint64_t);
+            groups[g].expressions = mem_pool_push_array_aligned (pool, groups[g].num_expressions, uint32_t);
+            groups[g].num_symbols = 0;
+            groups[g].num_expressions = 0;
+        }
+
+        for (uint32_t node=0; node<nodes.num_nodes; node++) {
+            struct system_component_t *group = &groups[root_group[union_find_root (nodes.parent, node)]];
+            uint64_t id = nodes.symbol[node];
+            uint32_t c = system->symbol_component[id];
+            if (c == SOLVER_NO_COMPONENT) {
+                group->symbol_ids[group->num_symbols++] = id;
+
+            } else if (system->components[c].symbol_ids[0] == id) {
+                struct system_component_t *component = &system->components[c];
+                for (uint32_t j=0; j<component->num_symbols; j++) {
+                    group->symbol_ids[group->num_symbols++] = component->symbol_ids[j];
                 }
+                for (uint32_t i=0; i<component->num_expressions; i++) {
+                    group->expressions[group->num_expressions++] = component->expressions[i];
+                }
+            }
+        }
 
-                //str_cat_matrix (error, augmented_matrix, m, n);
+        // Constant expressions and component arrays grow by doubling, old
+        // arrays stay in the pool.
+        if (system->num_constant_expressions + num_constant > system->constant_expressions_size) {
+            uint32_t new_size = MAX (system->num_constant_expressions + num_constant,
+                                     2*system->constant_expressions_size);
+            uint32_t *constant_expressions = mem_pool_push_array_aligned (pool, new_size, uint32_t);
+            if (system->num_constant_expressions > 0) {
+                memcpy (constant_expressions, system->constant_expressions,
+                        system->num_constant_expressions*sizeof(uint32_t));
             }
+            system->constant_expressions = constant_expressions;
+            system->constant_expressions_size = new_size;
         }
 
-        // Copy result back into symbol definitions as a solution
-        // NOTE: Only read the results of the first num_unassigned rows.
-        for (int i=0; i<num_unassigned_symbols; i++) {
-            int count = 0;
-            int col = -1;
-            for (int j=0; j<n-1; j++) {
-                if (augmented_matrix[n*i+j] != 0) {
-                    if (col == -1) {
-                        col = j;
-                    }
-                    count++;
-                }
+        for (uint32_t e=0; e<num_new_expressions; e++) {
+            if (expression_node[e] == -1) {
+                system->constant_expressions[system->num_constant_expressions++] = first_expression + e;
+            } else {
+                struct system_component_t *group = &groups[root_group[union_find_root (nodes.parent, expression_node[e])]];
+                group->expressions[group->num_expressions++] = first_expression + e;
             }
+        }
 
-            if (count == 1 && augmented_matrix[n*i+col] == 1) {
-                struct symbol_definition_t *symbol_definition =
-                    id_to_symbol_definition_get (&system->id_to_symbol_definition, column_to_symbol_id[col]);
-                symbol_definition->value = augmented_matrix[n*i + n-1];
-                symbol_definition->state = SYMBOL_SOLVED;
+        uint32_t num_components = system->num_components - num_replaced + num_groups;
+        if (num_components > system->components_size) {
+            uint32_t new_size = MAX (num_components, 2*system->components_size);
+            struct system_component_t *components = mem_pool_push_array_aligned (pool, new_size, struct system_component_t);
+            if (system->num_components > 0) {
+                memcpy (components, system->components, system->num_components*sizeof(struct system_component_t));
+            }
+            system->components = components;
+            system->components_size = new_size;
+        }
 
+        // Groups take the place of replaced components, extra groups are
+        // appended. Replaced components left without a group are filled with
+        // the last component, so only the symbols of groups and of moved
+        // components need their component updated.
+        uint32_t g = 0;
+        for (uint32_t r=0; r<num_replaced; r++) {
+            if (g < num_groups) {
+                system->components[replaced[r]] = groups[g];
+                struct system_component_t *component = &system->components[replaced[r]];
+                for (uint32_t j=0; j<component->num_symbols; j++) {
+                    system->symbol_component[component->symbol_ids[j]] = replaced[r];
+                }
+                g++;
             } else {
-                // TODO: Store the list of unsolved symbols somewhere. As with
-                // overconstrained symbols, we really only get information about
-                // the connected component.
+                system->components[replaced[r]].num_symbols = 0;
             }
         }
+        while (g < num_groups) {
+            uint32_t c = system->num_components++;
+            system->components[c] = groups[g++];
+            for (uint32_t j=0; j<system->components[c].num_symbols; j++) {
+                system->symbol_component[system->components[c].symbol_ids[j]] = c;
+            }
+        }
+
+        for (uint32_t r=num_groups; r<num_replaced; r++) {
+            while (system->num_components > 0 && system->components[system->num_components-1].num_symbols == 0) {
+                system->num_components--;
+            }
 
-        // Check that all symbols are either assigned or solved
-        {
-            BINARY_TREE_FOR (name_to_symbol_definition, &system->name_to_symbol_definition, curr_node) {
-                struct symbol_definition_t *symbol_definition = curr_node->value;
-                if (symbol_definition->state == SYMBOL_UNASSIGNED) {
-                    str_cat_printf (error, "Unsolved symbol '%s'\n", str_data(&symbol_definition->name));
-                    success = false;
+            uint32_t c = replaced[r];
+            if (c < system->num_components && system->components[c].num_symbols == 0) {
+                system->components[c] = system->components[--system->num_components];
+                for (uint32_t j=0; j<system->components[c].num_symbols; j++) {
+                    system->symbol_component[system->components[c].symbol_ids[j]] = c;
                 }
             }
         }
 
-        if (!success) {
-            str_cat_c (error, "\n");
-            str_cat_matrix (error, augmented_matrix, m, n);
+        for (uint32_t g=0; g<num_groups; g++) {
+            for (uint32_t j=0; j<groups[g].num_symbols; j++) {
+                uint64_t id = groups[g].symbol_ids[j];
+                if (system->state[id] == SYMBOL_SOLVED) {
+                    system->state[id] = SYMBOL_UNASSIGNED;
+                }
+            }
+        }
+
+        system->num_incremental_symbols += num_group_symbols;
+        system->num_factored_expressions = system->expressions_len;
+        system->num_factored_symbols = system->last_id;
+    }
+
+    for (uint32_t node=0; node<nodes.num_nodes; node++) {
+        system->symbol_mark[nodes.symbol[node]] = SOLVER_NO_MARK;
+    }
+    mem_pool_end_temporary_memory (mrkr);
+
+    return success;
+}
+
+// Partitions the system into components. Factorization of each component is
+// done later, when it's solved.
+void system_factor (struct linear_system_t *system)
+{
+    system_factorization_destroy (system);
+
+    mem_pool_t *pool = &system->factorization_pool;
+    mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (&system->pool);
+
+    // Arrays indexed by symbol id are allocated in pools instead of the
+    // stack, systems with millions of symbols would overflow it.
+    double presolve_start = wall_time_ms ();
+    system_merge_aliases (system, pool, &system->pool);
+    system_presolve (system, pool, &system->pool);
+    system->stats.presolve_ms += wall_time_ms () - presolve_start;
+
+    uint64_t *column_to_symbol_id = mem_pool_push_array_aligned (&system->pool, system->last_id, uint64_t);
+    uint32_t num_unassigned_symbols = 0;
+    for (uint64_t id=0; id<system->last_id; id++) {
+        if (!system->is_removed[id] && system->alias[id] == id && !symbol_is_known (system, id)) {
+            column_to_symbol_id[num_unassigned_symbols] = id;
+            num_unassigned_symbols++;
+        }
+    }
+
+    system_compute_components (system, pool, &system->pool,
+                               column_to_symbol_id, num_unassigned_symbols,
+                               system->expressions_len,
+                               &system->components, &system->num_components,
+                               &system->constant_expressions, &system->num_constant_expressions);
+
+    system->components_size = system->num_components;
+    system->constant_expressions_size = system->num_constant_expressions;
+    system_grow_symbol_arrays (system);
+    for (uint32_t c=0; c<system->num_components; c++) {
+        for (uint32_t j=0; j<system->components[c].num_symbols; j++) {
+            system->symbol_component[system->components[c].symbol_ids[j]] = c;
+        }
+    }
+    system->num_factored_expressions = system->expressions_len;
+    system->num_factored_symbols = system->last_id;
+
+    system->use_threads = system->num_threads != 1 && system->num_components >= SOLVER_PARALLEL_MIN_COMPONENTS;
+    if (system->use_threads && system->thread_pool.workers == NULL) {
+        thread_pool_init (&system->thread_pool, system->num_threads);
+    }
+
+    system->num_factor_pools = system->use_threads ? system->thread_pool.num_workers : 1;
+    system->factor_pools = calloc (system->num_factor_pools, sizeof(mem_pool_t));
+
+    mem_pool_end_temporary_memory (mrkr);
+
+    system->is_factored = true;
+}
+
+void system_compute_edit_dependencies (struct linear_system_t *system);
+
+// Common implementation of solver_solve() and solver_solve_unsafe(). If error
+// is NULL no checks or error messages are generated.
+bool system_solve (struct linear_system_t *system, string_t *error)
+{
+    bool success = true;
+
+    struct solver_stats_t *stats = &system->stats;
+    *stats = ZERO_INIT (struct solver_stats_t);
+    stats->num_tree_lookups = system->num_tree_lookups;
+    system->num_tree_lookups = 0;
+    double start = wall_time_ms ();
+
+    if (system->num_simplex_expressions > 0) {
+        success = system_solve_simplex (system, error);
+        stats->simplex_ms = wall_time_ms () - start;
+        stats->num_symbols = system_num_symbols (system);
+        stats->num_equations = system_num_equations (system);
+        stats->total_ms = wall_time_ms () - start;
+
+        // Components and the factorization are built from scratch once all
+        // expressions are equalities again.
+        system->is_factored = false;
+        system->is_solved = false;
+        system->success = success;
+        return success;
+
+    } else if (system->simplex != NULL) {
+        system_simplex_destroy (system);
+    }
+
+    if (system->is_factored &&
+        (system->expressions_len > system->num_factored_expressions || system->last_id > system->num_factored_symbols)) {
+        double partition_start = wall_time_ms ();
+        if (system_factor_incremental (system)) {
+            stats->partition_ms = wall_time_ms () - partition_start;
+        } else {
+            system->is_factored = false;
+        }
+    }
+
+    if (!system->is_factored) {
+        // Symbols solved in a previous call are unknowns again.
+        for (uint64_t id=0; id<system->last_id; id++) {
+            if (system->state[id] == SYMBOL_SOLVED) {
+                system->state[id] = SYMBOL_UNASSIGNED;
+            }
+            system->is_presolved[id] = false;
+            system->alias[id] = id;
+        }
+
+        system_factor (system);
+        stats->partition_ms = wall_time_ms () - start - stats->presolve_ms;
+    }
+
+    double presolve_start = wall_time_ms ();
+    system_presolve_solve (system, stats);
+    stats->presolve_ms += wall_time_ms () - presolve_start;
+
+    if (error != NULL) {
+        mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (&system->pool);
+
+        // Position of each symbol in the presolve order, only computed if
+        // there is an error to report.
+        uint64_t *presolve_position = NULL;
+
+        for (uint32_t i=0; i<system->num_constant_expressions; i++) {
+            uint32_t expression = system->constant_expressions[i];
+            if (fabs(expression_residual (system, expression)) > SOLVER_EPSILON) {
+                // Like elimination does, blame the last presolved symbol the
+                // expression depends on.
+                int64_t blame = -1;
+                struct term_t *terms = expression_terms (system, expression);
+                for (uint32_t t=0; t<system->expressions[expression].num_terms; t++) {
+                    uint64_t symbol = symbol_representative (system, terms[t].symbol);
+                    if (!system->is_presolved[symbol]) continue;
+
+                    if (presolve_position == NULL) {
+                        presolve_position = mem_pool_push_array_aligned (&system->pool, system->last_id, uint64_t);
+                        for (uint64_t k=0; k<system->num_presolved; k++) {
+                            presolve_position[system->presolve_symbols[k]] = k;
+                        }
+                    }
+
+                    if (blame == -1 || presolve_position[symbol] > presolve_position[blame]) {
+                        blame = symbol;
+                    }
+                }
+
+                if (blame != -1) {
+                    str_cat_printf (error, "Overconstrained symbol '%s' in equation '", symbol_name (system, blame));
+                } else {
+                    str_cat_c (error, "Unsatisfiable equation '");
+                }
+                str_cat_expression (error, system, expression);
+                str_cat_c (error, "'\n\n");
+                success = false;
+            }
         }
 
         mem_pool_end_temporary_memory (mrkr);
     }
 
+    if (system->use_threads) {
+        success &= system_solve_components_parallel (system, error);
+
+    } else {
+        for (uint32_t c=0; c<system->num_components; c++) {
+            struct system_component_t *component = &system->components[c];
+            if (system->is_solved && component->is_factored) continue;
+
+            if (!component->is_factored) {
+                system_factor_component (system, &system->factor_pools[0], &system->pool,
+                                         component, system->symbol_id_to_column,
+                                         system->num_threads != 1 ? &system->thread_pool : NULL, stats);
+            }
+
+            success &= system_solve_component (system, &system->pool, component, c, stats, error);
+        }
+    }
+
+    system_expand_aliases (system, stats);
+
+    stats->num_symbols = system_num_symbols (system);
+    stats->num_equations = system_num_equations (system);
+    stats->num_components = system->num_components;
+    for (uint32_t c=0; c<system->num_components; c++) {
+        struct sparse_lu_t *lu = &system->components[c].lu;
+        if (system->components[c].graph != NULL) {
+            stats->num_difference_components++;
+            stats->num_nonzeros += system->components[c].graph->nnz;
+        }
+        if (system->components[c].cg != NULL) {
+            struct sparse_matrix_t *A = &system->components[c].cg->A;
+            stats->num_iterative_components++;
+            stats->num_nonzeros += A->row_start[A->m];
+        }
+        if (system->components[c].dense != NULL) {
+            struct dense_lu_t *dense = system->components[c].dense;
+            stats->num_dense_components++;
+            stats->num_nonzeros += dense->num_nonzeros;
+            stats->num_pivots += dense->num_pivots;
+            stats->num_row_swaps += dense->num_row_swaps;
+        }
+        if (system->components[c].band != NULL) {
+            struct band_lu_t *band = system->components[c].band;
+            stats->num_banded_components++;
+            stats->num_nonzeros += band->num_nonzeros;
+            stats->num_pivots += band->n;
+            stats->num_row_swaps += band->num_row_swaps;
+        }
+        stats->num_nonzeros += lu->num_nonzeros;
+        stats->num_pivots += lu->num_pivots;
+        stats->num_row_swaps += lu->num_row_swaps;
+    }
+
     system->success = success;
+    system->is_solved = success && error != NULL;
+
+    if (success && system->edit_symbols_len > 0 && system->edit_dependencies_are_stale) {
+        system_compute_edit_dependencies (system);
+    }
+    stats->num_edit_dependencies = system->edit_dependencies_len;
+    stats->total_ms = wall_time_ms () - start;
 
     return success;
 }
 
+//////////////////////////
+// EDIT SYMBOLS
+//
+// Interactive changes, like dragging a rectangle, change the value of a few
+// assigned symbols many times per second. Marking them as edit symbols lets
+// solver_symbol_suggest() update only the symbols that depend on them instead
+// of solving the whole system again.
+//
+// Without a tableau, values of solved symbols are a linear function of the
+// values of assigned symbols. After a successful solve, the system is solved
+// once more for each edit symbol with its value increased by 1, the
+// difference with the previous values is how much each solved symbol depends
+// on it. Most symbols don't depend on a given edit symbol, they get exactly the
+// same value and are left out. A suggestion then costs one multiply add for
+// each dependent symbol.
+//
+// With a tableau, edit symbols are externals with a row that makes them equal
+// to their value, see system_simplex_suggest().
+
+void system_compute_edit_dependencies (struct linear_system_t *system)
+{
+    struct solver_stats_t stats = system->stats;
+    bool is_solved = system->is_solved;
+
+    // Keep the solves below from computing dependencies again.
+    system->edit_dependencies_are_stale = false;
+    system->edit_dependencies_len = 0;
+
+    double *values = malloc (system->last_id*sizeof(double));
+    memcpy (values, system->value, system->last_id*sizeof(double));
+
+    for (uint64_t i=0; i<system->edit_symbols_len; i++) {
+        struct edit_symbol_t *edit = &system->edit_symbols[i];
+        system->value[edit->symbol] = values[edit->symbol] + 1;
+        system->is_solved = false;
+        system_solve (system, NULL);
+
+        edit->first_dependency = system->edit_dependencies_len;
+        for (uint64_t id=0; id<system->last_id; id++) {
+            if (system->state[id] != SYMBOL_SOLVED) continue;
+
+            struct edit_dependency_t dependency;
+            dependency.symbol = id;
+            dependency.coefficient = system->value[id] - values[id];
+            if (fabs (dependency.coefficient) > SOLVER_EPSILON) {
+                DYNAMIC_ARRAY_APPEND (system->edit_dependencies, dependency);
+            }
+        }
+        edit->num_dependencies = system->edit_dependencies_len - edit->first_dependency;
+
+        system->value[edit->symbol] = values[edit->symbol];
+    }
+
+    memcpy (system->value, values, system->last_id*sizeof(double));
+    free (values);
+
+    system->stats = stats;
+    system->is_solved = is_solved;
+    system->success = true;
+}
+
+// Makes symbol an edit symbol, assigning it value. Its value can then be
+// changed with solver_symbol_suggest(). Suggestions are only fast once the
+// system has been solved after marking the edit symbols.
+void solver_symbol_edit (struct linear_system_t *system, symbol_handle_t symbol, double value)
+{
+    solver_symbol_assign_handle (system, symbol, value);
+    if (system->is_edit[symbol]) return;
+
+    system->is_edit[symbol] = true;
+    struct edit_symbol_t edit = {0};
+    edit.symbol = symbol;
+    DYNAMIC_ARRAY_APPEND (system->edit_symbols, edit);
+
+    // Edit symbols aren't folded into the tableau like other assigned ones.
+    system->edit_dependencies_are_stale = true;
+    system->simplex_is_stale = true;
+}
+
+// Makes an edit symbol a regular assigned symbol, it keeps its value.
+void solver_symbol_edit_end (struct linear_system_t *system, symbol_handle_t symbol)
+{
+    if (!system->is_edit[symbol]) return;
+
+    system->is_edit[symbol] = false;
+    for (uint64_t i=0; i<system->edit_symbols_len; i++) {
+        if (system->edit_symbols[i].symbol == symbol) {
+            system->edit_symbols[i] = system->edit_symbols[--system->edit_symbols_len];
+            break;
+        }
+    }
+
+    system->edit_dependencies_are_stale = true;
+    system->simplex_is_stale = true;
+}
+
+// Changes the value of an edit symbol and of all symbols that depend on it,
+// without solving the system. If the system changed since the last solve,
+// this is the same as solver_symbol_assign_handle() and values are updated by
+// the next solve. Returns false if the value conflicts with required
+// constraints, the next solve reports it.
+bool solver_symbol_suggest (struct linear_system_t *system, symbol_handle_t symbol, double value)
+{
+    assert (system->is_edit[symbol] && "Missing call to solver_symbol_edit().");
+
+    if (system->num_simplex_expressions > 0) {
+        if (system->simplex != NULL && !system->simplex_is_stale &&
+            symbol < system->simplex->external_size && system->simplex->edit_marker[symbol] != 0 &&
+            system->simplex_removed_expressions_len == 0 && system->simplex_removed_symbols_len == 0) {
+            return system_simplex_suggest (system, symbol, value);
+        }
+
+    } else if (!system->edit_dependencies_are_stale) {
+        struct edit_symbol_t *edit = NULL;
+        for (uint64_t i=0; i<system->edit_symbols_len; i++) {
+            if (system->edit_symbols[i].symbol == symbol) {
+                edit = &system->edit_symbols[i];
+                break;
+            }
+        }
+
+        double delta = value - system->value[symbol];
+        system->value[symbol] = value;
+
+        struct edit_dependency_t *dependencies = &system->edit_dependencies[edit->first_dependency];
+        for (uint64_t i=0; i<edit->num_dependencies; i++) {
+            system->value[dependencies[i].symbol] += delta*dependencies[i].coefficient;
+        }
+        return true;
+    }
+
+    solver_symbol_assign_handle (system, symbol, value);
+    return true;
+}
+
+// Solve components that aren't difference graphs with conjugate gradient
+// instead of sparse LU, see ITERATIVE SOLVER. Each solve iterates from the
+// current values of the symbols until the relative residual is at most
+// tolerance, or max_iterations are done. Passing 0 uses the default tolerance
+// and twice the number of symbols of each component as limit.
+//
+// Iteration limits can be changed between solves, switching solvers discards
+// the cached factorization.
+void solver_set_iterative (struct linear_system_t *system, bool enable, double tolerance, uint32_t max_iterations)
+{
+    if (system->use_iterative_solver != enable) {
+        system->use_iterative_solver = enable;
+        system->is_factored = false;
+    }
+    system->edit_dependencies_are_stale = true;
+    system->is_solved = false;
+    system->iterative_tolerance = tolerance;
+    system->iterative_max_iterations = max_iterations;
+}
+
+// This implementation of the solver works only if the system is solvable.
+// Unsolvable systems produce useless results. In theory, this function can
+// never fail if used correctly, we don't care about error messages or even
+// notifying something bad happened. If there is the slightest chance of
+// something going wrong DON'T USE THIS, use solver_solve().
+void solver_solve_unsafe (struct linear_system_t *system, string_t *error)
+{
+    system_solve (system, NULL);
+    system->success = true;
+}
+
+// This is a safe implementation of the solver that can generate partial
+// solutions if only part of the system is unsolvable. It will notify when an
+// error happens (by returning false) and try to provide useful error messages.
+bool solver_solve (struct linear_system_t *system, string_t *error)
+{
+    return system_solve (system, error);
+}
+
+// Statistics of the last call to solver_solve() or solver_solve_unsafe().
+struct solver_stats_t solver_get_stats (struct linear_system_t *system)
+{
+    return system->stats;
+}
+
+void str_cat_solver_stats (string_t *str, struct solver_stats_t *stats)
+{
+    str_cat_printf (str, "Aliases: %"PRIu64"\n", stats->num_aliases);
+    str_cat_printf (str, "Presolved symbols: %"PRIu64"\n", stats->num_presolved);
+    str_cat_printf (str, "Components: %u (%u factored, %u difference graphs, %u dense, %u banded)\n",
+                    stats->num_components, stats->num_factored_components,
+                    stats->num_difference_components, stats->num_dense_components,
+                    stats->num_banded_components);
+    str_cat_printf (str, "Nonzeros: %"PRIu64"\n", stats->num_nonzeros);
+    str_cat_printf (str, "Pivots: %"PRIu64"\n", stats->num_pivots);
+    str_cat_printf (str, "Row swaps: %"PRIu64"\n", stats->num_row_swaps);
+    str_cat_printf (str, "Flops: %"PRIu64"\n", stats->num_flops);
+    str_cat_printf (str, "Peak temporary memory: %"PRIu64" bytes\n", stats->peak_temporary_size);
+    str_cat_printf (str, "Tree lookups: %"PRIu64"\n", stats->num_tree_lookups);
+    if (stats->num_iterative_components > 0) {
+        str_cat_printf (str, "Iterations: %"PRIu64" (%u iterative components, %u not converged, max relative residual %g)\n",
+                        stats->num_iterations, stats->num_iterative_components,
+                        stats->num_unconverged_components, stats->max_relative_residual);
+    }
+    if (stats->num_edit_dependencies > 0) {
+        str_cat_printf (str, "Edit dependencies: %"PRIu64"\n", stats->num_edit_dependencies);
+    }
+    if (stats->num_simplex_constraints > 0) {
+        str_cat_printf (str, "Simplex: %u constraints, %u rows, %"PRIu64" pivots\n",
+                        stats->num_simplex_constraints, stats->num_simplex_rows, stats->num_simplex_pivots);
+    }
+    str_cat_printf (str, "Time: %.3f ms (presolve %.3f, partition %.3f, matrix build %.3f, factorization %.3f, substitution %.3f, copy back %.3f, simplex %.3f)\n",
+                    stats->total_ms, stats->presolve_ms, stats->partition_ms, stats->matrix_build_ms,
+                    stats->factorization_ms, stats->substitution_ms, stats->copy_back_ms, stats->simplex_ms);
+}
+
+// Symbols are printed in the order they were created.
 void solver_print_solution (struct linear_system_t *system)
 {
     int num_unassigned_symbols = 0;
     {
         printf ("Assigned:\n");
-        BINARY_TREE_FOR (name_to_symbol_definition, &system->name_to_symbol_definition, curr_node) {
-            struct symbol_definition_t *symbol_definition = curr_node->value;
-            if (symbol_definition->state == SYMBOL_ASSIGNED) {
-                printf ("%s = %.2f\n", str_data(&symbol_definition->name), symbol_definition->value);
+        for (uint64_t id=0; id<system->last_id; id++) {
+            if (system->is_removed[id]) continue;
+
+            if (system->state[id] == SYMBOL_ASSIGNED) {
+                printf ("%s = %.2f\n", symbol_name (system, id), system->value[id]);
             } else {
                 num_unassigned_symbols++;
             }
@@ -750,10 +5772,9 @@ void solver_print_solution (struct linear_system_t *system)
 
     {
         printf ("Solved:\n");
-        BINARY_TREE_FOR (name_to_symbol_definition, &system->name_to_symbol_definition, curr_node) {
-            struct symbol_definition_t *symbol_definition = curr_node->value;
-            if (symbol_definition->state == SYMBOL_SOLVED) {
-                printf ("%s = %.2f\n", str_data(&symbol_definition->name), symbol_definition->value);
+        for (uint64_t id=0; id<system->last_id; id++) {
+            if (!system->is_removed[id] && system->state[id] == SYMBOL_SOLVED) {
+                printf ("%s = %.2f\n", symbol_name (system, id), system->value[id]);
             }
         }
     }
@@ -762,5 +5783,10 @@ void solver_print_solution (struct linear_system_t *system)
     printf ("Total symbols: %d\n", system_num_symbols (system));
     printf ("Symbols to solve: %d\n", num_unassigned_symbols);
     printf ("Equations: %d\n", system_num_equations (system));
+
+    string_t str = {0};
+    str_cat_solver_stats (&str, &system->stats);
+    printf ("%s", str_data(&str));
+    str_free (&str);
 }
 
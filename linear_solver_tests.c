@@ -16,19 +16,12 @@
 // linear_dependency().
 void simple_computation_print (struct linear_system_t *system)
 {
-    int num_expressions = 0;
-    struct expression_t *curr_expr = system->expressions;
-    while (curr_expr != NULL) {
-        num_expressions++;
-        curr_expr = curr_expr->next;
-    }
+    int num_expressions = system_num_equations (system);
 
-    int num_symbols = system->id_to_symbol_definition.num_nodes;
+    int num_symbols = system_num_symbols (system);
     int num_assigned_symbols = 0;
-    BINARY_TREE_FOR (id_to_symbol_definition, &system->id_to_symbol_definition, symbol_node) {
-        struct symbol_definition_t *curr_symbol = symbol_node->value;
-
-        if (curr_symbol->state == SYMBOL_ASSIGNED) {
+    for (uint64_t id=0; id<system->last_id; id++) {
+        if (system->state[id] == SYMBOL_ASSIGNED) {
             num_assigned_symbols++;
         }
     }
@@ -43,6 +36,85 @@ void simple_computation_print (struct linear_system_t *system)
     printf ("\n\n");
 }
 
+// Scenarios that know their expected results check them, main() fails if any
+// of them didn't match.
+int num_failed_checks = 0;
+
+void check (bool condition, char *description)
+{
+    if (!condition) {
+        printf ("FAILED: %s\n", description);
+        num_failed_checks++;
+    }
+}
+
+void check_value (struct linear_system_t *system, char *name, double expected)
+{
+    double value = system_get_symbol_value (system, name);
+    if (fabs (value - expected) > 1e-6*(1 + fabs(expected))) {
+        printf ("FAILED: %s = %g, expected %g\n", name, value, expected);
+        num_failed_checks++;
+    }
+}
+
+// Checks that all symbols of reference have the same value in system.
+void check_same_solution (struct linear_system_t *system, struct linear_system_t *reference, char *description)
+{
+    bool same = system->success == reference->success;
+    for (uint64_t id=0; id<reference->last_id; id++) {
+        if (reference->is_removed[id]) continue;
+
+        double expected = solver_symbol_value (reference, id);
+        double value = system_get_symbol_value (system, solver_symbol_name (reference, id));
+        if (fabs (value - expected) > 1e-6*(1 + fabs(expected))) {
+            printf ("%s = %g, expected %g\n", solver_symbol_name (reference, id), value, expected);
+            same = false;
+        }
+    }
+    check (same, description);
+}
+
+// Factors each component of a solved system again with sparse LU, and checks
+// that the values computed by the method that solved it are the same.
+void check_against_sparse_lu (struct linear_system_t *system, char *description)
+{
+    mem_pool_t pool = {0};
+    uint64_t *symbol_id_to_column = mem_pool_push_array_aligned (&pool, system->last_id, uint64_t);
+
+    bool same = true;
+    for (uint32_t c=0; c<system->num_components; c++) {
+        mem_pool_marker_t mrkr = mem_pool_begin_temporary_memory (&pool);
+        struct system_component_t *component = &system->components[c];
+        for (uint32_t j=0; j<component->num_symbols; j++) {
+            symbol_id_to_column[component->symbol_ids[j]] = j;
+        }
+
+        struct sparse_matrix_t A;
+        system_build_sparse_matrix (system, &pool, component->expressions, component->num_expressions,
+                                    symbol_id_to_column, component->num_symbols, &A);
+        struct sparse_lu_t lu;
+        sparse_lu_factor (&pool, &A, &lu);
+
+        double *b = mem_pool_push_array_aligned (&pool, component->num_expressions, double);
+        double *x = mem_pool_push_array_aligned (&pool, component->num_symbols, double);
+        bool *known = mem_pool_push_array (&pool, component->num_symbols, bool);
+        component_build_rhs (system, component, b);
+        sparse_lu_solve (&lu, b, x, known);
+
+        for (uint32_t j=0; j<component->num_symbols; j++) {
+            uint64_t id = component->symbol_ids[j];
+            if (known[j] && fabs (system->value[id] - x[j]) > 1e-6*(1 + fabs(x[j]))) {
+                printf ("%s = %g, sparse LU computed %g\n", solver_symbol_name (system, id), system->value[id], x[j]);
+                same = false;
+            }
+        }
+        mem_pool_end_temporary_memory (mrkr);
+    }
+    check (same, description);
+
+    mem_pool_destroy (&pool);
+}
+
 void solver_solve_and_print (struct linear_system_t *system)
 {
     printf ("Simple solvability test:\n");
@@ -100,6 +172,7 @@ void linear_dependency ()
     solver_symbol_assign (system, "w1", 10);
 
     solver_solve_and_print (system);
+    solver_destroy (system);
 }
 
 void underconstrained_minimal ()
@@ -178,7 +251,603 @@ void overconstrained ()
     solver_solve_and_print (system);
 }
 
+// Coefficients and constants can be written directly in expressions, without
+// adding auxiliary symbols for them.
+void coefficients_and_constants ()
+{
+    struct linear_system_t _system = {};
+    struct linear_system_t *system = &_system;
+
+    solver_expr_equals_zero (system, "x1 + 2*w1 - x2");
+    solver_expr_equals_zero (system, "0.5*x2 - x3 + 12.5");
+    solver_expr_equals_zero (system, "x3 - 2*x4 + x4 - 1e2");
+    solver_expr_equals_zero (system, "a - b");
+    solver_expr_equals_zero (system, "a + b - x2");
+    solver_expr_equals_zero (system, "c + b");
+    solver_symbol_assign (system, "x1", 100);
+    solver_symbol_assign (system, "w1", 10);
+
+    solver_solve_and_print (system);
+    check (system->success, "coefficients_and_constants is solvable");
+    check_value (system, "x2", 120);
+    check_value (system, "x3", 72.5);
+    check_value (system, "x4", -27.5);
+
+    // 'a - b' merges b into a, which leaves a as the only unknown of
+    // 'a + b - x2'. Opposite signs like in 'c + b' aren't aliases, c is
+    // presolved from a, which stands for b, and b gets its value after.
+    check_value (system, "a", 60);
+    check_value (system, "b", 60);
+    check_value (system, "c", -60);
+
+    // x4 appears in two terms of its expression, it's still its only unknown.
+    struct solver_stats_t stats = solver_get_stats (system);
+    check (stats.num_aliases == 1, "b is an alias of a");
+    check (stats.num_presolved == 5 && stats.num_components == 0, "x2, x3, x4, a and c are presolved");
+
+    solver_destroy (system);
+}
+
+// Removing the conflicting expression from overconstrained() makes the system
+// solvable. The symbol it used can then be removed too, and a new expression
+// may reuse the handle of the removed one.
+void removed_expressions ()
+{
+    struct linear_system_t _system = {};
+    struct linear_system_t *system = &_system;
+
+    solver_expr_equals_zero (system, "x1 + w1 - x2");
+    solver_expr_equals_zero (system, "x2 + w2 - x3");
+    expression_handle_t conflict = solver_expr_equals_zero (system, "x2 + w3 - x3");
+    solver_expr_equals_zero (system, "x3 + w4 - x4");
+    solver_symbol_assign (system, "x1", 100);
+    solver_symbol_assign (system, "w1", 10);
+    solver_symbol_assign (system, "w2", 20);
+    solver_symbol_assign (system, "w3", 30);
+    solver_symbol_assign (system, "w4", 40);
+
+    solver_solve_and_print (system);
+    check (!system->success, "removed_expressions is overconstrained before removing");
+
+    solver_expr_remove (system, conflict);
+    symbol_handle_t w3 = solver_symbol_get_or_create (system, "w3");
+    check (solver_symbol_remove (system, w3), "unused symbol w3 can be removed");
+    solver_solve_and_print (system);
+    check (system->success, "removed_expressions is solvable after removing");
+    check_value (system, "x3", 130);
+    check_value (system, "x4", 170);
+
+    expression_handle_t new_expression = solver_expr_equals_zero (system, "x4 + w5 - x5");
+    check (new_expression == conflict, "expression handle is reused");
+    check (solver_symbol_get_or_create (system, "w5") == w3, "symbol handle is reused");
+    solver_symbol_assign (system, "w5", 50);
+    solver_solve_and_print (system);
+    check (system->success, "removed_expressions is solvable after adding");
+    check_value (system, "x5", 220);
+    check (system_num_symbols (system) == 9, "removed_expressions has 9 symbols");
+
+    solver_destroy (system);
+}
+
+// Removing most of a large system compacts it, which rebuilds the names, the
+// name tree and the free lists. Surviving symbols must still be found by name
+// with the same handle, and the system must still solve.
+void compacted_system ()
+{
+    struct linear_system_t _system = {};
+    struct linear_system_t *system = &_system;
+
+    int num_pairs = 3000, num_kept = 10;
+    expression_handle_t *expressions = malloc (num_pairs*sizeof(expression_handle_t));
+    symbol_handle_t *p = malloc (num_pairs*sizeof(symbol_handle_t));
+    string_t str = {0};
+    for (int i=0; i<num_pairs; i++) {
+        str_set_printf (&str, "p%d - q%d - 1", i, i);
+        expressions[i] = solver_expr_equals_zero (system, str_data(&str));
+        str_set_printf (&str, "p%d", i);
+        p[i] = solver_symbol_get_or_create (system, str_data(&str));
+        str_set_printf (&str, "q%d", i);
+        solver_symbol_assign (system, str_data(&str), i);
+    }
+    solver_solve (system, NULL);
+    check (system->success, "compacted_system is solvable");
+
+    // Removing from the end lets compaction drop the ids of removed symbols.
+    for (int i=num_pairs-1; i>=num_kept; i--) {
+        solver_expr_remove (system, expressions[i]);
+        str_set_printf (&str, "q%d", i);
+        solver_symbol_remove (system, solver_symbol_get_or_create (system, str_data(&str)));
+        solver_symbol_remove (system, p[i]);
+    }
+    check (system->last_id < 2*num_pairs, "removed symbols are compacted");
+    check (system_num_symbols (system) == 2*num_kept, "compacted_system keeps 20 symbols");
+
+    bool same_handles = true;
+    for (int i=0; i<num_kept; i++) {
+        str_set_printf (&str, "p%d", i);
+        same_handles &= solver_symbol_get_or_create (system, str_data(&str)) == p[i];
+    }
+    check (same_handles, "kept symbols are found by name after compacting");
+
+    solver_symbol_assign (system, "q3", 100);
+    solver_expr_equals_zero (system, "r - p3 - 5");
+    solver_solve (system, NULL);
+    check (system->success, "compacted_system is solvable after compacting");
+    check_value (system, "p0", 1);
+    check_value (system, "p3", 101);
+    check_value (system, "p9", 10);
+    check_value (system, "r", 106);
+
+    str_free (&str);
+    free (p);
+    free (expressions);
+    solver_destroy (system);
+}
+
+// Inequalities and constraints that aren't required are solved with the
+// simplex, which satisfies the strongest constraints first. Here a box of
+// width w between x1 and x2 must fit in [0, 200], so its preferred width of 300
+// is only approximated. A required minimum width of 250 can't be satisfied and
+// is reported.
+void inequalities ()
+{
+    struct linear_system_t _system = {};
+    struct linear_system_t *system = &_system;
+
+    solver_constraint (system, "x1 >= 0", SOLVER_REQUIRED);
+    solver_constraint (system, "x2 <= 200", SOLVER_REQUIRED);
+    solver_constraint (system, "x1 + w - x2 = 0", SOLVER_REQUIRED);
+    solver_constraint (system, "w = 300", SOLVER_STRONG);
+    solver_constraint (system, "x1 = 50", SOLVER_WEAK);
+
+    solver_solve_and_print (system);
+    check (system->success, "inequalities are satisfiable");
+    check_value (system, "x1", 0);
+    check_value (system, "x2", 200);
+    check_value (system, "w", 200);
+
+    expression_handle_t minimum = solver_constraint (system, "w >= 250", SOLVER_REQUIRED);
+    solver_solve_and_print (system);
+
+    string_t error = {0};
+    check (!solver_solve (system, &error), "required minimum width is unsatisfiable");
+    check (strstr (str_data(&error), "Unsatisfiable constraint 'w - 250 >= 0'") != NULL,
+           "unsatisfiable minimum width is reported");
+    str_free (&error);
+
+    solver_expr_remove (system, minimum);
+    solver_solve (system, NULL);
+    check (system->success, "inequalities are satisfiable after removing the minimum");
+    check_value (system, "w", 200);
+
+    solver_destroy (system);
+}
+
+// Dragging x1 with the mouse suggests many values for it. Symbols that depend
+// on it are updated without solving the system again.
+void edit_symbols ()
+{
+    struct linear_system_t _system = {};
+    struct linear_system_t *system = &_system;
+
+    solver_expr_equals_zero (system, "x1 + w1 - x2");
+    solver_expr_equals_zero (system, "x2 + w2 - x3");
+    solver_expr_equals_zero (system, "y1 + w1 - y2");
+    solver_symbol_assign (system, "w1", 10);
+    solver_symbol_assign (system, "w2", 20);
+    solver_symbol_assign (system, "y1", 5);
+
+    symbol_handle_t x1 = solver_symbol_get_or_create (system, "x1");
+    solver_symbol_edit (system, x1, 100);
+    solver_solve_and_print (system);
+
+    check_value (system, "x3", 130);
+
+    bool success = true;
+    for (int i=1; i<=10; i++) {
+        success = solver_symbol_suggest (system, x1, 100 + i) && success;
+    }
+    solver_print_solution (system);
+    check (success, "suggested values are accepted");
+    check_value (system, "x1", 110);
+    check_value (system, "x2", 120);
+    check_value (system, "x3", 140);
+    check_value (system, "y2", 15);
+
+    // After the system changes, suggested values are applied by the next solve.
+    solver_symbol_assign (system, "w2", 30);
+    solver_symbol_suggest (system, x1, 0);
+    solver_solve (system, NULL);
+    check_value (system, "x3", 40);
+
+    solver_destroy (system);
+}
+
+// Expressions added to a solved system only factor again the components they
+// touch. Here one joins two components, another one brings a new symbol, and
+// the last one has no unknowns. The result must be the same as solving the
+// whole system from scratch.
+void incremental_expressions ()
+{
+    char *expressions[] = {
+        "a1 + a2 - 10",
+        "a1 - a2 - 2",
+        "b1 + b2 - 20",
+        "b1 - b2 - 4",
+        "a1 + b1 - 18",
+        "c1 - a2 - b2 - 1",
+        "w1 - 5"
+    };
+    int num_initial = 4;
+
+    struct linear_system_t _system = {};
+    struct linear_system_t *system = &_system;
+    solver_symbol_get_or_create (system, "w1");
+    solver_symbol_assign (system, "w1", 5);
+    for (int i=0; i<num_initial; i++) {
+        solver_expr_equals_zero (system, expressions[i]);
+    }
+    solver_solve (system, NULL);
+    check (system->success, "initial components are solvable");
+
+    for (int i=num_initial; i<ARRAY_SIZE(expressions); i++) {
+        solver_expr_equals_zero (system, expressions[i]);
+    }
+    solver_solve_and_print (system);
+    check (system->num_incremental_symbols > 0, "new expressions are factored incrementally");
+
+    struct linear_system_t _reference = {};
+    struct linear_system_t *reference = &_reference;
+    solver_symbol_get_or_create (reference, "w1");
+    solver_symbol_assign (reference, "w1", 5);
+    for (int i=0; i<ARRAY_SIZE(expressions); i++) {
+        solver_expr_equals_zero (reference, expressions[i]);
+    }
+    solver_solve (reference, NULL);
+    check (reference->success, "incremental_expressions is solvable");
+    check_value (reference, "c1", 13);
+    check_same_solution (system, reference, "incremental factorization matches a full one");
+
+    solver_destroy (reference);
+    solver_destroy (system);
+}
+
+// Components where every equation relates two unknowns by an offset are solved
+// by walking their graph. Presolve leaves them floating in a full
+// factorization, an inconsistent cycle is still detected.
+void difference_graph_cycle ()
+{
+    struct linear_system_t _system = {};
+    struct linear_system_t *system = &_system;
+    solver_expr_equals_zero (system, "p - q - 1");
+    solver_expr_equals_zero (system, "q - r - 1");
+    solver_expr_equals_zero (system, "r - p - 1");
+
+    string_t err = {};
+    solver_solve (system, &err);
+    check (!system->success, "an inconsistent difference cycle isn't solvable");
+    check (strstr (str_data(&err), "Overconstrained symbol") != NULL, "the cycle is blamed on a symbol");
+
+    struct solver_stats_t stats = solver_get_stats (system);
+    check (stats.num_difference_components == 1, "the cycle is walked as a difference graph");
+
+    str_free (&err);
+    solver_destroy (system);
+}
+
+// Incremental factorization doesn't extend presolve, so new difference
+// equations that reference solved symbols anchor a difference graph.
+void difference_graph_anchored ()
+{
+    char *expressions[] = {
+        "x1 - x0 - 10",
+        "x2 - x1 - 10",
+        "x3 - x2 - 10",
+        "x3 - x1 - 20"
+    };
+    int num_initial = 1;
+
+    struct linear_system_t _system = {};
+    struct linear_system_t *system = &_system;
+    solver_symbol_get_or_create (system, "x0");
+    solver_symbol_assign (system, "x0", 10);
+    for (int i=0; i<num_initial; i++) {
+        solver_expr_equals_zero (system, expressions[i]);
+    }
+    solver_solve (system, NULL);
+    check (system->success, "initial chain is solvable");
+
+    for (int i=num_initial; i<ARRAY_SIZE(expressions); i++) {
+        solver_expr_equals_zero (system, expressions[i]);
+    }
+    solver_solve (system, NULL);
+    check (system->success, "anchored difference graph is solvable");
+    struct solver_stats_t stats = solver_get_stats (system);
+    check (system->num_incremental_symbols > 0 && stats.num_difference_components == 1,
+           "new expressions are walked as an anchored difference graph");
+    check_value (system, "x3", 40);
+
+    struct linear_system_t _reference = {};
+    struct linear_system_t *reference = &_reference;
+    solver_symbol_get_or_create (reference, "x0");
+    solver_symbol_assign (reference, "x0", 10);
+    for (int i=0; i<ARRAY_SIZE(expressions); i++) {
+        solver_expr_equals_zero (reference, expressions[i]);
+    }
+    solver_solve (reference, NULL);
+    check_same_solution (system, reference, "anchored difference graph matches a full factorization");
+    solver_destroy (reference);
+    solver_destroy (system);
+
+    struct linear_system_t _inconsistent = {};
+    system = &_inconsistent;
+    solver_symbol_get_or_create (system, "x0");
+    solver_symbol_assign (system, "x0", 10);
+    solver_expr_equals_zero (system, expressions[0]);
+    solver_solve (system, NULL);
+    solver_expr_equals_zero (system, expressions[1]);
+    solver_expr_equals_zero (system, expressions[2]);
+    solver_expr_equals_zero (system, "x3 - x1 - 25");
+
+    string_t err = {};
+    solver_solve (system, &err);
+    check (!system->success, "inconsistent anchors aren't solvable");
+    check (strstr (str_data(&err), "Overconstrained symbol 'x3'") != NULL, "the second anchor of x3 is blamed on it");
+    str_free (&err);
+    solver_destroy (system);
+}
+
+// Adds a row of n rectangles stretched between walls at 0 and 100*n, like the
+// row workload of solver_bench.c. The width of each rectangle is proportional
+// to the width of the first one. If chained, it's twice or half the width of
+// the previous one instead, like in the band workload, which keeps the matrix
+// banded.
+void stretched_row (struct linear_system_t *system, int n, bool chained)
+{
+    string_t expr = {0};
+    for (int i=0; i<n; i++) {
+        str_set_printf (&expr, "l%d + w%d - r%d", i, i, i);
+        solver_expr_equals_zero (system, str_data(&expr));
+        if (i > 0) {
+            str_set_printf (&expr, "r%d + 10 - l%d", i-1, i);
+            solver_expr_equals_zero (system, str_data(&expr));
+            if (chained) {
+                str_set_printf (&expr, "w%d - %g*w%d", i, i%2 ? 2 : 0.5, i-1);
+            } else {
+                str_set_printf (&expr, "w%d - %d*w0", i, 1 + i%4);
+            }
+            solver_expr_equals_zero (system, str_data(&expr));
+        }
+    }
+    solver_symbol_assign (system, "l0", 0);
+    str_set_printf (&expr, "r%d", n-1);
+    solver_symbol_assign (system, str_data(&expr), 100*n);
+    str_free (&expr);
+}
+
+// Adds a row of n rectangles starting at 0, each one is 10 to 40 wide plus a
+// share of the total width of the row. Every width depends on all the others,
+// so the matrix is dense.
+void shared_row (struct linear_system_t *system, int n)
+{
+    string_t expr = {0};
+    for (int i=0; i<n; i++) {
+        str_set_printf (&expr, "l%d + w%d - r%d", i, i, i);
+        solver_expr_equals_zero (system, str_data(&expr));
+        if (i > 0) {
+            str_set_printf (&expr, "r%d + 10 - l%d", i-1, i);
+            solver_expr_equals_zero (system, str_data(&expr));
+        }
+
+        str_set_printf (&expr, "w%d - %d", i, 10*(1 + i%4));
+        for (int j=0; j<n; j++) {
+            str_cat_printf (&expr, " - %g*w%d", 0.5/n, j);
+        }
+        solver_expr_equals_zero (system, str_data(&expr));
+    }
+    solver_symbol_assign (system, "l0", 0);
+    str_free (&expr);
+}
+
+// Solving with conjugate gradient must give the values sparse LU computes.
+void iterative_solver ()
+{
+    struct linear_system_t _system = {};
+    struct linear_system_t *system = &_system;
+    stretched_row (system, 50, false);
+    solver_set_iterative (system, true, 0, 0);
+
+    solver_solve (system, NULL);
+    struct solver_stats_t stats = solver_get_stats (system);
+    check (system->success, "iterative_solver is solvable");
+    check (stats.num_iterative_components == 1 && stats.num_unconverged_components == 0,
+           "the row is solved with conjugate gradient");
+    check_against_sparse_lu (system, "conjugate gradient matches sparse LU");
+
+    solver_destroy (system);
+}
+
+// A component that is dense enough is factored with dense LU, it must give the
+// values sparse LU computes.
+void dense_factorization ()
+{
+    struct linear_system_t _system = {};
+    struct linear_system_t *system = &_system;
+    system->num_threads = 1;
+    shared_row (system, 100);
+
+    solver_solve (system, NULL);
+    struct solver_stats_t stats = solver_get_stats (system);
+    check (system->success, "dense_factorization is solvable");
+    check (stats.num_dense_components == 1, "the row is factored with dense LU");
+    check_against_sparse_lu (system, "dense LU matches sparse LU");
+
+    solver_destroy (system);
+}
+
+// Components whose band is narrow after ordering are factored with banded LU,
+// it must give the values sparse LU computes.
+void banded_factorization ()
+{
+    struct linear_system_t _system = {};
+    struct linear_system_t *system = &_system;
+    stretched_row (system, 50, true);
+
+    solver_solve (system, NULL);
+    struct solver_stats_t stats = solver_get_stats (system);
+    check (system->success, "banded_factorization is solvable");
+    check (stats.num_banded_components == 1, "the row is factored with banded LU");
+    check_against_sparse_lu (system, "banded LU matches sparse LU");
+
+    solver_destroy (system);
+}
+
+// Trailing updates of large dense factorizations are split across threads.
+// Values must be exactly the same no matter how many threads are used.
+void parallel_dense_factorization ()
+{
+    struct linear_system_t _serial = {};
+    struct linear_system_t *serial = &_serial;
+    serial->num_threads = 1;
+    shared_row (serial, 200);
+    solver_solve (serial, NULL);
+
+    struct linear_system_t _system = {};
+    struct linear_system_t *system = &_system;
+    system->num_threads = 4;
+    shared_row (system, 200);
+    solver_solve (system, NULL);
+
+    struct solver_stats_t stats = solver_get_stats (system);
+    check (system->success, "parallel_dense_factorization is solvable");
+    check (stats.num_dense_components == 1 && system->thread_pool.workers != NULL,
+           "the row is factored with dense LU on the thread pool");
+    check (serial->last_id == system->last_id &&
+           memcmp (serial->value, system->value, system->last_id*sizeof(double)) == 0,
+           "parallel dense LU gives the same values as a single thread");
+    check_against_sparse_lu (system, "parallel dense LU matches sparse LU");
+
+    solver_destroy (serial);
+    solver_destroy (system);
+}
+
+// Whatever instruction set the vector kernels use, they must compute exactly
+// the same values as the scalar ones. Lengths cover the tails that don't fill
+// a whole register.
+void vector_kernels_match_scalar ()
+{
+    struct vector_kernels_t *kernels = vector_kernels_get ();
+    printf ("Vector kernels: %s\n", kernels->name);
+
+    int max_n = 67;
+    double *a = malloc (max_n*sizeof(double));
+    double *b = malloc (max_n*sizeof(double));
+    double *y = malloc (max_n*sizeof(double));
+    double *y_scalar = malloc (max_n*sizeof(double));
+
+    bool same = true;
+    for (int n=0; n<=max_n; n++) {
+        for (int i=0; i<n; i++) {
+            a[i] = sin (i + n) * 1e3;
+            b[i] = cos (3*i + n) / 7;
+        }
+
+        same &= kernels->dot (a, b, n) == vector_dot_scalar (a, b, n);
+        same &= kernels->max_abs (a, n) == vector_max_abs_scalar (a, n);
+
+        memcpy (y, b, n*sizeof(double));
+        memcpy (y_scalar, b, n*sizeof(double));
+        kernels->axpy (y, 0.3, a, n);
+        vector_axpy_scalar (y_scalar, 0.3, a, n);
+        same &= n == 0 || memcmp (y, y_scalar, n*sizeof(double)) == 0;
+
+        kernels->xpby (y, a, -1.7, n);
+        vector_xpby_scalar (y_scalar, a, -1.7, n);
+        same &= n == 0 || memcmp (y, y_scalar, n*sizeof(double)) == 0;
+
+        memcpy (b, a, n*sizeof(double));
+        kernels->swap (y, a, n);
+        vector_swap_scalar (y_scalar, b, n);
+        same &= n == 0 || (memcmp (y, y_scalar, n*sizeof(double)) == 0 && memcmp (a, b, n*sizeof(double)) == 0);
+    }
+    check (same, "vector kernels compute the same values as scalar ones");
+
+    free (a);
+    free (b);
+    free (y);
+    free (y_scalar);
+}
+
+struct count_task_t {
+    int work;
+    int count;
+};
+
+THREAD_POOL_TASK (count_task)
+{
+    struct count_task_t *count_task = (struct count_task_t*)data;
+
+    // Uneven work so idle workers steal from the others.
+    volatile int spin = 0;
+    for (int i=0; i<count_task->work; i++) spin++;
+
+    __atomic_add_fetch (&count_task->count, 1, __ATOMIC_RELAXED);
+}
+
+// Components are solved in batches on the thread pool. Batches grow from a
+// single task to many more than fit in the deques allocated by the previous
+// ones, every task must run exactly once.
+void thread_pool_batches ()
+{
+    struct thread_pool_t pool = {0};
+    thread_pool_init (&pool, 4);
+
+    int batch_sizes[] = {1, 3, 100, 5000, 7, 20000};
+    for (int b=0; b<ARRAY_SIZE(batch_sizes); b++) {
+        int num_tasks = batch_sizes[b];
+        struct count_task_t *counts = calloc (num_tasks, sizeof(struct count_task_t));
+        struct thread_pool_task_info_t *tasks = malloc (num_tasks*sizeof(struct thread_pool_task_info_t));
+        for (int i=0; i<num_tasks; i++) {
+            counts[i].work = (i%64)*100;
+            tasks[i].task = count_task;
+            tasks[i].data = &counts[i];
+        }
+        thread_pool_run (&pool, tasks, num_tasks);
+
+        bool all_once = true;
+        for (int i=0; i<num_tasks; i++) {
+            if (counts[i].count != 1) all_once = false;
+        }
+        check (all_once, "every task of a batch runs exactly once");
+
+        free (tasks);
+        free (counts);
+    }
+
+    thread_pool_destroy (&pool);
+}
+
 int main(int argc, char **argv)
 {
     linear_dependency ();
+    coefficients_and_constants ();
+    removed_expressions ();
+    compacted_system ();
+    inequalities ();
+    edit_symbols ();
+    incremental_expressions ();
+    difference_graph_cycle ();
+    difference_graph_anchored ();
+    thread_pool_batches ();
+    iterative_solver ();
+    vector_kernels_match_scalar ();
+    dense_factorization ();
+    parallel_dense_factorization ();
+    banded_factorization ();
+
+    if (num_failed_checks > 0) {
+        printf ("%d checks failed\n", num_failed_checks);
+        return 1;
+    }
+    return 0;
 }
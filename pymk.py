@@ -17,10 +17,13 @@ def default ():
     call_user_function(target)
 
 def layouter ():
-    ex ('gcc {C_FLAGS} -o bin/layouter layouter.c {GTK3_FLAGS} -lm')
+    ex ('gcc {C_FLAGS} -o bin/layouter layouter.c {GTK3_FLAGS} -lm -pthread')
 
 def linear_solver_tests ():
-    ex ('gcc {C_FLAGS} -o bin/linear_solver_tests linear_solver_tests.c -lm')
+    ex ('gcc {C_FLAGS} -o bin/linear_solver_tests linear_solver_tests.c -lm -pthread')
+
+def solver_bench ():
+    ex ('gcc {C_FLAGS} -o bin/solver_bench solver_bench.c -lm -pthread')
 
 if __name__ == "__main__":
     # Everything above this line will be executed for each TAB press.
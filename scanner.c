@@ -137,6 +137,94 @@ bool scanner_float (struct scanner_t *scnr, float *value)
     return false;
 }
 
+// Parses a decimal number like 12, 1.5 or 2.5e-3 without strtod(), which
+// depends on the current locale for the decimal separator and is slow for the
+// short numbers we usually parse. Returns the number of characters consumed, 0
+// if str doesn't start with a digit.
+//
+// Significands of up to 15 digits with exponents up to 22 are converted exactly
+// by a single multiplication or division by an exact power of 10. Longer or
+// more extreme numbers are computed in extended precision and may be off by
+// one ulp.
+size_t scan_decimal_double (const char *str, double *value)
+{
+    static const double exact_powers_of_10[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    const char *pos = str;
+    if (!isdigit (*pos)) {
+        return 0;
+    }
+
+    // Digits after the 19th don't fit in the significand, they are only
+    // counted to scale the result.
+    uint64_t significand = 0;
+    int num_digits = 0;
+    int exponent = 0;
+    while (isdigit (*pos)) {
+        if (num_digits < 19) {
+            significand = 10*significand + (*pos - '0');
+            if (significand != 0) num_digits++;
+        } else {
+            exponent++;
+        }
+        pos++;
+    }
+
+    if (*pos == '.') {
+        pos++;
+        while (isdigit (*pos)) {
+            if (num_digits < 19) {
+                significand = 10*significand + (*pos - '0');
+                if (significand != 0) num_digits++;
+                exponent--;
+            }
+            pos++;
+        }
+    }
+
+    // Only consume the exponent if it has digits, in '2e' or '2ex' the 'e' is
+    // something else.
+    if (*pos == 'e' || *pos == 'E') {
+        const char *exponent_pos = pos + 1;
+        int exponent_sign = 1;
+        if (*exponent_pos == '+' || *exponent_pos == '-') {
+            exponent_sign = *exponent_pos == '-' ? -1 : 1;
+            exponent_pos++;
+        }
+
+        if (isdigit (*exponent_pos)) {
+            int explicit_exponent = 0;
+            while (isdigit (*exponent_pos)) {
+                if (explicit_exponent < 100000) {
+                    explicit_exponent = 10*explicit_exponent + (*exponent_pos - '0');
+                }
+                exponent_pos++;
+            }
+            exponent += exponent_sign*explicit_exponent;
+            pos = exponent_pos;
+        }
+    }
+
+    if (significand == 0) {
+        *value = 0;
+
+    } else if (num_digits <= 15 && exponent >= -22 && exponent <= 22) {
+        if (exponent >= 0) {
+            *value = (double)significand * exact_powers_of_10[exponent];
+        } else {
+            *value = (double)significand / exact_powers_of_10[-exponent];
+        }
+
+    } else {
+        *value = (long double)significand * powl (10, exponent);
+    }
+
+    return pos - str;
+}
+
 bool scanner_double (struct scanner_t *scnr, double *value)
 {
     // TODO: Maybe allow value==NULL for the case when we want to consume
@@ -152,11 +240,21 @@ bool scanner_double (struct scanner_t *scnr, double *value)
         return false;
     }
 
-    char *end;
-    double res = strtod (scnr->pos, &end);
-    if (res != 0 || scnr->pos != end) {
-        *value = res;
-        scnr->pos = end;
+    // Hexadecimal floats are rare enough to leave them to strtod(), it only
+    // depends on the locale for the separator, which we don't expect to be
+    // anything different than '.' in them.
+    size_t len;
+    if (scnr->pos[0] == '0' && (scnr->pos[1] == 'x' || scnr->pos[1] == 'X')) {
+        char *end;
+        *value = strtod (scnr->pos, &end);
+        len = end - scnr->pos;
+
+    } else {
+        len = scan_decimal_double (scnr->pos, value);
+    }
+
+    if (len > 0) {
+        scnr->pos += len;
 
         if (*scnr->pos == '\0') {
             scanner_eof_set (scnr);
@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) 2020 Santiago León O.
+ */
+
+// Benchmark of the linear solver on synthetic layouts of N rectangles. Each
+// workload is built twice, once through symbol handles like the layout
+// functions do, and once from text with the equation syntax. Results are
+// printed as tab separated values, one row per workload and size, so runs can
+// be diffed or loaded in a spreadsheet to spot regressions.
+//
+// Usage:
+//  solver_bench [--max-n N] [--workload NAME] [--repeat R] [--threads T]
+//
+// Threads are used to solve independent components and to factor large dense
+// ones like in the shared workload. By default there is one per core, passing
+// 1 disables them.
+//
+// Setting SOLVER_KERNELS to scalar, sse2 or avx2 limits the instruction set of
+// the vector kernels, the row_iterative workload spends most of its time in
+// them.
+
+#define _GNU_SOURCE // Used to enable strcasestr()
+#define _XOPEN_SOURCE 700 // Required for strptime()
+#include "common.h"
+#include "binary_tree.c"
+#include "scanner.c"
+
+#include "linear_solver.c"
+#include "layout.c"
+
+// Distance between rectangles placed next to each other.
+#define BENCH_GAP 10
+
+// Number of rectangles of each tree in the forest workload.
+#define BENCH_FOREST_TREE_SIZE 16
+
+// Suggestions averaged to time dragging a fixed symbol.
+#define BENCH_NUM_SUGGESTIONS 100
+
+// Number of rectangles stretched between the walls of each row in the row
+// workload.
+#define BENCH_ROW_SIZE 128
+
+// Number of rectangles in the row of the shared workload, the rest are
+// chained below it.
+#define BENCH_SHARED_ROW_SIZE 256
+
+// Each rectangle is linked to the previous one by its top right corner, the
+// first one is fixed. A single component with a long dependency chain.
+void bench_chain (struct layout_t *layout, uint64_t n)
+{
+    uint64_t prev = layout_rectangle_size (layout, DVEC2(90, 20));
+    layout_fix (layout, prev, TK_MIN, DVEC2(0, 0));
+    for (uint64_t i=1; i<n; i++) {
+        uint64_t rectangle = layout_rectangle_size (layout, DVEC2(90, 20));
+        layout_link_d (layout, prev, TK_D, rectangle, TK_MIN, DVEC2(BENCH_GAP, 0));
+        prev = rectangle;
+    }
+}
+
+// Adds 'a.feature_a + gap - b.feature_b = 0' along a single axis.
+void bench_gap (struct layout_t *layout, enum axis_t axis,
+                uint64_t id_a, enum feature_identifier_t feature_a,
+                uint64_t id_b, enum feature_identifier_t feature_b,
+                double gap)
+{
+    struct linear_system_t *system = &layout->system;
+    solver_expr_begin (system);
+    solver_expr_add_term (system, layout_symbol (layout, id_a, feature_a, axis), 1);
+    solver_expr_add_term (system, layout_symbol (layout, id_b, feature_b, axis), -1);
+    solver_expr_add_constant (system, gap);
+    solver_expr_commit (system);
+}
+
+// Adds 'a.feature_a - ratio*b.feature_b = 0' along a single axis.
+void bench_ratio (struct layout_t *layout, enum axis_t axis,
+                  uint64_t id_a, enum feature_identifier_t feature_a,
+                  uint64_t id_b, enum feature_identifier_t feature_b,
+                  double ratio)
+{
+    struct linear_system_t *system = &layout->system;
+    solver_expr_begin (system);
+    solver_expr_add_term (system, layout_symbol (layout, id_a, feature_a, axis), 1);
+    solver_expr_add_term (system, layout_symbol (layout, id_b, feature_b, axis), -ratio);
+    solver_expr_commit (system);
+}
+
+// Rectangle with a fixed height placed at y, its width is left unknown.
+uint64_t bench_stretch_rectangle (struct layout_t *layout, double y)
+{
+    uint64_t id = layout->next_id;
+    layout->next_id++;
+
+    layout_sum (layout, TK_X, id, TK_MIN, id, TK_SIZE, id, TK_MAX);
+    layout_sum (layout, TK_Y, id, TK_MIN, id, TK_SIZE, id, TK_MAX);
+    solver_symbol_assign_handle (&layout->system, layout_symbol (layout, id, TK_SIZE, TK_Y), 20);
+    solver_symbol_assign_handle (&layout->system, layout_symbol (layout, id, TK_MIN, TK_Y), y);
+
+    return id;
+}
+
+// Square grid where the horizontal position of a rectangle depends on its
+// left neighbor and the vertical one on the neighbor above. Rows and columns
+// are all coupled so the system doesn't split into components.
+void bench_grid (struct layout_t *layout, uint64_t n)
+{
+    uint64_t side = MAX (1, (uint64_t)sqrt((double)n));
+    uint64_t *ids = malloc (side*side*sizeof(uint64_t));
+
+    for (uint64_t i=0; i<side; i++) {
+        for (uint64_t j=0; j<side; j++) {
+            uint64_t rectangle = layout_rectangle_size (layout, DVEC2(90, 20));
+            ids[i*side + j] = rectangle;
+
+            if (j > 0) {
+                bench_gap (layout, TK_X, ids[i*side + j-1], TK_MAX, rectangle, TK_MIN, BENCH_GAP);
+            } else if (i > 0) {
+                layout_equal (layout, TK_X, ids[(i-1)*side], TK_MIN, rectangle, TK_MIN);
+            }
+
+            if (i > 0) {
+                bench_gap (layout, TK_Y, ids[(i-1)*side + j], TK_MAX, rectangle, TK_MIN, BENCH_GAP);
+            } else if (j > 0) {
+                layout_equal (layout, TK_Y, ids[j-1], TK_MIN, rectangle, TK_MIN);
+            }
+        }
+    }
+    layout_fix (layout, ids[0], TK_MIN, DVEC2(0, 0));
+
+    free (ids);
+}
+
+// Binary tree of rectangles, each one linked to the bottom left corner of its
+// parent.
+void bench_tree (struct layout_t *layout, uint64_t n)
+{
+    uint64_t *ids = malloc (n*sizeof(uint64_t));
+    ids[0] = layout_rectangle_size (layout, DVEC2(90, 20));
+    layout_fix (layout, ids[0], TK_MIN, DVEC2(0, 0));
+    for (uint64_t i=1; i<n; i++) {
+        ids[i] = layout_rectangle_size (layout, DVEC2(90, 20));
+        layout_link_d (layout, ids[(i-1)/2], TK_B, ids[i], TK_MIN, DVEC2(i%2 ? 0 : 100, BENCH_GAP));
+    }
+    free (ids);
+}
+
+// Many small independent trees, this produces a large number of components.
+void bench_forest (struct layout_t *layout, uint64_t n)
+{
+    uint64_t root = 0;
+    for (uint64_t i=0; i<n; i++) {
+        uint64_t rectangle = layout_rectangle_size (layout, DVEC2(90, 20));
+        if (i%BENCH_FOREST_TREE_SIZE == 0) {
+            root = rectangle;
+            layout_fix (layout, root, TK_MIN, DVEC2(0, 100*(i/BENCH_FOREST_TREE_SIZE)));
+        } else {
+            layout_link_d (layout, root, TK_D, rectangle, TK_MIN, DVEC2(BENCH_GAP*(i%BENCH_FOREST_TREE_SIZE), 0));
+        }
+    }
+}
+
+// Rows of BENCH_ROW_SIZE rectangles stretched between two fixed walls, the
+// width of each one is proportional to the width of the first one in its row.
+// No equation has a single unknown, so presolve can't remove them and each row
+// is a component that has to be factored.
+void bench_row (struct layout_t *layout, uint64_t n)
+{
+    for (uint64_t i=0; i<n; i+=BENCH_ROW_SIZE) {
+        uint64_t row_size = MIN (BENCH_ROW_SIZE, n-i);
+        double y = 30*(i/BENCH_ROW_SIZE);
+
+        uint64_t first = bench_stretch_rectangle (layout, y);
+        solver_symbol_assign_handle (&layout->system, layout_symbol (layout, first, TK_MIN, TK_X), 0);
+
+        uint64_t prev = first;
+        for (uint64_t j=1; j<row_size; j++) {
+            uint64_t rectangle = bench_stretch_rectangle (layout, y);
+            bench_gap (layout, TK_X, prev, TK_MAX, rectangle, TK_MIN, BENCH_GAP);
+            bench_ratio (layout, TK_X, rectangle, TK_SIZE, first, TK_SIZE, 1 + j%4);
+            prev = rectangle;
+        }
+        solver_symbol_assign_handle (&layout->system, layout_symbol (layout, prev, TK_MAX, TK_X), 100*row_size);
+    }
+}
+
+// The row workload solved with conjugate gradient instead of sparse LU.
+void bench_row_iterative (struct layout_t *layout, uint64_t n)
+{
+    bench_row (layout, n);
+    solver_set_iterative (&layout->system, true, 0, 0);
+}
+
+// A single row of n rectangles stretched between two walls, each width is
+// twice or half the width of the previous one. Equations only couple
+// neighbors, so after ordering the matrix is banded and the row is factored
+// with banded LU however long it is.
+void bench_band (struct layout_t *layout, uint64_t n)
+{
+    uint64_t prev = bench_stretch_rectangle (layout, 0);
+    solver_symbol_assign_handle (&layout->system, layout_symbol (layout, prev, TK_MIN, TK_X), 0);
+    for (uint64_t i=1; i<n; i++) {
+        uint64_t rectangle = bench_stretch_rectangle (layout, 0);
+        bench_gap (layout, TK_X, prev, TK_MAX, rectangle, TK_MIN, BENCH_GAP);
+        bench_ratio (layout, TK_X, rectangle, TK_SIZE, prev, TK_SIZE, i%2 ? 2 : 0.5);
+        prev = rectangle;
+    }
+    solver_symbol_assign_handle (&layout->system, layout_symbol (layout, prev, TK_MAX, TK_X), 100*n);
+}
+
+// A row of rectangles where each width is a fixed amount plus a share of the
+// total width of the row, so every width depends on all others and the row is
+// factored with dense LU. Dense LU grows cubically, so only the first
+// BENCH_SHARED_ROW_SIZE rectangles go in the row and the rest are chained
+// below it like in the chain workload.
+void bench_shared (struct layout_t *layout, uint64_t n)
+{
+    struct linear_system_t *system = &layout->system;
+    uint64_t row_size = MAX (1, MIN (BENCH_SHARED_ROW_SIZE, n));
+    uint64_t *ids = malloc (row_size*sizeof(uint64_t));
+
+    for (uint64_t i=0; i<row_size; i++) {
+        ids[i] = bench_stretch_rectangle (layout, 0);
+        if (i > 0) {
+            bench_gap (layout, TK_X, ids[i-1], TK_MAX, ids[i], TK_MIN, BENCH_GAP);
+        }
+    }
+    solver_symbol_assign_handle (system, layout_symbol (layout, ids[0], TK_MIN, TK_X), 0);
+
+    for (uint64_t i=0; i<row_size; i++) {
+        solver_expr_begin (system);
+        solver_expr_add_term (system, layout_symbol (layout, ids[i], TK_SIZE, TK_X), 1);
+        for (uint64_t j=0; j<row_size; j++) {
+            solver_expr_add_term (system, layout_symbol (layout, ids[j], TK_SIZE, TK_X), -0.5/row_size);
+        }
+        solver_expr_add_constant (system, -10.0*(1 + i%4));
+        solver_expr_commit (system);
+    }
+
+    uint64_t prev = ids[0];
+    for (uint64_t i=row_size; i<n; i++) {
+        uint64_t rectangle = layout_rectangle_size (layout, DVEC2(90, 20));
+        layout_link_d (layout, prev, TK_B, rectangle, TK_MIN, DVEC2(0, BENCH_GAP));
+        prev = rectangle;
+    }
+
+    free (ids);
+}
+
+// The sample() layout of the layouter repeated until there are n rectangles.
+void bench_sample (struct layout_t *layout, uint64_t n)
+{
+    for (uint64_t i=0; i<n; i+=5) {
+        sample (layout, NULL, NULL);
+    }
+}
+
+// The mix_layout() layout of the layouter repeated until there are n
+// rectangles. The floating rectangles that are added with the equation syntax
+// in mix_layout() are added with handles here, so repetitions don't share
+// symbols.
+void bench_mix (struct layout_t *layout, uint64_t n)
+{
+    for (uint64_t i=0; i<n; i+=7) {
+        uint64_t rectangle_1, rectangle_2;
+        sample (layout, &rectangle_1, &rectangle_2);
+
+        uint64_t floating_1 = layout_rectangle_size (layout, DVEC2(90, 20));
+        uint64_t floating_2 = layout_rectangle_size (layout, DVEC2(90, 20));
+        layout_link_d (layout, floating_1, TK_B, floating_2, TK_MIN, DVEC2(10, 15));
+
+        // Align rectangle with left side of top left rectangle
+        layout_equal (layout, TK_X, rectangle_1, TK_MIN, floating_1, TK_MIN);
+
+        // Separate vertically rectangle from bottom left rectangle
+        uint64_t link = layout->next_id;
+        layout->next_id++;
+        layout_add_rectangle_anchor (layout, rectangle_2, TK_B);
+        layout_sum (layout, TK_Y, rectangle_2, TK_B, link, TK_D, floating_1, TK_MIN);
+        solver_symbol_assign_handle (&layout->system, layout_symbol (layout, link, TK_D, TK_Y), 15);
+    }
+}
+
+#define BENCH_WORKLOAD_TABLE              \
+    BENCH_WORKLOAD_ROW (chain)            \
+    BENCH_WORKLOAD_ROW (grid)             \
+    BENCH_WORKLOAD_ROW (tree)             \
+    BENCH_WORKLOAD_ROW (forest)           \
+    BENCH_WORKLOAD_ROW (sample)           \
+    BENCH_WORKLOAD_ROW (mix)              \
+    BENCH_WORKLOAD_ROW (row)              \
+    BENCH_WORKLOAD_ROW (row_iterative)    \
+    BENCH_WORKLOAD_ROW (band)             \
+    BENCH_WORKLOAD_ROW (shared)
+
+typedef void (bench_workload_t)(struct layout_t *layout, uint64_t n);
+
+#define BENCH_WORKLOAD_ROW(name) bench_ ## name,
+bench_workload_t *bench_workloads[] = {
+    BENCH_WORKLOAD_TABLE
+};
+#undef BENCH_WORKLOAD_ROW
+
+#define BENCH_WORKLOAD_ROW(name) #name,
+char *bench_workload_names[] = {
+    BENCH_WORKLOAD_TABLE
+};
+#undef BENCH_WORKLOAD_ROW
+
+struct bench_result_t {
+    uint64_t num_symbols;
+    uint64_t num_equations;
+
+    double build_ms;
+    double register_ms;
+    double parse_ms;
+    double resolve_ms;
+    double edit_ms;
+    double suggest_ms;
+
+    // Of the first solve, the one that factors the system.
+    struct solver_stats_t stats;
+
+    bool success;
+};
+
+void bench_run (bench_workload_t *workload, uint64_t n, int num_threads, struct bench_result_t *res)
+{
+    mem_pool_t pool = {0};
+    string_t error = {0};
+
+    // Build through handles.
+    struct layout_t layout = {0};
+    layout.system.num_threads = num_threads;
+    double start = wall_time_ms ();
+    workload (&layout, n);
+    res->build_ms = wall_time_ms () - start;
+
+    struct linear_system_t *system = &layout.system;
+    res->num_symbols = system_num_symbols (system);
+    res->num_equations = system_num_equations (system);
+
+    // Keep the text version of the system, it's used to time the parser.
+    char **names = mem_pool_push_array_aligned (&pool, res->num_symbols, char*);
+    double *assigned_values = mem_pool_push_array_aligned (&pool, res->num_symbols, double);
+    bool *is_assigned = mem_pool_push_array (&pool, res->num_symbols, bool);
+    for (uint64_t id=0; id<res->num_symbols; id++) {
+        names[id] = pom_strdup (&pool, solver_symbol_name (system, id));
+        is_assigned[id] = system->state[id] == SYMBOL_ASSIGNED;
+        assigned_values[id] = system->value[id];
+    }
+
+    char **equations = mem_pool_push_array_aligned (&pool, res->num_equations, char*);
+    string_t buffer = {0};
+    for (uint64_t i=0; i<res->num_equations; i++) {
+        str_set (&buffer, "");
+        str_cat_expression (&buffer, system, i);
+        equations[i] = pom_strdup (&pool, str_data(&buffer));
+    }
+    str_free (&buffer);
+
+    // The first solve computes components and factorizations, solving again
+    // after moving fixed symbols reuses them.
+    res->success = solver_solve (system, &error);
+    res->stats = solver_get_stats (system);
+
+    for (uint64_t id=0; id<res->num_symbols; id++) {
+        if (is_assigned[id]) {
+            solver_symbol_assign_handle (system, id, assigned_values[id] + 1);
+        }
+    }
+
+    res->success &= solver_solve (system, &error);
+    res->resolve_ms = solver_get_stats (system).total_ms;
+
+    // Drag the first fixed symbol like a rectangle moved with the mouse. The
+    // solve after marking it computes the symbols that depend on it.
+    for (uint64_t id=0; id<res->num_symbols; id++) {
+        if (is_assigned[id]) {
+            solver_symbol_edit (system, id, assigned_values[id]);
+            res->success &= solver_solve (system, &error);
+            res->edit_ms = solver_get_stats (system).total_ms;
+
+            start = wall_time_ms ();
+            for (int i=0; i<BENCH_NUM_SUGGESTIONS; i++) {
+                solver_symbol_suggest (system, id, assigned_values[id] + i);
+            }
+            res->suggest_ms = (wall_time_ms () - start)/BENCH_NUM_SUGGESTIONS;
+            break;
+        }
+    }
+
+    layout_destroy (&layout);
+
+    // Build from text. Symbols are registered first so parse time only
+    // measures the parser and name lookups.
+    struct linear_system_t text_system = {0};
+    text_system.num_threads = num_threads;
+    start = wall_time_ms ();
+    for (uint64_t id=0; id<res->num_symbols; id++) {
+        solver_symbol_get_or_create (&text_system, names[id]);
+    }
+    res->register_ms = wall_time_ms () - start;
+
+    start = wall_time_ms ();
+    for (uint64_t i=0; i<res->num_equations; i++) {
+        solver_expr_equals_zero (&text_system, equations[i]);
+    }
+    res->parse_ms = wall_time_ms () - start;
+
+    for (uint64_t id=0; id<res->num_symbols; id++) {
+        if (is_assigned[id]) {
+            solver_symbol_assign (&text_system, names[id], assigned_values[id]);
+        }
+    }
+    res->success &= solver_solve (&text_system, &error);
+
+    if (!res->success) {
+        fprintf (stderr, "%s", str_data(&error));
+    }
+
+    solver_destroy (&text_system);
+    str_free (&error);
+    mem_pool_destroy (&pool);
+}
+
+int main (int argc, char **argv)
+{
+    uint64_t max_n = 1000000;
+    char *workload_name = NULL;
+    int repeat = 1;
+    int num_threads = 0;
+
+    for (int i=1; i<argc; i++) {
+        if (strcmp (argv[i], "--max-n") == 0 && i+1 < argc) {
+            max_n = strtoull (argv[++i], NULL, 10);
+        } else if (strcmp (argv[i], "--workload") == 0 && i+1 < argc) {
+            workload_name = argv[++i];
+        } else if (strcmp (argv[i], "--repeat") == 0 && i+1 < argc) {
+            repeat = atoi (argv[++i]);
+            repeat = MAX (1, repeat);
+        } else if (strcmp (argv[i], "--threads") == 0 && i+1 < argc) {
+            num_threads = atoi (argv[++i]);
+            num_threads = MAX (0, num_threads);
+        } else {
+            fprintf (stderr, "Usage: %s [--max-n N] [--workload NAME] [--repeat R] [--threads T]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf ("workload\tn\tsymbols\tequations\tpresolved\tcomponents\tdifference_components\tdense_components\t"
+            "banded_components\titerative_components\titerations\tnonzeros\tflops\tpeak_temporary_bytes\t"
+            "build_ms\tregister_ms\tparse_ms\tsolve_ms\tpresolve_ms\tpartition_ms\tmatrix_build_ms\tfactorization_ms\t"
+            "substitution_ms\tcopy_back_ms\tresolve_ms\tedit_ms\tsuggest_ms\tsuccess\n");
+    for (int w=0; w<ARRAY_SIZE(bench_workloads); w++) {
+        if (workload_name != NULL && strcmp (workload_name, bench_workload_names[w]) != 0) {
+            continue;
+        }
+
+        for (uint64_t n=10; n<=max_n; n*=10) {
+            for (int r=0; r<repeat; r++) {
+                struct bench_result_t res = {0};
+                bench_run (bench_workloads[w], n, num_threads, &res);
+
+                struct solver_stats_t *stats = &res.stats;
+                printf ("%s\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%u\t%u\t%u\t%u\t%u\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t"
+                        "%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.4f\t%d\n",
+                        bench_workload_names[w], n, res.num_symbols, res.num_equations,
+                        stats->num_presolved, stats->num_components, stats->num_difference_components,
+                        stats->num_dense_components, stats->num_banded_components, stats->num_iterative_components,
+                        stats->num_iterations, stats->num_nonzeros, stats->num_flops, stats->peak_temporary_size,
+                        res.build_ms, res.register_ms, res.parse_ms, stats->total_ms, stats->presolve_ms, stats->partition_ms,
+                        stats->matrix_build_ms, stats->factorization_ms, stats->substitution_ms,
+                        stats->copy_back_ms, res.resolve_ms, res.edit_ms, res.suggest_ms, res.success);
+                fflush (stdout);
+            }
+        }
+    }
+
+    return 0;
+}